@@ -13,20 +13,288 @@ extern "C" {
 #include "ngx_dynamic_healthcheck_tcp.h"
 #include "ngx_dynamic_healthcheck_http.h"
 #include "ngx_dynamic_healthcheck_ssl.h"
+#include "ngx_dynamic_healthcheck_grpc.h"
+#include "ngx_dynamic_healthcheck_redis.h"
+#include "ngx_dynamic_healthcheck_tls.h"
+#include "ngx_dynamic_healthcheck_workers.h"
+#include "ngx_dynamic_healthcheck_alloc.h"
+#include "ngx_dynamic_healthcheck_snapshot.h"
+
+
+static ngx_array_t  *upstreams;
+
+
+/*
+ * Between the check rounds the refresh timer only renews the heartbeat
+ * of the worker. The upstreams are scanned when a round is due, an
+ * upstream is updated or the set of alive workers changes.
+ */
+
+typedef struct {
+    ngx_msec_t                     due;
+    ngx_atomic_uint_t              updated;
+    ngx_uint_t                     load;
+    ngx_uint_t                     nalive;
+    ngx_uint_t                     alive[NGX_MAX_PROCESSES];
+} ngx_dynamic_hc_refresh_t;
+
+static ngx_dynamic_hc_refresh_t  refresh;
+
+
+static ngx_int_t
+ngx_dynamic_healthcheck_cmp_weight(const void *one, const void *two)
+{
+    const ngx_dynamic_hc_assign_t  *a = (const ngx_dynamic_hc_assign_t *) one;
+    const ngx_dynamic_hc_assign_t  *b = (const ngx_dynamic_hc_assign_t *) two;
+
+    if (a->weight == b->weight)
+        return 0;
+
+    return a->weight > b->weight ? -1 : 1;
+}
+
+
+/*
+ * Every worker computes the same assignment from the shared weights
+ * and the shared table of alive workers: the heaviest upstream goes
+ * to the least loaded worker. Short disagreements while the inputs
+ * change are harmless - the round is claimed in the upstream zone
+ * (see claim_round()), two workers do not check one upstream at once.
+ */
+
+static void
+ngx_dynamic_healthcheck_balance(ngx_log_t *log)
+{
+    ngx_core_conf_t          *ccf;
+    ngx_time_t               *tp;
+    ngx_msec_t                now;
+    ngx_uint_t                alive[NGX_MAX_PROCESSES];
+    ngx_uint_t                load[NGX_MAX_PROCESSES];
+    ngx_uint_t                i, j, w, n;
+    ngx_dynamic_hc_assign_t  *u;
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(ngx_cycle->conf_ctx,
+                                           ngx_core_module);
+
+    ngx_time_update();
+
+    tp = ngx_timeofday();
+    now = tp->sec * 1000 + tp->msec;
+
+    upstreams->nelts = 0;
+
+    if (ngx_dynamic_healthcheck_api<ngx_http_upstream_main_conf_t,
+            ngx_http_upstream_srv_conf_t>::collect(upstreams) != NGX_OK
+        || ngx_dynamic_healthcheck_api<ngx_stream_upstream_main_conf_t,
+            ngx_stream_upstream_srv_conf_t>::collect(upstreams) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "healthcheck: no memory");
+        return;
+    }
+
+    u = (ngx_dynamic_hc_assign_t *) upstreams->elts;
+
+    n = ngx_dynamic_healthcheck_workers_alive(now, alive,
+                                              ccf->worker_processes);
+
+    refresh.nalive = n;
+    ngx_memcpy(refresh.alive, alive, n * sizeof(ngx_uint_t));
+
+    if (n == 0) {
+        for (i = 0; i < upstreams->nelts; i++)
+            u[i].conf->owner = i % ccf->worker_processes;
+        return;
+    }
+
+    ngx_sort(u, upstreams->nelts, sizeof(ngx_dynamic_hc_assign_t),
+             ngx_dynamic_healthcheck_cmp_weight);
+
+    ngx_memzero(load, n * sizeof(ngx_uint_t));
+
+    for (i = 0; i < upstreams->nelts; i++) {
+
+        for (w = 0, j = 1; j < n; j++)
+            if (load[j] < load[w])
+                w = j;
+
+        u[i].conf->owner = alive[w];
+        load[w] += u[i].weight;
+    }
+
+    for (j = 0; j < n; j++)
+        if (alive[j] == ngx_worker) {
+            refresh.load = load[j];
+            ngx_dynamic_healthcheck_workers_heartbeat(now, load[j]);
+        }
+}
+
+
+static ngx_flag_t
+ngx_dynamic_healthcheck_idle(ngx_msec_t now)
+{
+    ngx_core_conf_t  *ccf;
+    ngx_uint_t        alive[NGX_MAX_PROCESSES];
+    ngx_uint_t        n;
+
+    if (now >= refresh.due)
+        return 0;
+
+    if (ngx_dynamic_healthcheck_workers_updated() != refresh.updated)
+        return 0;
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(ngx_cycle->conf_ctx,
+                                           ngx_core_module);
+
+    n = ngx_dynamic_healthcheck_workers_alive(now, alive,
+                                              ccf->worker_processes);
+
+    if (n != refresh.nalive
+        || ngx_memcmp(alive, refresh.alive, n * sizeof(ngx_uint_t)) != 0)
+        return 0;
+
+    ngx_dynamic_healthcheck_workers_heartbeat(now, refresh.load);
+
+    return 1;
+}
 
 
 static void
 ngx_dynamic_healthcheck_refresh_timers(ngx_event_t *ev)
 {
-    ngx_dynamic_healthcheck_api<ngx_http_upstream_main_conf_t,
-        ngx_http_upstream_srv_conf_t>::refresh_timers(ev->log);
-    ngx_dynamic_healthcheck_api<ngx_stream_upstream_main_conf_t,
-        ngx_stream_upstream_srv_conf_t>::refresh_timers(ev->log);
+    ngx_msec_t   delay, stream_delay, now;
+    ngx_time_t  *tp;
+
+    ngx_time_update();
+
+    tp = ngx_timeofday();
+    now = tp->sec * 1000 + tp->msec;
+
+    if (!ngx_dynamic_healthcheck_idle(now)) {
+
+        // an update during the scan is seen by the next tick
+
+        refresh.updated = ngx_dynamic_healthcheck_workers_updated();
+
+        ngx_dynamic_healthcheck_balance(ev->log);
 
-    if (ngx_stopping())
+        delay = ngx_dynamic_healthcheck_api<ngx_http_upstream_main_conf_t,
+            ngx_http_upstream_srv_conf_t>::refresh_timers(ev->log);
+        stream_delay = ngx_dynamic_healthcheck_api<
+            ngx_stream_upstream_main_conf_t,
+            ngx_stream_upstream_srv_conf_t>::refresh_timers(ev->log);
+
+        refresh.due = now + ngx_min(delay, stream_delay);
+    }
+
+    if (ngx_stopping()) {
+        ngx_dynamic_healthcheck_workers_exit();
         return;
+    }
+
+    ngx_add_timer(ev, ngx_min(refresh.due - now,
+                              NGX_DYNAMIC_HC_WORKER_HEARTBEAT));
+}
+
+
+static ngx_int_t
+ngx_dynamic_healthcheck_hosts_compile(ngx_dynamic_healthcheck_conf_t *conf,
+    ngx_dynamic_healthcheck_opts_t *sh, ngx_pool_t *pool)
+{
+    ngx_dynamic_hc_hosts_t          *hosts = &conf->hosts;
+    ngx_str_array_t                 *disabled[3];
+    ngx_uint_t                       i, j, n;
+
+    disabled[0] = &sh->disabled_hosts_global;
+    disabled[1] = &sh->disabled_hosts;
+    disabled[2] = &sh->disabled_hosts_manual;
 
-    ngx_add_timer(ev, 1000);
+    for (n = 0, j = 0; j < 3; j++)
+        n += disabled[j]->len;
+
+    if (ngx_dynamic_healthcheck_host_set_init(&hosts->disabled, n, pool)
+            != NGX_OK)
+        return NGX_ERROR;
+
+    for (j = 0; j < 3; j++)
+        for (i = 0; i < disabled[j]->len; i++)
+            if (ngx_dynamic_healthcheck_host_set_add(&hosts->disabled,
+                    &disabled[j]->data[i], pool) != NGX_OK)
+                return NGX_ERROR;
+
+    if (ngx_dynamic_healthcheck_host_set_init(&hosts->excluded,
+            sh->excluded_hosts.len, pool) != NGX_OK)
+        return NGX_ERROR;
+
+    for (i = 0; i < sh->excluded_hosts.len; i++)
+        if (ngx_dynamic_healthcheck_host_set_add(&hosts->excluded,
+                &sh->excluded_hosts.data[i], pool) != NGX_OK)
+            return NGX_ERROR;
+
+    return NGX_OK;
+}
+
+
+/*
+ * returns NULL in the master process and on allocation errors,
+ * the lists are scanned under the lock in this case
+ */
+
+ngx_dynamic_hc_hosts_t *
+ngx_dynamic_healthcheck_hosts(ngx_dynamic_healthcheck_conf_t *conf)
+{
+    ngx_dynamic_hc_hosts_t          *hosts = &conf->hosts;
+    ngx_dynamic_healthcheck_opts_t  *sh;
+    ngx_pool_t                      *pool;
+
+    if (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE)
+        return NULL;
+
+    if (conf->shared == NULL)
+        return NULL;
+
+    if (hosts->compiled && hosts->generation == conf->shared->generation)
+        return hosts;
+
+    pool = ngx_create_pool(ngx_pagesize, ngx_cycle->log);
+    if (pool == NULL)
+        return NULL;
+
+    sh = ngx_dynamic_healthcheck_snapshot_read(conf->shared, pool);
+
+    if (sh == NULL
+        || ngx_dynamic_healthcheck_hosts_compile(conf, sh, pool) != NGX_OK) {
+        ngx_destroy_pool(pool);
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                      "[%V] %V: no memory for hosts",
+                      &conf->config.module, &conf->config.upstream);
+        return NULL;
+    }
+
+    hosts->generation = sh->generation;
+
+    if (hosts->pool != NULL)
+        ngx_destroy_pool(hosts->pool);
+
+    hosts->pool = pool;
+    hosts->compiled = 1;
+
+    return hosts;
+}
+
+
+/*
+ * The options are copied once per round into the round pool,
+ * probes send, receive and parse without the shared zone lock.
+ */
+
+static ngx_dynamic_healthcheck_opts_t *
+ngx_dynamic_healthcheck_snapshot(ngx_dynamic_healthcheck_event_t *event)
+{
+    event->pool = ngx_create_pool(ngx_pagesize, event->log);
+    if (event->pool == NULL)
+        return NULL;
+
+    return ngx_dynamic_healthcheck_snapshot_read(event->conf->shared,
+                                                 event->pool);
 }
 
 
@@ -44,6 +312,13 @@ ngx_dynamic_healthcheck_init_worker(ngx_cycle_t *cycle)
     if (event == NULL || dumb_conn == NULL)
         return NGX_ERROR;
 
+    upstreams = ngx_array_create(cycle->pool, 16,
+                                 sizeof(ngx_dynamic_hc_assign_t));
+    if (upstreams == NULL)
+        return NGX_ERROR;
+
+    ngx_dynamic_healthcheck_workers_init(cycle);
+
     dumb_conn->fd = -1;
 
     event->log = cycle->log;
@@ -59,76 +334,79 @@ ngx_dynamic_healthcheck_init_worker(ngx_cycle_t *cycle)
 template <class S, class PeersT, class PeerT> ngx_int_t
 do_check_private(S *uscf, ngx_dynamic_healthcheck_event_t *event)
 {
-    PeerT                         *peer;
-    PeersT                        *primary, *peers;
-    ngx_uint_t                     i;
-    void                          *addr;
-    ngx_dynamic_hc_state_node_t    state;
-    ngx_dynamic_healthcheck_peer  *p;
-    ngx_str_t                      type = event->conf->shared->type;
-    ngx_msec_t                     touched;
-    ngx_addr_t                     saddr;
-    ngx_pool_t                    *pool = NULL;
-    ngx_str_t                      sname, host;
-
-    ngx_str_null(&sname);
-    ngx_str_null(&host);
+    PeerT                           *peer;
+    PeersT                          *primary, *peers;
+    ngx_uint_t                       i;
+    void                            *addr;
+    size_t                           size;
+    ngx_dynamic_hc_state_node_t      state;
+    ngx_dynamic_healthcheck_peer    *p;
+    ngx_dynamic_healthcheck_opts_t  *opts;
+    ngx_str_t                        type;
+    ngx_msec_t                       touched;
+    ngx_core_conf_t                 *ccf;
+    ngx_uint_t                       shard = 0, nshards = 0;
+
+    opts = ngx_dynamic_healthcheck_snapshot(event);
+    if (opts == NULL) {
+        ngx_log_error(NGX_LOG_ERR, event->log, 0,
+                      "[%V] no memory", &event->conf->config.module);
+        return NGX_ERROR;
+    }
 
-    primary = (PeersT *) uscf->peer.data;
-    peers = primary;
+    event->opts = opts;
+    type = opts->type;
 
-    ngx_rwlock_rlock(&primary->rwlock);
+    if (opts->shard && ngx_process == NGX_PROCESS_WORKER) {
+
+        ccf = (ngx_core_conf_t *) ngx_get_conf(ngx_cycle->conf_ctx,
+                                               ngx_core_module);
 
-    if (event->conf->shared->port) {
+        nshards = ngx_dynamic_healthcheck_workers_shards(
+            event->conf->last, ccf->worker_processes, &shard);
+    }
 
-        pool = ngx_create_pool(1024, event->log);
-        if (pool == NULL)
-            goto nomem;
+    primary = (PeersT *) uscf->peer.data;
+    peers = primary;
 
-        sname.data = (u_char *) ngx_pcalloc(pool, 1024);
-        if (sname.data == NULL)
-            goto nomem;
+    ngx_rwlock_rlock(&primary->rwlock);
 
+    if (opts->port)
         ngx_log_debug3(NGX_LOG_DEBUG_HTTP, event->log, 0,
                        "[%V] %V: check port=%d",
-                       &event->conf->shared->module,
-                       &event->conf->shared->upstream,
-                       event->conf->shared->port);
-    }
+                       &opts->module, &opts->upstream, opts->port);
 
     touched = ngx_current_msec;
 
-    for (i = 0; peers && i < 2; peers = peers->next, i++) {
-
-        for (peer = peers->peer; peer; peer = peer->next) {
-
-            if (event->conf->shared->port) {
-
-                ngx_memzero(&saddr, sizeof(ngx_addr_t));
+    // outliers are found once per round for all peers
 
-                host = peer->name;
-                for (; host.len > 0 && host.data[host.len - 1] != ':';
-                       host.len--);
+    if ((opts->outlier || opts->outlier_errors) && shard == 0)
+        ngx_dynamic_healthcheck_state_outliers(&event->conf->peers,
+            opts->outlier, opts->outlier_errors, opts->outlier_ejection,
+            event->pool);
 
-                host.len--;
+    for (i = 0; peers && i < 2; peers = peers->next, i++) {
 
-                sname.len = ngx_snprintf(sname.data, 1024, "%V:%d", &host,
-                    event->conf->shared->port) - sname.data;
+        for (peer = peers->peer; peer; peer = peer->next) {
 
-                if (ngx_parse_addr_port(pool, &saddr, sname.data, sname.len)
-                        == NGX_ERROR)
-                    goto nomem;
-            } else {
+            // peer is checked by another worker, keep its state alive
 
-                saddr.sockaddr = peer->sockaddr;
-                saddr.socklen = peer->socklen;
-                saddr.name = peer->name;
+            if (nshards != 0
+                && (shard == nshards
+                    || ngx_dynamic_healthcheck_workers_shard(&peer->name,
+                           nshards) != shard)) {
+                ngx_dynamic_healthcheck_state_touch(&event->conf->peers,
+                                                    &peer->server,
+                                                    &peer->name);
+                continue;
             }
 
+            // address with 'port' is cached in the local node
+
             state = ngx_dynamic_healthcheck_state_get(&event->conf->peers,
                         &peer->server, &peer->name,
-                        saddr.sockaddr, saddr.socklen,
-                        event->conf->shared->buffer_size);
+                        peer->sockaddr, peer->socklen,
+                        opts->port, opts->buffer_size);
 
             if (state.local == NULL)
                 goto nomem;
@@ -136,28 +414,31 @@ do_check_private(S *uscf, ngx_dynamic_healthcheck_event_t *event)
             state.local->module = event->conf->config.module;
             state.local->upstream = event->conf->config.upstream;
 
-            state.shared->down = peer->down;
+            state.shared->stat->down = peer->down;
+            state.local->down = peer->down;
 
             if (type.len == 3 && ngx_memcmp(type.data, "tcp", 3) == 0)
-
-                addr = ngx_calloc(sizeof(ngx_dynamic_healthcheck_tcp<PeersT,
-                                                                     PeerT>),
-                                  event->log);
-
+                size = sizeof(ngx_dynamic_healthcheck_tcp<PeersT, PeerT>);
             else if (type.len == 4 && ngx_memcmp(type.data, "http", 4) == 0)
-
-                addr = ngx_calloc(sizeof(ngx_dynamic_healthcheck_http<PeersT,
-                                                                      PeerT>),
-                                  event->log);
-
+                size = sizeof(ngx_dynamic_healthcheck_http<PeersT, PeerT>);
             else if (type.len == 3 && ngx_memcmp(type.data, "ssl", 3) == 0)
-
-                addr = ngx_calloc(sizeof(ngx_dynamic_healthcheck_ssl<PeersT,
-                                                                     PeerT>),
-                                  event->log);
+                size = sizeof(ngx_dynamic_healthcheck_ssl<PeersT, PeerT>);
+            else if (type.len == 4 && ngx_memcmp(type.data, "grpc", 4) == 0)
+                size = sizeof(ngx_dynamic_healthcheck_grpc<PeersT, PeerT>);
+            else if (type.len == 5 && ngx_memcmp(type.data, "redis", 5) == 0)
+                size = sizeof(ngx_dynamic_healthcheck_redis<PeersT, PeerT>);
+#if (NGX_SSL)
+            else if (type.len == 3 && ngx_memcmp(type.data, "tls", 3) == 0)
+                size = sizeof(ngx_dynamic_healthcheck_tls<PeersT, PeerT>);
+            else if (type.len == 5 && ngx_memcmp(type.data, "https", 5) == 0)
+                size = sizeof(ngx_dynamic_healthcheck_https<PeersT, PeerT>);
+            else if (type.len == 5 && ngx_memcmp(type.data, "grpcs", 5) == 0)
+                size = sizeof(ngx_dynamic_healthcheck_grpcs<PeersT, PeerT>);
+#endif
             else
                 goto end;
 
+            addr = ngx_dynamic_healthcheck_calloc(size, event->log);
             if (addr == NULL)
                 goto nomem;
 
@@ -179,6 +460,38 @@ do_check_private(S *uscf, ngx_dynamic_healthcheck_event_t *event)
                     ngx_dynamic_healthcheck_ssl<PeersT, PeerT>(primary, event,
                         state);
 
+            else if (type.len == 4 && ngx_memcmp(type.data, "grpc", 4) == 0)
+
+                p = new (addr)
+                    ngx_dynamic_healthcheck_grpc<PeersT, PeerT>(primary, event,
+                        state);
+
+            else if (type.len == 5 && ngx_memcmp(type.data, "redis", 5) == 0)
+
+                p = new (addr)
+                    ngx_dynamic_healthcheck_redis<PeersT, PeerT>(primary, event,
+                        state);
+
+#if (NGX_SSL)
+            else if (type.len == 3 && ngx_memcmp(type.data, "tls", 3) == 0)
+
+                p = new (addr)
+                    ngx_dynamic_healthcheck_tls<PeersT, PeerT>(primary, event,
+                        state);
+
+            else if (type.len == 5 && ngx_memcmp(type.data, "https", 5) == 0)
+
+                p = new (addr)
+                    ngx_dynamic_healthcheck_https<PeersT, PeerT>(primary, event,
+                        state);
+
+            else if (type.len == 5 && ngx_memcmp(type.data, "grpcs", 5) == 0)
+
+                p = new (addr)
+                    ngx_dynamic_healthcheck_grpcs<PeersT, PeerT>(primary, event,
+                        state);
+#endif
+
             else
                 continue;
 
@@ -188,27 +501,24 @@ do_check_private(S *uscf, ngx_dynamic_healthcheck_event_t *event)
     }
 
     ngx_dynamic_healthcheck_state_gc(&event->conf->shared->state, touched);
+    ngx_dynamic_healthcheck_state_gc_local(&event->conf->peers.local, touched);
 
 end:
 
     ngx_rwlock_unlock(&primary->rwlock);
 
-    if (pool != NULL)
-        ngx_destroy_pool(pool);
-
     return NGX_OK;
 
 nomem:
 
     ngx_rwlock_unlock(&primary->rwlock);
 
-    if (pool != NULL)
-        ngx_destroy_pool(pool);
-
     ngx_log_error(NGX_LOG_ERR, event->log, 0,
                   "[%V] no memory", &event->conf->config.module);
 
-    return NGX_ERROR;
+    // started peers use the event and its pool, the round ends with them
+
+    return event->remains != 0 ? NGX_OK : NGX_ERROR;
 }
 
 
@@ -20,6 +20,9 @@ extern "C" {
 #endif
 
 #include "ngx_dynamic_healthcheck_state.h"
+#include "ngx_dynamic_healthcheck_regex.h"
+#include "ngx_dynamic_healthcheck_hosts.h"
+#include "ngx_dynamic_healthcheck_workers.h"
 
 #define NGX_DYNAMIC_UPDATE_OPT_TYPE                1
 #define NGX_DYNAMIC_UPDATE_OPT_FALL                2
@@ -62,6 +65,9 @@ struct ngx_num_array_s {
 typedef struct ngx_num_array_s ngx_num_array_t;
 
 
+typedef struct ngx_dynamic_healthcheck_snapshot_s ngx_dynamic_hc_snapshot_t;
+
+
 struct ngx_dynamic_healthcheck_opts_s {
     ngx_str_t                module;
     ngx_str_t                upstream;
@@ -88,8 +94,32 @@ struct ngx_dynamic_healthcheck_opts_s {
     ngx_msec_t               last;
     ngx_str_t                persistent;
     ngx_uint_t               updated;
+    ngx_uint_t               generation;
+    ngx_atomic_uint_t        seq;
+    ngx_atomic_t             round;
+    ngx_dynamic_hc_snapshot_t *snapshot;
     ngx_int_t                loaded;
     ngx_flag_t               passive;
+    ngx_msec_t               passive_window;
+    ngx_msec_t               passive_latency;
+    uint32_t                 passive_codes[4];
+    ngx_uint_t               outlier;
+    ngx_uint_t               outlier_errors;
+    ngx_msec_t               outlier_ejection;
+    ngx_flag_t               ssl_verify;
+    ngx_str_t                ssl_name;
+    ngx_str_t                ssl_trusted_certificate;
+    ngx_str_t                ssl_certificate;
+    ngx_str_t                ssl_certificate_key;
+    ngx_str_t                grpc_service;
+    ngx_str_t                redis_user;
+    ngx_str_t                redis_password;
+    ngx_uint_t               redis_role;
+    ngx_uint_t               splay;
+    ngx_uint_t               concurrency;
+    ngx_flag_t               shard;
+    ngx_uint_t               npeers;
+    ngx_msec_t               cost;
     ngx_dynamic_hc_shared_t  state;
     ngx_flag_t               flags;
 };
@@ -97,6 +127,35 @@ typedef struct ngx_dynamic_healthcheck_opts_s
 ngx_dynamic_healthcheck_opts_t;
 
 
+#define NGX_DYNAMIC_HC_REDIS_ANY      0
+#define NGX_DYNAMIC_HC_REDIS_MASTER   1
+#define NGX_DYNAMIC_HC_REDIS_REPLICA  2
+
+
+// 5xx codes counted as failures in passive mode, bit per code
+
+#define ngx_dynamic_healthcheck_passive_code(opts, code)                     \
+    ((code) >= 500 && (code) < 600                                          \
+     && ((opts)->passive_codes[((code) - 500) >> 5]                          \
+         & (1U << (((code) - 500) & 31))))
+
+
+/*
+ * Worker local http request rendered from the options, the parts
+ * depending on the peer are added by every probe.
+ */
+
+typedef struct {
+    ngx_uint_t                       generation;
+    unsigned                         rendered:1;
+    ngx_pool_t                      *pool;
+    ngx_str_t                        line;
+    ngx_str_t                        headers;
+    ngx_str_t                        host;
+    ngx_str_t                        tail;
+} ngx_dynamic_hc_request_t;
+
+
 struct ngx_dynamic_healthcheck_conf_s;
 
 
@@ -112,6 +171,14 @@ struct ngx_dynamic_healthcheck_conf_s {
     ngx_shm_zone_t                  *zone;
     ngx_shm_zone_post_init_pt        post_init;
     void                            *uscf;
+    ngx_dynamic_hc_regex_t           regex;
+    ngx_dynamic_hc_hosts_t           hosts;
+    ngx_dynamic_hc_request_t         request;
+    ngx_uint_t                       owner;
+    ngx_msec_t                       last;
+#if (NGX_SSL)
+    ngx_ssl_t                       *ssl;
+#endif
 };
 typedef struct ngx_dynamic_healthcheck_conf_s ngx_dynamic_healthcheck_conf_t;
 
@@ -122,6 +189,13 @@ ngx_dynamic_healthcheck_init_worker(ngx_cycle_t *cycle);
 
 struct ngx_dynamic_healthcheck_event_s;
 
+typedef struct {
+    ngx_str_t   server;
+    ngx_str_t   name;
+    ngx_flag_t  down;
+    ngx_flag_t  skip;
+} ngx_dynamic_hc_mark_t;
+
 typedef void (*ngx_dynamic_healthcheck_event_completed_pt)
     (struct ngx_dynamic_healthcheck_event_s *event);
 
@@ -134,6 +208,15 @@ struct ngx_dynamic_healthcheck_event_s {
     ngx_dynamic_healthcheck_conf_t              *conf;
     ngx_dynamic_healthcheck_event_completed_pt   completed;
     ngx_uint_t                                   updated;
+    ngx_uint_t                                   active;
+    ngx_queue_t                                  waiting;
+    ngx_uint_t                                   peers;
+    ngx_msec_t                                   cost;
+    ngx_dynamic_healthcheck_opts_t              *opts;
+    ngx_pool_t                                  *pool;
+    void                                        *primary;
+    ngx_array_t                                 *marks;
+    ngx_event_t                                  apply;
 };
 typedef struct ngx_dynamic_healthcheck_event_s ngx_dynamic_healthcheck_event_t;
 
@@ -144,6 +227,41 @@ ngx_stopping()
     return ngx_exiting || ngx_terminate || ngx_quit;
 }
 
+
+#define NGX_DYNAMIC_HEALTHCHECK_ROUND    5000
+
+
+/*
+ * interval is stored in milliseconds,
+ * delay between check rounds is capped by 'max'
+ */
+
+ngx_inline ngx_msec_t
+ngx_dynamic_healthcheck_period(ngx_dynamic_healthcheck_opts_t *opts,
+    ngx_msec_t max)
+{
+    if (opts->interval <= 0 || (ngx_msec_t) opts->interval > max)
+        return max;
+
+    return (ngx_msec_t) opts->interval;
+}
+
+
+/*
+ * interval is shown in seconds, fractional for subsecond values
+ */
+
+ngx_inline u_char *
+ngx_dynamic_healthcheck_print_interval(u_char *buf, u_char *last,
+    ngx_int_t interval)
+{
+    if (interval % 1000 == 0)
+        return ngx_slprintf(buf, last, "%i", interval / 1000);
+
+    return ngx_slprintf(buf, last, "%i.%03i", interval / 1000,
+                        interval % 1000);
+}
+
 #ifdef __cplusplus
 
 class scoped_slab_lock {
@@ -154,11 +272,11 @@ public:
     scoped_slab_lock(ngx_slab_pool_t *s)
         : slab(s)
     {
-        ngx_shmtx_lock(&slab->mutex);
+        ngx_dynamic_healthcheck_shmtx_lock(&slab->mutex);
     }
     ~scoped_slab_lock()
     {
-        ngx_shmtx_unlock(&slab->mutex);
+        ngx_dynamic_healthcheck_shmtx_unlock(&slab->mutex);
     }
 };
 
@@ -180,10 +298,19 @@ get_host(ngx_str_t *name)
 }
 
 
+ngx_dynamic_hc_hosts_t *
+ngx_dynamic_healthcheck_hosts(ngx_dynamic_healthcheck_conf_t *conf);
+
+
 ngx_inline ngx_flag_t
 ngx_peer_excluded(ngx_str_t *name,
     ngx_dynamic_healthcheck_conf_t *conf)
 {
+    ngx_dynamic_hc_hosts_t *hosts = ngx_dynamic_healthcheck_hosts(conf);
+
+    if (hosts != NULL)
+        return ngx_dynamic_healthcheck_host_set_match(&hosts->excluded, name);
+
     ngx_uint_t i;
     ngx_str_t  host = get_host(name);
 
@@ -208,9 +335,14 @@ ngx_inline ngx_flag_t
 ngx_peer_disabled(ngx_str_t *name,
     ngx_dynamic_healthcheck_conf_t *conf)
 {
+    ngx_dynamic_hc_hosts_t *hosts = ngx_dynamic_healthcheck_hosts(conf);
+
+    if (hosts != NULL)
+        return ngx_dynamic_healthcheck_host_set_match(&hosts->disabled, name);
+
     SCOPED_SLAB_LOCK(conf->peers.shared->slab);
 
-    ngx_str_array_t hosts[3] = {
+    ngx_str_array_t hosts_list[3] = {
         conf->shared->disabled_hosts_global,
         conf->shared->disabled_hosts,
         conf->shared->disabled_hosts_manual
@@ -218,13 +350,13 @@ ngx_peer_disabled(ngx_str_t *name,
     ngx_uint_t i, j;
     ngx_str_t  host = get_host(name);
 
-    for (j = 0; j < sizeof(hosts) / sizeof(hosts[1]); j++) {
-        for (i = 0; i < hosts[j].len; i++) {
-            if (ngx_memn2cmp(host.data, hosts[j].data[i].data,
-                             host.len, hosts[j].data[i].len) == 0)
+    for (j = 0; j < sizeof(hosts_list) / sizeof(hosts_list[1]); j++) {
+        for (i = 0; i < hosts_list[j].len; i++) {
+            if (ngx_memn2cmp(host.data, hosts_list[j].data[i].data,
+                             host.len, hosts_list[j].data[i].len) == 0)
                 return 1;
-            if (ngx_memn2cmp(name->data, hosts[j].data[i].data,
-                             name->len, hosts[j].data[i].len) == 0)
+            if (ngx_memn2cmp(name->data, hosts_list[j].data[i].data,
+                             name->len, hosts_list[j].data[i].len) == 0)
                 return 1;
         }
     }
@@ -269,19 +401,16 @@ public:
                 goto end;
 
             event->in_progress = 1;
-
-            goto timer;
         }
 
         if (event->remains == 0)
             goto end;
 
-timer:
+        // the last completed peer posts this event again
+
         ngx_log_debug2(NGX_LOG_DEBUG_HTTP, event->log, 0,
                        "[%V] remains=%d", &uscf->host, event->remains);
 
-        ngx_add_timer(ev, 1000);
-
         return;
 
 end:
@@ -289,10 +418,20 @@ end:
         ngx_log_debug2(NGX_LOG_DEBUG_HTTP, event->log, 0,
                        "[%V] remains=%d", &uscf->host, event->remains);
 
+        // results of the last peers are applied before the pool is gone
+
+        if (event->apply.posted) {
+            ngx_delete_posted_event(&event->apply);
+            event->apply.handler(&event->apply);
+        }
+
         event->completed(event);
 
         ngx_memzero(ev, sizeof(ngx_event_t));
 
+        if (event->pool != NULL)
+            ngx_destroy_pool(event->pool);
+
         ngx_free(event);
     }
 };
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+#include "ngx_dynamic_healthcheck_alloc.h"
+
+
+typedef struct {
+    size_t                         size;
+    ngx_queue_t                    free;
+} ngx_dynamic_hc_alloc_class_t;
+
+
+typedef struct {
+    ngx_queue_t                    queue;
+    ngx_dynamic_hc_alloc_class_t  *cls;
+} ngx_dynamic_hc_chunk_t;
+
+
+#define NGX_DYNAMIC_HC_CHUNK_SIZE  ngx_align(sizeof(ngx_dynamic_hc_chunk_t), 16)
+
+
+static ngx_dynamic_hc_alloc_class_t  classes[NGX_DYNAMIC_HC_ALLOC_CLASSES];
+static ngx_uint_t                    nclasses = 0;
+
+static ngx_dynamic_hc_alloc_stat_t   alloc_stat;
+
+
+static ngx_dynamic_hc_alloc_class_t *
+ngx_dynamic_healthcheck_alloc_class(size_t size)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; i < nclasses; i++)
+        if (classes[i].size == size)
+            return &classes[i];
+
+    if (nclasses == NGX_DYNAMIC_HC_ALLOC_CLASSES)
+        return NULL;
+
+    classes[nclasses].size = size;
+    ngx_queue_init(&classes[nclasses].free);
+
+    return &classes[nclasses++];
+}
+
+
+void *
+ngx_dynamic_healthcheck_alloc(size_t size, ngx_log_t *log)
+{
+    ngx_dynamic_hc_alloc_class_t  *cls;
+    ngx_dynamic_hc_chunk_t        *chunk;
+    ngx_queue_t                   *q;
+
+    cls = ngx_dynamic_healthcheck_alloc_class(size);
+
+    if (cls != NULL && !ngx_queue_empty(&cls->free)) {
+
+        q = ngx_queue_head(&cls->free);
+        ngx_queue_remove(q);
+
+        chunk = (ngx_dynamic_hc_chunk_t *) q;
+
+        alloc_stat.reused++;
+        alloc_stat.cached--;
+
+        goto done;
+    }
+
+    chunk = ngx_alloc(NGX_DYNAMIC_HC_CHUNK_SIZE + size, log);
+    if (chunk == NULL)
+        return NULL;
+
+    chunk->cls = cls;
+
+    alloc_stat.allocated++;
+
+done:
+
+    alloc_stat.used++;
+
+    return (u_char *) chunk + NGX_DYNAMIC_HC_CHUNK_SIZE;
+}
+
+
+void *
+ngx_dynamic_healthcheck_calloc(size_t size, ngx_log_t *log)
+{
+    void  *p;
+
+    p = ngx_dynamic_healthcheck_alloc(size, log);
+
+    if (p != NULL)
+        ngx_memzero(p, size);
+
+    return p;
+}
+
+
+void
+ngx_dynamic_healthcheck_free(void *p)
+{
+    ngx_dynamic_hc_chunk_t  *chunk;
+
+    if (p == NULL)
+        return;
+
+    chunk = (ngx_dynamic_hc_chunk_t *)
+        ((u_char *) p - NGX_DYNAMIC_HC_CHUNK_SIZE);
+
+    alloc_stat.used--;
+
+    if (chunk->cls == NULL) {
+        alloc_stat.freed++;
+        ngx_free(chunk);
+        return;
+    }
+
+    // most recently used chunk is reused first, it is still in cache
+
+    ngx_queue_insert_head(&chunk->cls->free, &chunk->queue);
+
+    alloc_stat.cached++;
+}
+
+
+void
+ngx_dynamic_healthcheck_alloc_stat(ngx_dynamic_hc_alloc_stat_t *s)
+{
+    *s = alloc_stat;
+}
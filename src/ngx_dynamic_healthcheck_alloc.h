@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+#ifndef NGX_DYNAMIC_HEALTHCHECK_ALLOC_H
+#define NGX_DYNAMIC_HEALTHCHECK_ALLOC_H
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include <ngx_core.h>
+
+
+/*
+ * Worker local free lists of check objects and buffers.
+ * Chunks are kept per exact size, a check round allocates
+ * the same few sizes, so after the first round probes are
+ * served from the lists without malloc/free.
+ */
+
+#define NGX_DYNAMIC_HC_ALLOC_CLASSES  16
+
+
+typedef struct {
+    ngx_uint_t                     allocated;
+    ngx_uint_t                     reused;
+    ngx_uint_t                     freed;
+    ngx_uint_t                     used;
+    ngx_uint_t                     cached;
+} ngx_dynamic_hc_alloc_stat_t;
+
+
+void *
+ngx_dynamic_healthcheck_alloc(size_t size, ngx_log_t *log);
+
+void *
+ngx_dynamic_healthcheck_calloc(size_t size, ngx_log_t *log);
+
+void
+ngx_dynamic_healthcheck_free(void *p);
+
+void
+ngx_dynamic_healthcheck_alloc_stat(ngx_dynamic_hc_alloc_stat_t *stat);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* NGX_DYNAMIC_HEALTHCHECK_ALLOC_H */
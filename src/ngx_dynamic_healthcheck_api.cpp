@@ -19,13 +19,19 @@ ngx_int_t
 ngx_dynamic_healthcheck_api_base::do_disable
     (ngx_dynamic_healthcheck_conf_t *conf, ngx_flag_t disable)
 {
+    SCOPED_SLAB_LOCK(conf->peers.shared->slab);
+
     if (conf->shared->disabled == disable)
         return NGX_DECLINED;
 
     conf->shared->disabled = disable;
     conf->shared->updated++;
+    conf->shared->generation++;
+    ngx_dynamic_healthcheck_workers_touch();
     conf->shared->flags |= NGX_DYNAMIC_UPDATE_OPT_DISABLED;
 
+    ngx_dynamic_healthcheck_snapshot_publish(conf->shared);
+
     ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0, "[%V] %V %s",
                   &conf->config.module, &conf->config.upstream,
                   disable ? "disable" : "enable");
@@ -62,6 +68,10 @@ ngx_dynamic_healthcheck_api_base::do_disable_host
             disabled_hosts->len--;
 
             conf->shared->updated++;
+            conf->shared->generation++;
+            ngx_dynamic_healthcheck_workers_touch();
+
+            ngx_dynamic_healthcheck_snapshot_publish(conf->shared);
 
             ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
                           "[%V] %V enable host: %V",
@@ -93,6 +103,10 @@ ngx_dynamic_healthcheck_api_base::do_disable_host
     disabled_hosts->len++;
 
     conf->shared->updated++;
+    conf->shared->generation++;
+    ngx_dynamic_healthcheck_workers_touch();
+
+    ngx_dynamic_healthcheck_snapshot_publish(conf->shared);
 
     ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
                   "[%V] %V disable host: %V",
@@ -161,6 +175,59 @@ ngx_dynamic_healthcheck_api_base::do_disable_host
 }
 
 
+/*
+ * Peers failed on the real traffic, the address is matched
+ * in all servers. Recovered by the active checks.
+ */
+
+template <class S, class PeersT, class PeerT> static void
+passive_down_private(S *uscf, ngx_str_t *name)
+{
+    PeersT      *primary, *peers;
+    PeerT       *peer;
+    ngx_uint_t   i;
+
+    primary = (PeersT *) uscf->peer.data;
+    peers = primary;
+
+    ngx_rwlock_rlock(&primary->rwlock);
+
+    for (i = 0; peers && i < 2; peers = peers->next, i++)
+        for (peer = peers->peer; peer; peer = peer->next) {
+            if (ngx_memn2cmp(peer->name.data, name->data,
+                             peer->name.len, name->len) == 0) {
+                ngx_rwlock_wlock(&peer->lock);
+                peer->down = 1;
+                ngx_rwlock_unlock(&peer->lock);
+            }
+        }
+
+    ngx_rwlock_unlock(&primary->rwlock);
+}
+
+
+void
+ngx_dynamic_healthcheck_api_base::passive_down
+    (ngx_http_upstream_srv_conf_t *uscf,
+     ngx_str_t *name)
+{
+    passive_down_private<ngx_http_upstream_srv_conf_t,
+                         ngx_http_upstream_rr_peers_t,
+                         ngx_http_upstream_rr_peer_t>(uscf, name);
+}
+
+
+void
+ngx_dynamic_healthcheck_api_base::passive_down
+    (ngx_stream_upstream_srv_conf_t *uscf,
+     ngx_str_t *name)
+{
+    passive_down_private<ngx_stream_upstream_srv_conf_t,
+                         ngx_stream_upstream_rr_peers_t,
+                         ngx_stream_upstream_rr_peer_t>(uscf, name);
+}
+
+
 ngx_int_t
 ngx_dynamic_healthcheck_api_base::do_update
     (ngx_dynamic_healthcheck_conf_t *conf,
@@ -235,8 +302,12 @@ ngx_dynamic_healthcheck_api_base::do_update
         conf->shared->request_headers = sh.request_headers;
 
     conf->shared->updated++;
+    conf->shared->generation++;
+    ngx_dynamic_healthcheck_workers_touch();
     conf->shared->flags |= flags;
 
+    ngx_dynamic_healthcheck_snapshot_publish(conf->shared);
+
     ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0, "[%V] %V update",
                   &conf->config.module, &conf->config.upstream);
 
@@ -263,21 +334,29 @@ ngx_dynamic_healthcheck_api_base::healthcheck_push(lua_State *L,
 {
     ngx_uint_t                      i;
     ngx_dynamic_healthcheck_opts_t *opts;
+    ngx_pool_t                     *pool;
 
     if (conf->shared == NULL) {
         lua_pushnil(L);
         return 1;
     }
 
-    opts = conf->shared;
+    pool = ngx_create_pool(ngx_pagesize, ngx_cycle->log);
+    if (pool == NULL)
+        return luaL_error(L, "no memory");
+
+    opts = ngx_dynamic_healthcheck_snapshot_read(conf->shared, pool);
+    if (opts == NULL) {
+        ngx_destroy_pool(pool);
+        return luaL_error(L, "no memory");
+    }
 
     if (opts->type.data == NULL) {
+        ngx_destroy_pool(pool);
         lua_pushnil(L);
         return 1;
     }
 
-    SCOPED_SLAB_LOCK(conf->peers.shared->slab);
-
     lua_newtable(L);
 
     lua_pushlstring(L, (char *) opts->type.data,
@@ -293,7 +372,7 @@ ngx_dynamic_healthcheck_api_base::healthcheck_push(lua_State *L,
     lua_pushinteger(L, opts->timeout);
     lua_setfield(L, -2, "timeout");
 
-    lua_pushinteger(L, opts->interval);
+    lua_pushnumber(L, opts->interval / 1000.);
     lua_setfield(L, -2, "interval");
 
     lua_pushinteger(L, opts->off);
@@ -403,6 +482,8 @@ ngx_dynamic_healthcheck_api_base::healthcheck_push(lua_State *L,
         lua_setfield(L, -2, "command");
     }
 
+    ngx_destroy_pool(pool);
+
     return 1;
 }
 
@@ -422,6 +503,21 @@ get_field_number(lua_State *L, int index, const char *field,
 }
 
 
+static ngx_int_t
+get_field_msec(lua_State *L, int index, const char *field,
+    ngx_flag_t *flags, ngx_flag_t flag)
+{
+    ngx_int_t  n = 0;
+    lua_getfield(L, index, field);
+    if (!lua_isnil(L, -1)) {
+        n = (ngx_int_t) (lua_tonumber(L, -1) * 1000);
+        *flags |= flag;
+    }
+    lua_pop(L, 1);
+    return n;
+}
+
+
 static ngx_str_t
 get_field_string(lua_State *L, int index, const char *field,
     ngx_flag_t *flags, ngx_flag_t flag)
@@ -510,8 +606,8 @@ ngx_dynamic_healthcheck_api_base::do_lua_update(lua_State *L,
                                       &flags, NGX_DYNAMIC_UPDATE_OPT_RISE);
     opts.timeout   = get_field_number(L, 2, "timeout",
                                       &flags, NGX_DYNAMIC_UPDATE_OPT_TIMEOUT);
-    opts.interval  = get_field_number(L, 2, "interval",
-                                      &flags, NGX_DYNAMIC_UPDATE_OPT_INTERVAL);
+    opts.interval  = get_field_msec(L, 2, "interval",
+                                    &flags, NGX_DYNAMIC_UPDATE_OPT_INTERVAL);
     opts.keepalive = get_field_number(L, 2, "keepalive",
                                       &flags, NGX_DYNAMIC_UPDATE_OPT_KEEPALIVE);
     opts.off       = get_field_number(L, 2, "off",
@@ -985,7 +1081,7 @@ ngx_dynamic_healthcheck_api_base::save(ngx_dynamic_healthcheck_conf_t *conf,
                                       "fall:%d"                   LF
                                       "rise:%d"                   LF
                                       "timeout:%d"                LF
-                                      "interval:%d"               LF
+                                      "interval:%dms"             LF
                                       "keepalive:%d"              LF
                                       "request_body:\"%V\""       LF
                                       "response_body:\"%V\""      LF
@@ -1156,7 +1252,7 @@ ngx_dynamic_healthcheck_api_base::parse(ngx_dynamic_healthcheck_conf_t *conf,
                    "fall:(\\d+)"                    LF
                    "rise:(\\d+)"                    LF
                    "timeout:(\\d+)"                 LF
-                   "interval:(\\d+)"                LF
+                   "interval:(\\d+(?:ms)?)"         LF
                    "keepalive:(\\d+)"               LF
                    "request_body:\"([^\"]*)\""      LF
                    "response_body:\"([^\"]*)\""     LF
@@ -1212,7 +1308,8 @@ ngx_dynamic_healthcheck_api_base::parse(ngx_dynamic_healthcheck_conf_t *conf,
     shared->fall = ngx_atoi(content->data + capt[4], capt[5] - capt[4]);
     shared->rise = ngx_atoi(content->data + capt[6], capt[7] - capt[6]);
     shared->timeout = ngx_atoi(content->data + capt[8], capt[9] - capt[8]);
-    shared->interval = ngx_atoi(content->data + capt[10], capt[11] - capt[10]);
+    shared->interval = ngx_parse_time(temp_str(content->data + capt[10],
+                                               capt[11] - capt[10], &temp), 0);
     shared->keepalive = ngx_atoi(content->data + capt[12], capt[13] - capt[12]);
 
     if (ngx_shm_str_copy(&shared->request_body,
@@ -1353,6 +1450,10 @@ ngx_dynamic_healthcheck_api_base::parse(ngx_dynamic_healthcheck_conf_t *conf,
                                slab) != NGX_OK)
         goto nomem;
 
+    shared->generation++;
+
+    ngx_dynamic_healthcheck_snapshot_publish(shared);
+
     return NGX_OK;
 
 nomem:
@@ -24,6 +24,7 @@ extern "C" {
 
 #include "ngx_dynamic_healthcheck.h"
 #include "ngx_dynamic_shm.h"
+#include "ngx_dynamic_healthcheck_snapshot.h"
 
 
 ngx_inline ngx_flag_t str_eq(ngx_str_t s1, ngx_str_t s2)
@@ -32,6 +33,12 @@ ngx_inline ngx_flag_t str_eq(ngx_str_t s1, ngx_str_t s2)
 }
 
 
+typedef struct {
+    ngx_dynamic_healthcheck_conf_t  *conf;
+    ngx_uint_t                       weight;
+} ngx_dynamic_hc_assign_t;
+
+
 class ngx_dynamic_healthcheck_api_base {
     static ngx_int_t
     parse(ngx_dynamic_healthcheck_conf_t *conf,
@@ -57,6 +64,12 @@ public:
     static ngx_int_t
     load(ngx_dynamic_healthcheck_conf_t *conf, ngx_log_t *log);
 
+    static void
+    passive_down(ngx_http_upstream_srv_conf_t *uscf, ngx_str_t *name);
+
+    static void
+    passive_down(ngx_stream_upstream_srv_conf_t *uscf, ngx_str_t *name);
+
 protected:
 
     static ngx_int_t
@@ -528,7 +541,58 @@ public:
 
 #endif
     
-    static void
+    /*
+     * collects upstreams with healthcheck and their weights
+     * for the assignment to workers:
+     * peers count plus seconds spent in probes in the last round;
+     * sharded upstreams are checked by all workers and not assigned
+     */
+
+    static ngx_int_t
+    collect(ngx_array_t *upstreams)
+    {
+        ngx_uint_t                        i;
+        M                                *umcf = NULL;
+        S                               **uscf;
+        ngx_dynamic_healthcheck_conf_t   *conf;
+        ngx_dynamic_hc_assign_t          *u;
+
+        umcf = get_upstream_conf(umcf);
+        if (umcf == NULL)
+            return NGX_OK;
+
+        uscf = (S **) umcf->upstreams.elts;
+
+        for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+            if (uscf[i]->shm_zone == NULL)
+                continue;
+
+            conf = get_srv_conf(uscf[i]);
+
+            if (conf == NULL || conf->shared == NULL)
+                continue;
+
+            if (conf->shared->type.len == 0 || conf->shared->shard)
+                continue;
+
+            u = (ngx_dynamic_hc_assign_t *) ngx_array_push(upstreams);
+            if (u == NULL)
+                return NGX_ERROR;
+
+            u->conf = conf;
+            u->weight = 1 + conf->shared->npeers + conf->shared->cost / 1000;
+        }
+
+        return NGX_OK;
+    }
+
+    /*
+     * returns the delay until the nearest check round of
+     * the upstreams owned by this worker
+     */
+
+    static ngx_msec_t
     refresh_timers(ngx_log_t *log = ngx_cycle->log)
     {
         ngx_uint_t                        i;
@@ -536,17 +600,17 @@ public:
         S                               **uscf;
         ngx_dynamic_healthcheck_conf_t   *conf;
         ngx_dynamic_healthcheck_event_t  *event;
-        ngx_msec_t                        now;
+        ngx_msec_t                        now, period, delay;
+        ngx_msec_t                       *last;
         ngx_time_t                       *tp;
-        ngx_core_conf_t                  *ccf;
         ngx_flag_t                        persistent;
+        ngx_flag_t                        owner;
 
-        ccf = (ngx_core_conf_t *) ngx_get_conf(ngx_cycle->conf_ctx,
-                                               ngx_core_module);
+        delay = NGX_DYNAMIC_HEALTHCHECK_ROUND;
 
         umcf = get_upstream_conf(umcf);
         if (umcf == NULL)
-            return;
+            return delay;
 
         uscf = (S **) umcf->upstreams.elts;
 
@@ -558,10 +622,6 @@ public:
         
         for (i = 0; i < umcf->upstreams.nelts; i++) {
 
-            if (ngx_process == NGX_PROCESS_WORKER
-                && i % ccf->worker_processes != ngx_worker)
-                continue;
-
             if (uscf[i]->shm_zone == NULL)
                 continue;
 
@@ -573,18 +633,42 @@ public:
             if (conf->shared == NULL)
                 continue;
 
-            ngx_shmtx_lock(&conf->shared->state.slab->mutex);
+            // a round started before the ownership change is finished
+
+            owner = ngx_process != NGX_PROCESS_WORKER
+                    || conf->owner == ngx_worker
+                    || conf->shared->shard;
+
+            if (!owner && conf->event.data == NULL)
+                continue;
+
+            ngx_dynamic_healthcheck_shmtx_lock(
+                &conf->shared->state.slab->mutex);
 
             if (conf->shared->type.len == 0)
                 goto next;
 
+            period = ngx_dynamic_healthcheck_period(conf->shared,
+                                                NGX_DYNAMIC_HEALTHCHECK_ROUND);
+
+            // each worker runs own rounds over its shard of peers
+
+            last = conf->shared->shard ? &conf->last : &conf->shared->last;
+
             if (conf->event.data != NULL) {
-                conf->shared->last = now;
+                *last = now;
+                goto due;
+            }
+
+            if (!owner)
+                goto next;
+
+            if (!conf->shared->updated && *last + period > now) {
+                delay = ngx_min(delay, *last + period - now);
                 goto next;
             }
 
-            if (!conf->shared->updated
-                && conf->shared->last + 5000 > now)
+            if (!conf->shared->shard && !claim_round(conf->shared, now))
                 goto next;
 
             persistent = conf->config.persistent.len != 0 &&
@@ -597,6 +681,7 @@ public:
                                "[%V] %V healthcheck off",
                                &conf->shared->module,
                                &conf->shared->upstream);
+                release_round(conf->shared);
                 goto next;
             }
 
@@ -605,13 +690,16 @@ public:
             event = (ngx_dynamic_healthcheck_event_t *)
                 ngx_calloc(sizeof(ngx_dynamic_healthcheck_event_t), log);
             if (event == NULL) {
-                ngx_shmtx_unlock(&conf->shared->state.slab->mutex);
+                release_round(conf->shared);
+                ngx_dynamic_healthcheck_shmtx_unlock(
+                    &conf->shared->state.slab->mutex);
                 ngx_log_error(NGX_LOG_ERR, log, 0, "healthcheck: no memory");
-                return;
+                return delay;
             }
 
             event->dumb_conn.fd = -1;
             event->uscf = (void *) uscf[i];
+            ngx_queue_init(&event->waiting);
             event->conf = conf;
             event->completed = &ngx_dynamic_healthcheck_api<M, S>::on_completed;
             event->updated = conf->shared->updated;
@@ -620,22 +708,73 @@ public:
             conf->event.data = (void *) event;
             conf->event.handler = &ngx_dynamic_event_handler<S>::check;
 
-            conf->shared->last = now;
+            *last = now;
 
             ngx_add_timer(&conf->event, 0);
 
+due:
+
+            delay = ngx_min(delay, period);
+
 next:
 
-            ngx_shmtx_unlock(&conf->shared->state.slab->mutex);
+            ngx_dynamic_healthcheck_shmtx_unlock(
+                &conf->shared->state.slab->mutex);
         }
+
+        return delay;
     }
 
 private:
 
+    /*
+     * Only one worker at a time runs the round of an upstream which
+     * is not sharded: the owners computed by the workers may disagree
+     * for a while, e.g. on start each worker sees only itself alive.
+     * The claim of a dead worker is taken over.
+     * Called under the upstream zone mutex.
+     */
+
+    static ngx_flag_t
+    claim_round(ngx_dynamic_healthcheck_opts_t *shared, ngx_msec_t now)
+    {
+        ngx_atomic_uint_t  pid = shared->round;
+
+        if (pid == (ngx_atomic_uint_t) ngx_pid)
+            return 1;
+
+        if (pid != 0
+            && ngx_dynamic_healthcheck_workers_pid_alive((ngx_pid_t) pid, now))
+            return 0;
+
+        return ngx_atomic_cmp_set(&shared->round, pid,
+                                  (ngx_atomic_uint_t) ngx_pid);
+    }
+
+    static void
+    release_round(ngx_dynamic_healthcheck_opts_t *shared)
+    {
+        (void) ngx_atomic_cmp_set(&shared->round, (ngx_atomic_uint_t) ngx_pid,
+                                  0);
+    }
+
     static void
     on_completed(ngx_dynamic_healthcheck_event_t *event)
     {
-        ngx_shmtx_lock(&event->conf->shared->state.slab->mutex);
+        ngx_time_t  *tp = ngx_timeofday();
+
+        ngx_dynamic_healthcheck_shmtx_lock(
+            &event->conf->shared->state.slab->mutex);
+
+        if (event->conf->shared->shard)
+            event->conf->last = tp->sec * 1000 + tp->msec;
+        else
+            event->conf->shared->last = tp->sec * 1000 + tp->msec;
+
+        event->conf->shared->npeers = event->peers;
+        event->conf->shared->cost = event->cost;
+
+        release_round(event->conf->shared);
 
         if (event->conf->config.persistent.len != 0
             && ngx_strcmp(event->conf->config.persistent.data, "off") != 0)
@@ -643,7 +782,8 @@ private:
         else if (event->updated == event->conf->shared->updated)
             event->conf->shared->updated = 0;
 
-        ngx_shmtx_unlock(&event->conf->shared->state.slab->mutex);
+        ngx_dynamic_healthcheck_shmtx_unlock(
+            &event->conf->shared->state.slab->mutex);
     }
 };
 
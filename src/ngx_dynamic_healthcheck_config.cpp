@@ -21,6 +21,32 @@ ngx_is_arg(const char *n, ngx_str_t arg)
 }
 
 
+static ngx_int_t
+ngx_dynamic_healthcheck_passive_codes(ngx_dynamic_healthcheck_opts_t *opts,
+    u_char *s, size_t len)
+{
+    u_char     *last = s + len, *c;
+    ngx_int_t   code;
+
+    while (s < last) {
+        c = ngx_strlchr(s, last, ',');
+        if (c == NULL)
+            c = last;
+
+        code = ngx_atoi(s, c - s);
+        if (code < 500 || code > 599)
+            return NGX_ERROR;
+
+        code -= 500;
+        opts->passive_codes[code >> 5] |= 1U << (code & 31);
+
+        s = c + 1;
+    }
+
+    return NGX_OK;
+}
+
+
 char *
 ngx_dynamic_healthcheck_check(ngx_conf_t *cf, ngx_command_t *cmd,
     void *p)
@@ -28,7 +54,7 @@ ngx_dynamic_healthcheck_check(ngx_conf_t *cf, ngx_command_t *cmd,
     ngx_str_t *value;
     ngx_dynamic_healthcheck_conf_t *conf;
     ngx_uint_t i;
-    ngx_str_t arg, type;
+    ngx_str_t arg, type, tmp;
 
     conf = (ngx_dynamic_healthcheck_conf_t *) p;
 
@@ -43,7 +69,12 @@ ngx_dynamic_healthcheck_check(ngx_conf_t *cf, ngx_command_t *cmd,
 
             if (ngx_strncmp("http", type.data, type.len) != 0
                 && ngx_strncmp("tcp", type.data, type.len) != 0
-                && ngx_strncmp("ssl", type.data, type.len) != 0)
+                && ngx_strncmp("ssl", type.data, type.len) != 0
+                && ngx_strncmp("tls", type.data, type.len) != 0
+                && ngx_strncmp("https", type.data, type.len) != 0
+                && ngx_strncmp("grpc", type.data, type.len) != 0
+                && ngx_strncmp("grpcs", type.data, type.len) != 0
+                && ngx_strncmp("redis", type.data, type.len) != 0)
                 goto fail;
 
             conf->config.type = type;
@@ -79,16 +110,18 @@ ngx_dynamic_healthcheck_check(ngx_conf_t *cf, ngx_command_t *cmd,
         }
 
         if (ngx_is_arg("interval=", arg)) {
-            conf->config.interval = ngx_atoi(arg.data + 9, arg.len - 9);
+            tmp.data = arg.data + 9;
+            tmp.len = arg.len - 9;
+
+            conf->config.interval = ngx_parse_time(&tmp, 0);
 
-            if (conf->config.interval < 0)
+            if (conf->config.interval == NGX_ERROR)
                 goto fail;
 
             continue;
         }
 
-        if (ngx_is_arg("keepalive=", arg) &&
-            conf->config.module.data == NGX_DH_MODULE_HTTP.data) {
+        if (ngx_is_arg("keepalive=", arg)) {
             conf->config.keepalive = ngx_atoi(arg.data + 10, arg.len - 10);
 
             if (conf->config.keepalive == 0)
@@ -97,6 +130,31 @@ ngx_dynamic_healthcheck_check(ngx_conf_t *cf, ngx_command_t *cmd,
             continue;
         }
 
+        if (ngx_is_arg("splay=", arg)) {
+            tmp.data = arg.data + 6;
+            tmp.len = arg.len - 6;
+
+            if (tmp.len != 0 && tmp.data[tmp.len - 1] == '%')
+                tmp.len--;
+
+            conf->config.splay = ngx_atoi(tmp.data, tmp.len);
+
+            if (conf->config.splay == (ngx_uint_t) NGX_ERROR
+                || conf->config.splay > 100)
+                goto fail;
+
+            continue;
+        }
+
+        if (ngx_is_arg("concurrency=", arg)) {
+            conf->config.concurrency = ngx_atoi(arg.data + 12, arg.len - 12);
+
+            if (conf->config.concurrency == (ngx_uint_t) NGX_ERROR)
+                goto fail;
+
+            continue;
+        }
+
         if (ngx_is_arg("port=", arg)) {
             conf->config.port = ngx_atoi(arg.data + 5, arg.len - 5);
 
@@ -111,10 +169,139 @@ ngx_dynamic_healthcheck_check(ngx_conf_t *cf, ngx_command_t *cmd,
             continue;
         }
 
+        if (ngx_is_arg("passive_window=", arg)) {
+            tmp.data = arg.data + 15;
+            tmp.len = arg.len - 15;
+
+            conf->config.passive_window = ngx_parse_time(&tmp, 0);
+
+            if (conf->config.passive_window == (ngx_msec_t) NGX_ERROR
+                || conf->config.passive_window == 0)
+                goto fail;
+
+            continue;
+        }
+
+        if (ngx_is_arg("passive_latency=", arg)) {
+            tmp.data = arg.data + 16;
+            tmp.len = arg.len - 16;
+
+            conf->config.passive_latency = ngx_parse_time(&tmp, 0);
+
+            if (conf->config.passive_latency == (ngx_msec_t) NGX_ERROR)
+                goto fail;
+
+            continue;
+        }
+
+        if (ngx_is_arg("passive_codes=", arg)) {
+            if (ngx_dynamic_healthcheck_passive_codes(&conf->config,
+                    arg.data + 14, arg.len - 14) != NGX_OK)
+                goto fail;
+
+            continue;
+        }
+
+        if (ngx_is_arg("outlier=", arg)) {
+            conf->config.outlier = ngx_atoi(arg.data + 8, arg.len - 8);
+
+            if (conf->config.outlier == (ngx_uint_t) NGX_ERROR
+                || conf->config.outlier < 2)
+                goto fail;
+
+            continue;
+        }
+
+        if (ngx_is_arg("outlier_errors=", arg)) {
+            tmp.data = arg.data + 15;
+            tmp.len = arg.len - 15;
+
+            if (tmp.len != 0 && tmp.data[tmp.len - 1] == '%')
+                tmp.len--;
+
+            conf->config.outlier_errors = ngx_atoi(tmp.data, tmp.len);
+
+            if (conf->config.outlier_errors == (ngx_uint_t) NGX_ERROR
+                || conf->config.outlier_errors == 0
+                || conf->config.outlier_errors > 100)
+                goto fail;
+
+            continue;
+        }
+
+        if (ngx_is_arg("outlier_ejection=", arg)) {
+            tmp.data = arg.data + 17;
+            tmp.len = arg.len - 17;
+
+            conf->config.outlier_ejection = ngx_parse_time(&tmp, 0);
+
+            if (conf->config.outlier_ejection == (ngx_msec_t) NGX_ERROR
+                || conf->config.outlier_ejection == 0)
+                goto fail;
+
+            continue;
+        }
+
+        if (ngx_is_arg("ssl_name=", arg)) {
+            conf->config.ssl_name.data = arg.data + 9;
+            conf->config.ssl_name.len = arg.len - 9;
+            continue;
+        }
+
+        if (ngx_is_arg("grpc_service=", arg)) {
+            conf->config.grpc_service.data = arg.data + 13;
+            conf->config.grpc_service.len = arg.len - 13;
+
+            // the request message goes in one DATA frame of 16384 bytes
+
+            if (conf->config.grpc_service.len > 16375)
+                goto fail;
+
+            continue;
+        }
+
+        if (ngx_is_arg("redis_user=", arg)) {
+            conf->config.redis_user.data = arg.data + 11;
+            conf->config.redis_user.len = arg.len - 11;
+            continue;
+        }
+
+        if (ngx_is_arg("redis_password=", arg)) {
+            conf->config.redis_password.data = arg.data + 15;
+            conf->config.redis_password.len = arg.len - 15;
+            continue;
+        }
+
+        if (ngx_is_arg("redis_role=", arg)) {
+            tmp.data = arg.data + 11;
+            tmp.len = arg.len - 11;
+
+            if (tmp.len == 3 && ngx_strncmp(tmp.data, "any", 3) == 0)
+                conf->config.redis_role = NGX_DYNAMIC_HC_REDIS_ANY;
+            else if (tmp.len == 6 && ngx_strncmp(tmp.data, "master", 6) == 0)
+                conf->config.redis_role = NGX_DYNAMIC_HC_REDIS_MASTER;
+            else if (tmp.len == 7 && ngx_strncmp(tmp.data, "replica", 7) == 0)
+                conf->config.redis_role = NGX_DYNAMIC_HC_REDIS_REPLICA;
+            else
+                goto fail;
+
+            continue;
+        }
+
+        if (ngx_strcmp(arg.data, "ssl_verify") == 0) {
+            conf->config.ssl_verify = 1;
+            continue;
+        }
+
         if (ngx_strcmp(arg.data, "passive") == 0) {
             conf->config.passive = 1;
             continue;
         }
+
+        if (ngx_strcmp(arg.data, "shard") == 0) {
+            conf->config.shard = 1;
+            continue;
+        }
     }
 
     if (conf->config.type.len == 0) {
@@ -273,4 +460,147 @@ ngx_conf_set_str_array_slot2(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 
     return (char *) NGX_CONF_OK;
-}
\ No newline at end of file
+}
+
+
+void
+ngx_dynamic_healthcheck_merge_passive(ngx_dynamic_healthcheck_opts_t *conf,
+    ngx_dynamic_healthcheck_opts_t *prev)
+{
+    static u_char  codes[] = "502,503,504";
+
+    ngx_conf_merge_msec_value(conf->passive_window,
+        prev->passive_window, 10000);
+    ngx_conf_merge_msec_value(conf->passive_latency,
+        prev->passive_latency, 0);
+
+    ngx_conf_merge_uint_value(conf->outlier, prev->outlier, 0);
+    ngx_conf_merge_uint_value(conf->outlier_errors, prev->outlier_errors, 0);
+    ngx_conf_merge_msec_value(conf->outlier_ejection,
+        prev->outlier_ejection, 30000);
+
+    if (conf->passive_codes[0] || conf->passive_codes[1]
+        || conf->passive_codes[2] || conf->passive_codes[3])
+        return;
+
+    ngx_memcpy(conf->passive_codes, prev->passive_codes,
+               sizeof(conf->passive_codes));
+
+    if (conf->passive_codes[0] || conf->passive_codes[1]
+        || conf->passive_codes[2] || conf->passive_codes[3])
+        return;
+
+    ngx_dynamic_healthcheck_passive_codes(conf, codes, sizeof(codes) - 1);
+}
+
+
+#if !(NGX_SSL)
+
+static ngx_flag_t
+ngx_dynamic_healthcheck_tls_type(ngx_str_t *type)
+{
+    return (type->len == 3 && ngx_strncmp(type->data, "tls", 3) == 0)
+        || (type->len == 5 && ngx_strncmp(type->data, "https", 5) == 0)
+        || (type->len == 5 && ngx_strncmp(type->data, "grpcs", 5) == 0);
+}
+
+#endif
+
+
+/*
+ * TLS context is created for every checked upstream when nginx is built
+ * with TLS, the type may be switched to a TLS one by the api or by the
+ * persisted options. The context is shared by the checks of all peers.
+ */
+
+ngx_int_t
+ngx_dynamic_healthcheck_init_ssl(ngx_conf_t *cf,
+    ngx_dynamic_healthcheck_conf_t *conf, ngx_dynamic_healthcheck_opts_t *prev)
+{
+    ngx_str_t            *type = &conf->config.type;
+#if (NGX_SSL)
+    ngx_pool_cleanup_t   *cln;
+#endif
+
+    ngx_conf_merge_value(conf->config.ssl_verify, prev->ssl_verify, 0);
+    ngx_conf_merge_str_value(conf->config.ssl_name, prev->ssl_name);
+    ngx_conf_merge_str_value(conf->config.ssl_trusted_certificate,
+        prev->ssl_trusted_certificate);
+    ngx_conf_merge_str_value(conf->config.ssl_certificate,
+        prev->ssl_certificate);
+    ngx_conf_merge_str_value(conf->config.ssl_certificate_key,
+        prev->ssl_certificate_key);
+
+#if (NGX_SSL)
+
+    if (type->len == 0
+        && conf->config.ssl_trusted_certificate.len == 0
+        && conf->config.ssl_certificate.len == 0)
+        return NGX_OK;
+
+    if (conf->config.ssl_verify
+        && conf->config.ssl_trusted_certificate.len == 0) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+            "'ssl_verify' requires 'check_ssl_trusted_certificate'"
+            " in upstream %V", &conf->config.upstream);
+        return NGX_ERROR;
+    }
+
+    if (conf->config.ssl_certificate.len != 0
+        && conf->config.ssl_certificate_key.len == 0) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+            "no 'check_ssl_certificate_key' for 'check_ssl_certificate'"
+            " in upstream %V", &conf->config.upstream);
+        return NGX_ERROR;
+    }
+
+    conf->ssl = (ngx_ssl_t *) ngx_pcalloc(cf->pool, sizeof(ngx_ssl_t));
+    if (conf->ssl == NULL)
+        return NGX_ERROR;
+
+    conf->ssl->log = cf->log;
+
+    if (ngx_ssl_create(conf->ssl, NGX_SSL_TLSv1_2|NGX_SSL_TLSv1_3, NULL)
+            != NGX_OK)
+        return NGX_ERROR;
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        ngx_ssl_cleanup_ctx(conf->ssl);
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_ssl_cleanup_ctx;
+    cln->data = conf->ssl;
+
+    if (ngx_dynamic_healthcheck_ssl_session_cache(conf->ssl) != NGX_OK)
+        return NGX_ERROR;
+
+    if (conf->config.ssl_trusted_certificate.len != 0
+        && ngx_ssl_trusted_certificate(cf, conf->ssl,
+               &conf->config.ssl_trusted_certificate, 9) != NGX_OK)
+        return NGX_ERROR;
+
+    // client certificate presented to the peers requiring it
+
+    if (conf->config.ssl_certificate.len != 0
+        && ngx_ssl_certificate(cf, conf->ssl, &conf->config.ssl_certificate,
+               &conf->config.ssl_certificate_key, NULL) != NGX_OK)
+        return NGX_ERROR;
+
+    return NGX_OK;
+
+#else
+
+    if (!ngx_dynamic_healthcheck_tls_type(type)
+        && conf->config.ssl_trusted_certificate.len == 0
+        && conf->config.ssl_certificate.len == 0)
+        return NGX_OK;
+
+    ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+        "TLS checks require ngx_http_ssl_module or ngx_stream_ssl_module");
+
+    return NGX_ERROR;
+
+#endif
+}
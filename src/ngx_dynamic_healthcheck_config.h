@@ -18,6 +18,14 @@ char *
 ngx_dynamic_healthcheck_check(ngx_conf_t *cf, ngx_command_t *cmd,
     void *p);
 
+void
+ngx_dynamic_healthcheck_merge_passive(ngx_dynamic_healthcheck_opts_t *conf,
+    ngx_dynamic_healthcheck_opts_t *prev);
+
+ngx_int_t
+ngx_dynamic_healthcheck_init_ssl(ngx_conf_t *cf,
+    ngx_dynamic_healthcheck_conf_t *conf, ngx_dynamic_healthcheck_opts_t *prev);
+
 // http
 
 char *
@@ -0,0 +1,860 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+#include "ngx_dynamic_healthcheck_grpc.h"
+
+extern "C" {
+
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+}
+
+
+#define NGX_H2_DATA            0x0
+#define NGX_H2_HEADERS         0x1
+#define NGX_H2_RST_STREAM      0x3
+#define NGX_H2_SETTINGS        0x4
+#define NGX_H2_PING            0x6
+#define NGX_H2_GOAWAY          0x7
+#define NGX_H2_WINDOW_UPDATE   0x8
+#define NGX_H2_CONTINUATION    0x9
+
+#define NGX_H2_END_STREAM      0x1
+#define NGX_H2_ACK             0x1
+#define NGX_H2_END_HEADERS     0x4
+#define NGX_H2_PADDED          0x8
+#define NGX_H2_PRIORITY        0x20
+
+#define NGX_H2_FRAME_HEADER    9
+
+// HPACK static table: :status 200 .. 500 are 8 .. 14, 61 entries total
+
+#define NGX_H2_STATUS_FIRST    8
+#define NGX_H2_STATUS_LAST     14
+#define NGX_H2_STATIC_SIZE     61
+
+// HealthCheckResponse.ServingStatus
+
+#define NGX_GRPC_SERVING       1
+
+
+static const u_char grpc_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+static ngx_str_t grpc_path = ngx_string("/grpc.health.v1.Health/Check");
+static ngx_str_t grpc_content_type = ngx_string("application/grpc");
+static ngx_str_t grpc_user_agent = ngx_string("nginx/" NGINX_VERSION);
+static ngx_str_t grpc_te = ngx_string("trailers");
+
+static const ngx_uint_t grpc_status_codes[] = {
+    200, 204, 206, 304, 400, 404, 500
+};
+
+
+static u_char *
+h2_frame_head(u_char *p, size_t len, ngx_uint_t type, ngx_uint_t flags,
+    ngx_uint_t id)
+{
+    *p++ = (u_char) (len >> 16);
+    *p++ = (u_char) (len >> 8);
+    *p++ = (u_char) len;
+    *p++ = (u_char) type;
+    *p++ = (u_char) flags;
+    *p++ = (u_char) (id >> 24);
+    *p++ = (u_char) (id >> 16);
+    *p++ = (u_char) (id >> 8);
+    *p++ = (u_char) id;
+
+    return p;
+}
+
+
+static u_char *
+h2_write_uint32(u_char *p, uint32_t v)
+{
+    *p++ = (u_char) (v >> 24);
+    *p++ = (u_char) (v >> 16);
+    *p++ = (u_char) (v >> 8);
+    *p++ = (u_char) v;
+
+    return p;
+}
+
+
+static uint32_t
+h2_read_uint32(u_char *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16)
+           | ((uint32_t) p[2] << 8) | p[3];
+}
+
+
+// HPACK integer with 'prefix' bits in the first byte (RFC 7541, 5.1)
+
+static u_char *
+hpack_write_int(u_char *p, ngx_uint_t value, ngx_uint_t prefix, u_char mask)
+{
+    ngx_uint_t  max = (1 << prefix) - 1;
+
+    if (value < max) {
+        *p++ = (u_char) (mask | value);
+        return p;
+    }
+
+    *p++ = (u_char) (mask | max);
+    value -= max;
+
+    while (value >= 128) {
+        *p++ = (u_char) (0x80 | (value & 0x7f));
+        value >>= 7;
+    }
+
+    *p++ = (u_char) value;
+
+    return p;
+}
+
+
+static size_t
+hpack_int_len(ngx_uint_t value, ngx_uint_t prefix)
+{
+    ngx_uint_t  max = (1 << prefix) - 1;
+    size_t      len = 1;
+
+    if (value < max)
+        return len;
+
+    for (value -= max; value >= 128; value >>= 7)
+        len++;
+
+    return len + 1;
+}
+
+
+static ngx_int_t
+hpack_read_int(u_char **pos, u_char *last, ngx_uint_t prefix)
+{
+    u_char      *p = *pos;
+    ngx_uint_t   max = (1 << prefix) - 1, value, shift, i;
+
+    if (p == last)
+        return NGX_ERROR;
+
+    value = *p++ & max;
+
+    if (value == max) {
+
+        for (shift = 0, i = 0; ; shift += 7, i++) {
+
+            if (p == last || i == 4)
+                return NGX_ERROR;
+
+            value += (ngx_uint_t) (*p & 0x7f) << shift;
+
+            if ((*p++ & 0x80) == 0)
+                break;
+        }
+    }
+
+    *pos = p;
+
+    return (ngx_int_t) value;
+}
+
+
+// literal header field without indexing, indexed name, plain value
+
+static u_char *
+hpack_write_literal(u_char *p, ngx_uint_t index, ngx_str_t *value)
+{
+    p = hpack_write_int(p, index, 4, 0x00);
+    p = hpack_write_int(p, value->len, 7, 0x00);
+
+    return ngx_cpymem(p, value->data, value->len);
+}
+
+
+static size_t
+hpack_literal_len(ngx_uint_t index, ngx_str_t *value)
+{
+    return hpack_int_len(index, 4) + hpack_int_len(value->len, 7)
+           + value->len;
+}
+
+
+static ngx_int_t
+pb_read_varint(u_char **pos, u_char *last, uint64_t *value)
+{
+    u_char      *p = *pos;
+    ngx_uint_t   shift;
+
+    *value = 0;
+
+    for (shift = 0; shift < 64; shift += 7) {
+
+        if (p == last)
+            return NGX_ERROR;
+
+        *value |= (uint64_t) (*p & 0x7f) << shift;
+
+        if ((*p++ & 0x80) == 0) {
+            *pos = p;
+            return NGX_OK;
+        }
+    }
+
+    return NGX_ERROR;
+}
+
+
+ngx_int_t
+healthcheck_grpc_helper::make_request(ngx_dynamic_healthcheck_opts_t *conf,
+    ngx_flag_t tls, ngx_dynamic_hc_local_node_t *state)
+{
+    ngx_buf_t         *buf = state->buf;
+    ngx_connection_t  *c = state->pc.connection;
+    ngx_str_t          authority = conf->ssl_name;
+    u_char            *p, *head;
+    size_t             len;
+
+    if (authority.len == 0)
+        authority = state->server;
+
+    // HEADERS: method, scheme, literals and te: trailers with a new name
+
+    len = NGX_H2_FRAME_HEADER + 2
+          + hpack_literal_len(4, &grpc_path)
+          + hpack_literal_len(1, &authority)
+          + hpack_literal_len(31, &grpc_content_type)
+          + hpack_literal_len(58, &grpc_user_agent)
+          + 4 + hpack_int_len(grpc_te.len, 7) + grpc_te.len;
+
+    // DATA: grpc message prefix and the service field
+
+    len += NGX_H2_FRAME_HEADER + 5;
+
+    if (conf->grpc_service.len != 0)
+        len += 1 + (conf->grpc_service.len < 128 ? 1 : 2)
+               + conf->grpc_service.len;
+
+    if (c->requests == 0)
+        len += sizeof(grpc_preface) - 1
+               + NGX_H2_FRAME_HEADER + 12
+               + NGX_H2_FRAME_HEADER + 4;
+
+    if ((size_t) (buf->end - buf->last) < len) {
+        ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                      "[%V] %V: %V addr=%V, fd=%d grpc "
+                      "healthcheck_buffer_size too small for the request",
+                      &module, &upstream, &server, &name, c->fd);
+        return NGX_ERROR;
+    }
+
+    // client streams are odd, one stream per check on the connection
+
+    sid = 2 * c->requests + 1;
+
+    p = buf->last;
+
+    if (c->requests == 0) {
+
+        p = ngx_cpymem(p, grpc_preface, sizeof(grpc_preface) - 1);
+
+        // no server push, no dynamic table in the responses
+
+        p = h2_frame_head(p, 12, NGX_H2_SETTINGS, 0, 0);
+        p = h2_write_uint32(p, 0x00010000);
+        p = h2_write_uint32(p, 0);
+        p = h2_write_uint32(p, 0x00020000);
+        p = h2_write_uint32(p, 0);
+
+        // connection window is never refilled, open it once for good
+
+        p = h2_frame_head(p, 4, NGX_H2_WINDOW_UPDATE, 0, 0);
+        p = h2_write_uint32(p, 0x7fffffff - 65535);
+    }
+
+    head = p;
+    p += NGX_H2_FRAME_HEADER;
+
+    *p++ = 0x83;                             // :method: POST
+    *p++ = tls ? 0x87 : 0x86;                // :scheme: https|http
+
+    p = hpack_write_literal(p, 4, &grpc_path);
+    p = hpack_write_literal(p, 1, &authority);
+    p = hpack_write_literal(p, 31, &grpc_content_type);
+    p = hpack_write_literal(p, 58, &grpc_user_agent);
+
+    *p++ = 0x00;                             // te: trailers, new name
+    *p++ = 2;
+    *p++ = 't';
+    *p++ = 'e';
+    p = hpack_write_int(p, grpc_te.len, 7, 0x00);
+    p = ngx_cpymem(p, grpc_te.data, grpc_te.len);
+
+    h2_frame_head(head, p - head - NGX_H2_FRAME_HEADER, NGX_H2_HEADERS,
+                  NGX_H2_END_HEADERS, sid);
+
+    // HealthCheckRequest { string service = 1; }
+
+    len = 0;
+    if (conf->grpc_service.len != 0)
+        len = 1 + (conf->grpc_service.len < 128 ? 1 : 2)
+              + conf->grpc_service.len;
+
+    p = h2_frame_head(p, 5 + len, NGX_H2_DATA, NGX_H2_END_STREAM, sid);
+
+    *p++ = 0;                                // not compressed
+    p = h2_write_uint32(p, len);
+
+    if (len != 0) {
+        *p++ = 0x0a;
+        if (conf->grpc_service.len < 128) {
+            *p++ = (u_char) conf->grpc_service.len;
+        } else {
+            *p++ = (u_char) (0x80 | (conf->grpc_service.len & 0x7f));
+            *p++ = (u_char) (conf->grpc_service.len >> 7);
+        }
+        p = ngx_cpymem(p, conf->grpc_service.data, conf->grpc_service.len);
+    }
+
+    buf->last = p;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+healthcheck_grpc_helper::control(ngx_connection_t *c, ngx_uint_t type,
+    u_char *data, size_t len)
+{
+    u_char  frame[NGX_H2_FRAME_HEADER + 8], *p;
+
+    p = h2_frame_head(frame, len, type, NGX_H2_ACK, 0);
+    if (len != 0)
+        p = ngx_cpymem(p, data, len);
+
+    if (c->send(c, frame, p - frame) != p - frame) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "[%V] %V: %V addr=%V, fd=%d grpc "
+                      "failed to send frame type=%ui",
+                      &module, &upstream, &server, &name, c->fd, type);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * HPACK Huffman code (RFC 7541, Appendix B) is canonical: the codes of
+ * each length are consecutive and follow in the order of the symbols.
+ * It is decoded here, nginx may be built without the HTTP/2 module.
+ */
+
+static const u_char hpack_huff_count[31] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+    0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+
+static const uint16_t hpack_huff_symbol[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37,
+    45, 46, 47, 51, 52, 53, 54, 55, 56, 57, 61, 65,
+    95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+    58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89,
+    106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44, 59,
+    88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62,
+    0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161,
+    167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+    132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+    173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+    151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+    183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159,
+    171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+    255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245,
+    246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+    6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220,
+    249, 10, 13, 22, 256
+};
+
+
+static ngx_int_t
+hpack_huff_decode(u_char *src, size_t len, u_char *dst, size_t *n)
+{
+    u_char      *end = src + len, *d = dst;
+    ngx_uint_t   bits = 0, ones = 1, bit, index = 0, sym;
+    ngx_int_t    i, code = 0, first = 0, count;
+
+    for (; src < end; src++) {
+
+        for (i = 7; i >= 0; i--) {
+
+            bit = (*src >> i) & 1;
+
+            code |= bit;
+            ones &= bit;
+            count = hpack_huff_count[++bits];
+
+            if (code < first + count) {
+
+                sym = hpack_huff_symbol[index + code - first];
+                if (sym == 256)
+                    return NGX_ERROR;
+
+                *d++ = (u_char) sym;
+
+                bits = index = 0;
+                code = first = 0;
+                ones = 1;
+
+                continue;
+            }
+
+            if (bits == 30)
+                return NGX_ERROR;
+
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+        }
+    }
+
+    // padding is up to 7 most significant bits of EOS
+
+    if (bits > 7 || !ones)
+        return NGX_ERROR;
+
+    *n = d - dst;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Huffman coded strings are decoded into 'dst' if they fit,
+ * longer ones are skipped, only short names and values are matched.
+ */
+
+ngx_int_t
+healthcheck_grpc_helper::literal(ngx_connection_t *c, u_char **pos,
+    u_char *last, u_char *dst, size_t size, ngx_str_t *s)
+{
+    ngx_flag_t  huff;
+    ngx_int_t   len;
+
+    if (*pos == last)
+        return NGX_ERROR;
+
+    huff = **pos & 0x80;
+
+    len = hpack_read_int(pos, last, 7);
+    if (len == NGX_ERROR || len > last - *pos)
+        return NGX_ERROR;
+
+    ngx_str_null(s);
+
+    if (!huff) {
+        s->data = *pos;
+        s->len = len;
+
+    } else if ((size_t) len * 8 / 5 < size) {
+
+        if (hpack_huff_decode(*pos, len, dst, &s->len) != NGX_OK) {
+            ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                          "[%V] %V: %V addr=%V, fd=%d grpc "
+                          "invalid huffman string",
+                          &module, &upstream, &server, &name, c->fd);
+            return NGX_ERROR;
+        }
+
+        s->data = dst;
+    }
+
+    *pos += len;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+healthcheck_grpc_helper::headers(ngx_connection_t *c, u_char *pos,
+    u_char *last)
+{
+    static ngx_str_t  status_name = ngx_string(":status");
+    static ngx_str_t  grpc_status_name = ngx_string("grpc-status");
+    u_char            ch, name_buf[32], value_buf[32];
+    ngx_int_t         index, n;
+    ngx_str_t         key, value;
+
+    while (pos < last) {
+
+        ch = *pos;
+
+        if (ch & 0x80) {
+
+            // indexed field, the dynamic table is disabled
+
+            index = hpack_read_int(&pos, last, 7);
+            if (index <= 0 || index > NGX_H2_STATIC_SIZE)
+                return NGX_ERROR;
+
+            if (index >= NGX_H2_STATUS_FIRST && index <= NGX_H2_STATUS_LAST)
+                status = grpc_status_codes[index - NGX_H2_STATUS_FIRST];
+
+            continue;
+        }
+
+        if ((ch & 0xe0) == 0x20) {
+
+            // dynamic table size update
+
+            if (hpack_read_int(&pos, last, 5) == NGX_ERROR)
+                return NGX_ERROR;
+
+            continue;
+        }
+
+        index = hpack_read_int(&pos, last, (ch & 0x40) ? 6 : 4);
+        if (index < 0 || index > NGX_H2_STATIC_SIZE)
+            return NGX_ERROR;
+
+        ngx_str_null(&key);
+
+        if (index >= NGX_H2_STATUS_FIRST && index <= NGX_H2_STATUS_LAST)
+            key = status_name;
+        else if (index == 0
+                 && literal(c, &pos, last, name_buf, sizeof(name_buf), &key)
+                        != NGX_OK)
+            return NGX_ERROR;
+
+        if (literal(c, &pos, last, value_buf, sizeof(value_buf), &value)
+                != NGX_OK)
+            return NGX_ERROR;
+
+        if (key.len == status_name.len
+            && ngx_strncmp(key.data, status_name.data, key.len) == 0) {
+
+            n = ngx_atoi(value.data, value.len);
+            if (n != NGX_ERROR)
+                status = n;
+
+        } else if (key.len == grpc_status_name.len
+                   && ngx_strncmp(key.data, grpc_status_name.data,
+                                  key.len) == 0) {
+
+            grpc_status = ngx_atoi(value.data, value.len);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+healthcheck_grpc_helper::frame(ngx_connection_t *c, ngx_uint_t type,
+    ngx_uint_t flags, ngx_uint_t id, u_char *pos, size_t len)
+{
+    size_t  pad = 0, n;
+
+    ngx_log_debug7(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "[%V] %V: %V addr=%V, grpc frame type=%ui flags=%ui "
+                   "sid=%ui", &module, &upstream, &server, &name,
+                   type, flags, id);
+
+    if ((type == NGX_H2_DATA || type == NGX_H2_HEADERS)
+        && (flags & NGX_H2_PADDED)) {
+
+        if (len == 0 || (size_t) *pos + 1 > len)
+            return NGX_ERROR;
+
+        pad = *pos++;
+        len -= pad + 1;
+    }
+
+    switch (type) {
+
+        case NGX_H2_DATA:
+
+            if (id != sid)
+                break;
+
+            n = ngx_min(len, sizeof(msg) - msg_len);
+            ngx_memcpy(msg + msg_len, pos, n);
+            msg_len += n;
+
+            done = flags & NGX_H2_END_STREAM;
+
+            break;
+
+        case NGX_H2_HEADERS:
+
+            if (id != sid)
+                break;
+
+            if (flags & NGX_H2_PRIORITY) {
+                if (len < 5)
+                    return NGX_ERROR;
+                pos += 5;
+                len -= 5;
+            }
+
+            // health responses are tiny, CONTINUATION is not expected
+
+            if (!(flags & NGX_H2_END_HEADERS)) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                              "[%V] %V: %V addr=%V, fd=%d grpc "
+                              "split header block is not supported",
+                              &module, &upstream, &server, &name, c->fd);
+                return NGX_ERROR;
+            }
+
+            if (headers(c, pos, pos + len) != NGX_OK) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                              "[%V] %V: %V addr=%V, fd=%d grpc "
+                              "invalid header block",
+                              &module, &upstream, &server, &name, c->fd);
+                return NGX_ERROR;
+            }
+
+            done = flags & NGX_H2_END_STREAM;
+
+            break;
+
+        case NGX_H2_RST_STREAM:
+
+            if (id != sid)
+                break;
+
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "[%V] %V: %V addr=%V, fd=%d grpc stream reset, "
+                          "error=%ui", &module, &upstream, &server, &name,
+                          c->fd, len >= 4 ? h2_read_uint32(pos) : 0);
+            return NGX_ERROR;
+
+        case NGX_H2_SETTINGS:
+
+            if (flags & NGX_H2_ACK)
+                break;
+
+            return control(c, NGX_H2_SETTINGS, NULL, 0);
+
+        case NGX_H2_PING:
+
+            if ((flags & NGX_H2_ACK) || len != 8)
+                break;
+
+            return control(c, NGX_H2_PING, pos, 8);
+
+        case NGX_H2_GOAWAY:
+
+            if (len < 8)
+                return NGX_ERROR;
+
+            // the connection is not reused after the check
+
+            c->close = 1;
+
+            if ((h2_read_uint32(pos) & 0x7fffffff) < sid) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                              "[%V] %V: %V addr=%V, fd=%d grpc goaway, "
+                              "error=%ui", &module, &upstream, &server,
+                              &name, c->fd, h2_read_uint32(pos + 4));
+                return NGX_ERROR;
+            }
+
+            break;
+
+        case NGX_H2_CONTINUATION:
+            return NGX_ERROR;
+
+        default:
+            break;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+healthcheck_grpc_helper::response(ngx_connection_t *c)
+{
+    u_char    *p, *last;
+    uint64_t   key, v, serving = 0;
+
+    if (status != 200) {
+        ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                      "[%V] %V: %V addr=%V, fd=%d grpc http status %ui",
+                      &module, &upstream, &server, &name, c->fd, status);
+        return NGX_ERROR;
+    }
+
+    if (grpc_status != 0) {
+        ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                      "[%V] %V: %V addr=%V, fd=%d grpc-status %i",
+                      &module, &upstream, &server, &name, c->fd,
+                      grpc_status);
+        return NGX_ERROR;
+    }
+
+    if (msg_len < 5 || msg[0] != 0)
+        goto invalid;
+
+    p = msg + 5;
+    last = msg + ngx_min(msg_len, 5 + h2_read_uint32(msg + 1));
+
+    // HealthCheckResponse { ServingStatus status = 1; }
+
+    while (p < last) {
+
+        if (pb_read_varint(&p, last, &key) != NGX_OK)
+            goto invalid;
+
+        switch (key & 7) {
+
+            case 0:
+                if (pb_read_varint(&p, last, &v) != NGX_OK)
+                    goto invalid;
+                if (key >> 3 == 1)
+                    serving = v;
+                break;
+
+            case 1:
+                p += 8;
+                break;
+
+            case 2:
+                if (pb_read_varint(&p, last, &v) != NGX_OK
+                    || v > (uint64_t) (last - p))
+                    goto invalid;
+                p += v;
+                break;
+
+            case 5:
+                p += 4;
+                break;
+
+            default:
+                goto invalid;
+        }
+    }
+
+    if (serving != NGX_GRPC_SERVING) {
+        ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                      "[%V] %V: %V addr=%V, fd=%d grpc service "
+                      "is not serving, status=%uL",
+                      &module, &upstream, &server, &name, c->fd, serving);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                  "[%V] %V: %V addr=%V, fd=%d grpc invalid health response",
+                  &module, &upstream, &server, &name, c->fd);
+
+    return NGX_ERROR;
+}
+
+
+/*
+ * Frames already in the buffer are parsed first, then reads until
+ * the socket is drained, the TLS layer may hold more data than
+ * the buffer had room for.
+ */
+
+ngx_int_t
+healthcheck_grpc_helper::receive(ngx_dynamic_hc_local_node_t *state)
+{
+    ngx_connection_t  *c = state->pc.connection;
+    ngx_buf_t         *buf = state->buf;
+    ssize_t            size;
+    size_t             len, n;
+    u_char            *p;
+
+    for ( ;; ) {
+
+        while (buf->last - buf->pos >= NGX_H2_FRAME_HEADER) {
+
+            p = buf->pos;
+            len = (p[0] << 16) | (p[1] << 8) | p[2];
+
+            if ((size_t) (buf->last - p) < NGX_H2_FRAME_HEADER + len)
+                break;
+
+            if (frame(c, p[3], p[4], h2_read_uint32(p + 5) & 0x7fffffff,
+                      p + NGX_H2_FRAME_HEADER, len) != NGX_OK)
+                return NGX_ERROR;
+
+            buf->pos += NGX_H2_FRAME_HEADER + len;
+
+            if (done)
+                return response(c);
+        }
+
+        if (buf->pos == buf->last)
+            buf->pos = buf->last = buf->start;
+
+        if (buf->last == buf->end) {
+
+            // incomplete frame is moved to the buffer start
+
+            n = buf->last - buf->pos;
+
+            if (buf->pos == buf->start) {
+                ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                              "[%V] %V: %V addr=%V, fd=%d grpc "
+                              "healthcheck_buffer_size too small for a frame",
+                              &module, &upstream, &server, &name, c->fd);
+                return NGX_ERROR;
+            }
+
+            ngx_memmove(buf->start, buf->pos, n);
+            buf->pos = buf->start;
+            buf->last = buf->start + n;
+        }
+
+        size = c->recv(c, buf->last, buf->end - buf->last);
+
+        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "[%V] %V: %V addr=%V, fd=%d grpc on_recv() recv: %z",
+                       &module, &upstream, &server, &name, c->fd, size);
+
+        if (size == NGX_AGAIN)
+            return NGX_AGAIN;
+
+        if (size == NGX_ERROR || size == 0)
+            return NGX_ERROR;
+
+        buf->last += size;
+    }
+}
+
+
+/*
+ * The server may send SETTINGS, PING or WINDOW_UPDATE between checks,
+ * they are handled as in a check without a stream. GOAWAY, eof or
+ * an error close the connection. The buffer is reused by the next
+ * check, a frame split between reads closes the connection too.
+ */
+
+ngx_int_t
+healthcheck_grpc_helper::idle(ngx_dynamic_hc_local_node_t *state)
+{
+    ngx_dynamic_hc_state_node_t  s = { NULL, state };
+    healthcheck_grpc_helper      helper(s);
+
+    if (helper.receive(state) != NGX_AGAIN
+        || state->pc.connection->close
+        || state->buf->pos != state->buf->last)
+        return NGX_ERROR;
+
+    return NGX_AGAIN;
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+#ifndef NGX_DYNAMIC_HEALTHCHECK_GRPC_H
+#define NGX_DYNAMIC_HEALTHCHECK_GRPC_H
+
+
+#include "ngx_dynamic_healthcheck_tcp.h"
+
+
+/*
+ * grpc.health.v1.Health/Check over HTTP/2 with prior knowledge.
+ * Every check is a new stream on the keepalive connection of the peer,
+ * the connection preface is sent only on a new connection.
+ */
+
+class healthcheck_grpc_helper {
+
+private:
+
+    ngx_str_t   name;
+    ngx_str_t   server;
+    ngx_str_t   upstream;
+    ngx_str_t   module;
+
+    ngx_uint_t  sid;
+    ngx_uint_t  status;
+    ngx_int_t   grpc_status;
+    ngx_flag_t  done;
+
+    // grpc message prefix and HealthCheckResponse
+
+    u_char      msg[16];
+    size_t      msg_len;
+
+private:
+
+    ngx_int_t control(ngx_connection_t *c, ngx_uint_t type, u_char *data,
+        size_t len);
+
+    ngx_int_t literal(ngx_connection_t *c, u_char **pos, u_char *last,
+        u_char *dst, size_t size, ngx_str_t *s);
+
+    ngx_int_t headers(ngx_connection_t *c, u_char *pos, u_char *last);
+
+    ngx_int_t frame(ngx_connection_t *c, ngx_uint_t type, ngx_uint_t flags,
+        ngx_uint_t id, u_char *pos, size_t len);
+
+    ngx_int_t response(ngx_connection_t *c);
+
+public:
+
+    healthcheck_grpc_helper(ngx_dynamic_hc_state_node_t s)
+        : sid(0), status(0), grpc_status(-1), done(0), msg_len(0)
+    {
+        name     = s.local->name;
+        server   = s.local->server;
+        upstream = s.local->upstream;
+        module   = s.local->module;
+    }
+
+    ngx_int_t make_request(ngx_dynamic_healthcheck_opts_t *conf,
+        ngx_flag_t tls, ngx_dynamic_hc_local_node_t *state);
+
+    ngx_int_t receive(ngx_dynamic_hc_local_node_t *state);
+
+    static ngx_int_t idle(ngx_dynamic_hc_local_node_t *state);
+};
+
+
+template <class PeersT, class PeerT> class ngx_dynamic_healthcheck_grpc :
+    public ngx_dynamic_healthcheck_tcp<PeersT, PeerT>
+{
+
+    healthcheck_grpc_helper helper;
+
+protected:
+
+    virtual ngx_int_t
+    on_send(ngx_dynamic_hc_local_node_t *state)
+    {
+        if (state->buf->last == state->buf->start)
+            if (helper.make_request(this->event->opts, this->tls,
+                                    state) == NGX_ERROR)
+                return NGX_ERROR;
+
+        return ngx_dynamic_healthcheck_tcp<PeersT, PeerT>::on_send(state);
+    }
+
+    virtual ngx_int_t
+    on_recv(ngx_dynamic_hc_local_node_t *state)
+    {
+        return helper.receive(state);
+    }
+
+    virtual ngx_dynamic_hc_idle_pt
+    on_idle()
+    {
+        return &healthcheck_grpc_helper::idle;
+    }
+
+public:
+
+    ngx_dynamic_healthcheck_grpc(PeersT *peers,
+        ngx_dynamic_healthcheck_event_t *event, ngx_dynamic_hc_state_node_t s)
+        : ngx_dynamic_healthcheck_tcp<PeersT, PeerT>(peers, event, s),
+          helper(s)
+    {}
+};
+
+
+#endif /* NGX_DYNAMIC_HEALTHCHECK_GRPC_H */
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+#include "ngx_dynamic_healthcheck_hosts.h"
+
+
+/*
+ * Open addressing with linear probing, the table is at most half full.
+ */
+
+ngx_int_t
+ngx_dynamic_healthcheck_host_set_init(ngx_dynamic_hc_host_set_t *set,
+    ngx_uint_t n, ngx_pool_t *pool)
+{
+    ngx_uint_t  size = 8;
+
+    while (size < 2 * n)
+        size <<= 1;
+
+    set->buckets = ngx_pcalloc(pool, size * sizeof(ngx_str_t));
+    if (set->buckets == NULL)
+        return NGX_ERROR;
+
+    set->mask = size - 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_str_t *
+ngx_dynamic_healthcheck_host_set_find(ngx_dynamic_hc_host_set_t *set,
+    u_char *data, size_t len)
+{
+    ngx_uint_t  i;
+    ngx_str_t  *b;
+
+    for (i = ngx_hash_key(data, len) & set->mask;
+         ;
+         i = (i + 1) & set->mask)
+    {
+        b = &set->buckets[i];
+
+        if (b->data == NULL)
+            return b;
+
+        if (b->len == len && ngx_memcmp(b->data, data, len) == 0)
+            return b;
+    }
+}
+
+
+ngx_int_t
+ngx_dynamic_healthcheck_host_set_add(ngx_dynamic_hc_host_set_t *set,
+    ngx_str_t *host, ngx_pool_t *pool)
+{
+    ngx_str_t  *b;
+
+    if (host->len == 0)
+        return NGX_OK;
+
+    b = ngx_dynamic_healthcheck_host_set_find(set, host->data, host->len);
+
+    if (b->data != NULL)
+        return NGX_OK;
+
+    b->data = ngx_pstrdup(pool, host);
+    if (b->data == NULL)
+        return NGX_ERROR;
+
+    b->len = host->len;
+
+    return NGX_OK;
+}
+
+
+/*
+ * name matches by itself ('host:port') or by the host part
+ */
+
+ngx_flag_t
+ngx_dynamic_healthcheck_host_set_match(ngx_dynamic_hc_host_set_t *set,
+    ngx_str_t *name)
+{
+    u_char  *c;
+
+    if (set->buckets == NULL || name->len == 0)
+        return 0;
+
+    if (ngx_dynamic_healthcheck_host_set_find(set, name->data, name->len)
+            ->data != NULL)
+        return 1;
+
+    c = ngx_strlchr(name->data, name->data + name->len, ':');
+    if (c == NULL)
+        return 0;
+
+    return ngx_dynamic_healthcheck_host_set_find(set, name->data,
+                                                 c - name->data)->data != NULL;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+#ifndef NGX_DYNAMIC_HEALTHCHECK_HOSTS_H
+#define NGX_DYNAMIC_HEALTHCHECK_HOSTS_H
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include <ngx_core.h>
+
+
+typedef struct {
+    ngx_str_t                     *buckets;
+    ngx_uint_t                     mask;
+} ngx_dynamic_hc_host_set_t;
+
+
+/*
+ * Worker local hash sets of disabled and excluded hosts.
+ * Rebuilt only when the options generation changes.
+ */
+
+typedef struct {
+    ngx_uint_t                     generation;
+    unsigned                       compiled:1;
+    ngx_pool_t                    *pool;
+    ngx_dynamic_hc_host_set_t      disabled;
+    ngx_dynamic_hc_host_set_t      excluded;
+} ngx_dynamic_hc_hosts_t;
+
+
+ngx_int_t
+ngx_dynamic_healthcheck_host_set_init(ngx_dynamic_hc_host_set_t *set,
+    ngx_uint_t n, ngx_pool_t *pool);
+
+ngx_int_t
+ngx_dynamic_healthcheck_host_set_add(ngx_dynamic_hc_host_set_t *set,
+    ngx_str_t *host, ngx_pool_t *pool);
+
+ngx_flag_t
+ngx_dynamic_healthcheck_host_set_match(ngx_dynamic_hc_host_set_t *set,
+    ngx_str_t *name);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* NGX_DYNAMIC_HEALTHCHECK_HOSTS_H */
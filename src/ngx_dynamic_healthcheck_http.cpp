@@ -20,77 +20,240 @@ get_in_port(struct sockaddr *sa)
 }
 
 
+/*
+ * The request without the per peer parts is rendered once per options
+ * generation, probes only fill the version, Connection and Host.
+ */
+
+static ngx_int_t
+ngx_dynamic_healthcheck_http_render(ngx_dynamic_hc_request_t *req,
+    ngx_dynamic_healthcheck_opts_t *shared, ngx_pool_t *pool)
+{
+    ngx_uint_t        i;
+    size_t            len;
+    u_char           *p;
+    ngx_keyval_t     *h;
+    static ngx_str_t  Host = ngx_string("Host");
+    static ngx_str_t  user_agent =
+        ngx_string("User-Agent: nginx/" NGINX_VERSION "\r\n");
+
+    ngx_str_null(&req->host);
+
+    len = shared->request_method.len + 1 + shared->request_uri.len
+          + sizeof(" HTTP/1.") - 1;
+
+    req->line.data = (u_char *) ngx_pnalloc(pool, len);
+    if (req->line.data == NULL)
+        return NGX_ERROR;
+
+    req->line.len = ngx_sprintf(req->line.data, "%V %V HTTP/1.",
+                                &shared->request_method,
+                                &shared->request_uri) - req->line.data;
+
+    len = user_agent.len;
+
+    for (i = 0; i < shared->request_headers.len; i++) {
+        h = &shared->request_headers.data[i];
+        len += h->key.len + sizeof(": \r\n") - 1 + h->value.len;
+    }
+
+    req->headers.data = (u_char *) ngx_pnalloc(pool, len);
+    if (req->headers.data == NULL)
+        return NGX_ERROR;
+
+    p = ngx_cpymem(req->headers.data, user_agent.data, user_agent.len);
+
+    for (i = 0; i < shared->request_headers.len; i++) {
+        h = &shared->request_headers.data[i];
+
+        if (ngx_strncasecmp(Host.data, h->key.data, h->key.len) == 0) {
+            req->host = h->value;
+            continue;
+        }
+
+        p = ngx_sprintf(p, "%V: %V\r\n", &h->key, &h->value);
+    }
+
+    req->headers.len = p - req->headers.data;
+
+    if (req->host.len != 0) {
+        req->host.data = ngx_pstrdup(pool, &req->host);
+        if (req->host.data == NULL)
+            return NGX_ERROR;
+    }
+
+    len = sizeof("Content-Length: \r\n\r\n") - 1 + NGX_SIZE_T_LEN
+          + shared->request_body.len;
+
+    req->tail.data = (u_char *) ngx_pnalloc(pool, len);
+    if (req->tail.data == NULL)
+        return NGX_ERROR;
+
+    if (shared->request_body.len)
+        p = ngx_sprintf(req->tail.data, "Content-Length: %uz\r\n\r\n%V",
+                        shared->request_body.len, &shared->request_body);
+    else
+        p = ngx_cpymem(req->tail.data, "\r\n", 2);
+
+    req->tail.len = p - req->tail.data;
+
+    return NGX_OK;
+}
+
+
+ngx_dynamic_hc_request_t *
+ngx_dynamic_healthcheck_http_request(ngx_dynamic_healthcheck_conf_t *conf,
+    ngx_dynamic_healthcheck_opts_t *shared)
+{
+    ngx_dynamic_hc_request_t  *req = &conf->request;
+    ngx_pool_t                *pool;
+
+    if (req->rendered && req->generation == shared->generation)
+        return req;
+
+    pool = ngx_create_pool(ngx_pagesize, ngx_cycle->log);
+    if (pool == NULL)
+        return NULL;
+
+    if (ngx_dynamic_healthcheck_http_render(req, shared, pool) != NGX_OK) {
+        ngx_destroy_pool(pool);
+        req->rendered = 0;
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                      "[%V] %V: no memory for the request",
+                      &conf->config.module, &conf->config.upstream);
+        return NULL;
+    }
+
+    req->generation = shared->generation;
+
+    if (req->pool != NULL)
+        ngx_destroy_pool(req->pool);
+
+    req->pool = pool;
+    req->rendered = 1;
+
+    return req;
+}
+
+
+static void
+healthcheck_http_out(ngx_buf_t *b, ngx_chain_t *cl, u_char *pos, u_char *last)
+{
+    ngx_memzero(b, sizeof(ngx_buf_t));
+
+    b->pos = pos;
+    b->last = last;
+    b->memory = 1;
+
+    cl->buf = b;
+    cl->next = NULL;
+}
+
+
 ngx_int_t
-healthcheck_http_helper::make_request(ngx_dynamic_healthcheck_opts_t *shared,
+healthcheck_http_helper::make_request(ngx_dynamic_hc_request_t *req,
+    ngx_dynamic_healthcheck_opts_t *shared,
     ngx_dynamic_hc_local_node_t *state)
 {
     ngx_buf_t                       *buf = state->buf;
     ngx_connection_t                *c = state->pc.connection;
-    ngx_uint_t                       i;
     ngx_str_t                        host;
     ngx_flag_t                       is_unix_socket;
-    ngx_uint_t                       keepalive = shared->keepalive;
-    static ngx_str_t                 Host = ngx_string("Host");
-
-    ngx_str_null(&host);
+    ngx_uint_t                       keepalive = shared->keepalive, i;
+    u_char                          *version;
+    ngx_chain_t                    **ll;
+    ngx_buf_t                       *b;
 
     is_unix_socket = state->server.len > 5
         && ngx_strncmp(state->server.data, "unix:", 5) == 0;
     if (is_unix_socket)
         keepalive = 1;
 
-    buf->last = ngx_snprintf(buf->last, buf->end - buf->last,
-        "%V %V HTTP/1.%d\r\n", &shared->request_method, &shared->request_uri,
-        is_unix_socket ? 0 : 1);
+    if (buf->end - buf->start < 64 + (ssize_t) ngx_max(req->host.len,
+                                                       state->name.len)) {
+        ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                      "[%V] %V: %V addr=%V, fd=%d http "
+                      "healthcheck_buffer_size too small for the request",
+                      &module, &upstream, &server, &name, c->fd);
+        return NGX_ERROR;
+    }
 
-    buf->last = ngx_snprintf(buf->last, buf->end - buf->last,
-        "User-Agent: nginx/" NGINX_VERSION "\r\n"
-        "Connection: %s\r\n",
-        keepalive > c->requests + 1 ? "keep-alive" : "close");
+    // request line and the rendered headers are sent from the template
 
-    for (i = 0; i < shared->request_headers.len; i++) {
-        if (ngx_strncasecmp(Host.data, shared->request_headers.data[i].key.data,
-                            shared->request_headers.data[i].key.len) == 0) {
-            host = shared->request_headers.data[i].value;
-            continue;
-        }
-        buf->last = ngx_snprintf(buf->last, buf->end - buf->last,
-            "%V: %V\r\n",
-            &shared->request_headers.data[i].key,
-            &shared->request_headers.data[i].value);
-    }
+    buf->last = ngx_sprintf(buf->start, "%d\r\n", is_unix_socket ? 0 : 1);
+    version = buf->last;
+
+    buf->last = ngx_sprintf(buf->last, "Connection: %s\r\n",
+        keepalive > c->requests + 1 ? "keep-alive" : "close");
 
-    if (host.data != NULL) {
-        buf->last = ngx_snprintf(buf->last, buf->end - buf->last,
-            "Host: %V\r\n", &host);
+    if (req->host.len != 0) {
+        buf->last = ngx_sprintf(buf->last, "Host: %V\r\n", &req->host);
     } else if (!is_unix_socket) {
         host = state->name;
         for (; host.len > 0 && host.data[host.len - 1] != ':';
                host.len--);
         host.len--;
-        buf->last = ngx_snprintf(buf->last, buf->end - buf->last,
-            "Host: %V:%d\r\n", &host, get_in_port(state->sockaddr));
+        buf->last = ngx_sprintf(buf->last, "Host: %V:%d\r\n", &host,
+                                get_in_port(state->sockaddr));
     }
 
-    if (shared->request_body.len)
-        buf->last = ngx_snprintf(buf->last, buf->end - buf->last,
-            "Content-Length: %d\r\n\r\n%V",
-            shared->request_body.len, &shared->request_body);
-    else
-        buf->last = ngx_snprintf(buf->last, buf->end - buf->last, "\r\n");
+    // line, version, headers, Connection and Host, tail
+
+    healthcheck_http_out(&out[0], &chain[0], req->line.data,
+                         req->line.data + req->line.len);
+    healthcheck_http_out(&out[1], &chain[1], buf->start, version);
+    healthcheck_http_out(&out[2], &chain[2], req->headers.data,
+                         req->headers.data + req->headers.len);
+    healthcheck_http_out(&out[3], &chain[3], version, buf->last);
+    healthcheck_http_out(&out[4], &chain[4], req->tail.data,
+                         req->tail.data + req->tail.len);
+
+    for (i = 0, ll = &pending, b = NULL; i < 5; i++)
+        if (out[i].last != out[i].pos) {
+            *ll = &chain[i];
+            ll = &chain[i].next;
+            b = &out[i];
+        }
 
-    if (buf->last == buf->end) {
-        ngx_log_error(NGX_LOG_WARN, c->log, 0,
-                      "[%V] %V: %V addr=%V, fd=%d http "
-                      "healthcheck_buffer_size too small for the request",
-                      &module, &upstream, &server, &name, c->fd);
-        return NGX_ERROR;
-    }
+    *ll = NULL;
+
+    // the TLS connection buffers small writes until the flush
+
+    if (b != NULL)
+        b->flush = 1;
 
     return NGX_OK;
 }
 
 
+/*
+ * The parts go out with a single writev() or through the TLS buffer.
+ */
+
+ngx_int_t
+healthcheck_http_helper::send(ngx_dynamic_hc_local_node_t *state)
+{
+    ngx_connection_t  *c = state->pc.connection;
+
+    if (pending == NULL && !c->buffered)
+        return NGX_OK;
+
+    // the rest of the TLS buffer is flushed by the call with no chain
+
+    pending = c->send_chain(c, pending, 0);
+
+    if (pending == NGX_CHAIN_ERROR)
+        return NGX_ERROR;
+
+    ngx_log_debug6(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "[%V] %V: %V addr=%V, fd=%d http request %s",
+                   &module, &upstream, &server, &name, c->fd,
+                   pending == NULL && !c->buffered ? "sent" : "partially sent");
+
+    return pending == NULL && !c->buffered ? NGX_OK : NGX_AGAIN;
+}
+
+
 ngx_int_t
 healthcheck_http_helper::parse_status_line(ngx_dynamic_hc_local_node_t *state)
 {
@@ -434,18 +597,11 @@ healthcheck_http_helper::receive_body(ngx_dynamic_healthcheck_opts_t *shared,
             remains = content_length;
     }
 
-    pool = ngx_create_pool(1024, c->log);
-    if (pool == NULL) {
+    // recycled through the worker free list
 
-        ngx_log_error(NGX_LOG_WARN, c->log, c->fd, 0,
-                      "[%V] %V: %V addr=%V, fd=%d http receiving body: "
-                      "no memory for read body",
-                      &module, &upstream, &server, &name, c->fd);
-        return NGX_ERROR;
-    }
-
-    body = ngx_create_temp_buf(pool, shared->buffer_size);
-    if (body == NULL) {
+    body_buf.start = (u_char *)
+        ngx_dynamic_healthcheck_alloc(shared->buffer_size, c->log);
+    if (body_buf.start == NULL) {
 
         ngx_log_error(NGX_LOG_WARN, c->log, 0,
                       "[%V] %V: %V addr=%V, fd=%d http receiving body: "
@@ -454,6 +610,12 @@ healthcheck_http_helper::receive_body(ngx_dynamic_healthcheck_opts_t *shared,
         return NGX_ERROR;
     }
 
+    body_buf.pos = body_buf.last = body_buf.start;
+    body_buf.end = body_buf.start + shared->buffer_size;
+    body_buf.temporary = 1;
+
+    body = &body_buf;
+
 receive:
 
     for (;;) {
@@ -564,7 +726,7 @@ receive:
 
 ngx_int_t
 healthcheck_http_helper::receive(ngx_dynamic_healthcheck_opts_t *shared,
-    ngx_dynamic_hc_local_node_t *state)
+    ngx_dynamic_hc_regex_t *regex, ngx_dynamic_hc_local_node_t *state)
 {
     ngx_connection_t  *c = state->pc.connection;
     ngx_int_t          rc;
@@ -619,8 +781,7 @@ healthcheck_http_helper::receive(ngx_dynamic_healthcheck_opts_t *shared,
 
     if (shared->response_body.len) {
 
-        switch(ngx_dynamic_healthcheck_match_buffer(&shared->response_body,
-                                                    &s)) {
+        switch(ngx_dynamic_healthcheck_match_buffer(regex, shared, &s)) {
 
             case NGX_OK:
 
@@ -658,6 +819,5 @@ healthcheck_http_helper::receive(ngx_dynamic_healthcheck_opts_t *shared,
 
 healthcheck_http_helper::~healthcheck_http_helper()
 {
-    if (pool != NULL)
-        ngx_destroy_pool(pool);
+    ngx_dynamic_healthcheck_free(body_buf.start);
 }
@@ -25,7 +25,11 @@ private:
     ngx_flag_t          chunked;
     ngx_flag_t          eof;
     ngx_buf_t          *body;
-    ngx_pool_t         *pool;
+    ngx_buf_t           body_buf;
+
+    ngx_buf_t           out[5];
+    ngx_chain_t         chain[5];
+    ngx_chain_t        *pending;
 
 private:
 
@@ -48,7 +52,8 @@ private:
 public:
 
     healthcheck_http_helper(ngx_dynamic_hc_state_node_t s)
-        : remains(0), content_length(-1), chunked(0), eof(0), pool(NULL)
+        : remains(0), content_length(-1), chunked(0), eof(0), body(NULL),
+          pending(NULL)
     {
         name     = s.local->name;
         server   = s.local->server;
@@ -57,18 +62,27 @@ public:
 
         ngx_memzero(&r, sizeof(ngx_http_request_t));
         ngx_memzero(&status, sizeof(ngx_http_status_t));
+        ngx_memzero(&body_buf, sizeof(ngx_buf_t));
     }
 
-    ngx_int_t make_request(ngx_dynamic_healthcheck_opts_t *shared,
+    ngx_int_t make_request(ngx_dynamic_hc_request_t *req,
+        ngx_dynamic_healthcheck_opts_t *shared,
         ngx_dynamic_hc_local_node_t *state);
 
+    ngx_int_t send(ngx_dynamic_hc_local_node_t *state);
+
     ngx_int_t receive(ngx_dynamic_healthcheck_opts_t *shared,
-        ngx_dynamic_hc_local_node_t *state);
+        ngx_dynamic_hc_regex_t *regex, ngx_dynamic_hc_local_node_t *state);
 
     ~healthcheck_http_helper();
 };
 
 
+ngx_dynamic_hc_request_t *
+ngx_dynamic_healthcheck_http_request(ngx_dynamic_healthcheck_conf_t *conf,
+    ngx_dynamic_healthcheck_opts_t *shared);
+
+
 template <class PeersT, class PeerT> class ngx_dynamic_healthcheck_http :
     public ngx_dynamic_healthcheck_tcp<PeersT, PeerT>
 {
@@ -81,23 +95,29 @@ protected:
     virtual ngx_int_t
     on_send(ngx_dynamic_hc_local_node_t *state)
     {
-        if (this->event->conf->shared->request_uri.len == 0)
-            goto tcp;
+        ngx_dynamic_hc_request_t  *req;
 
-        if (state->buf->last == state->buf->start)
-            if (helper.make_request(this->shared, state)
-                    == NGX_ERROR)
-                return NGX_ERROR;
+        if (this->shared->request_uri.len == 0)
+            return ngx_dynamic_healthcheck_tcp<PeersT, PeerT>::on_send(state);
+
+        if (state->buf->last == state->buf->start) {
 
-tcp:
+            req = ngx_dynamic_healthcheck_http_request(this->event->conf,
+                                                       this->shared);
+
+            if (req == NULL
+                || helper.make_request(req, this->shared, state) == NGX_ERROR)
+                return NGX_ERROR;
+        }
 
-        return ngx_dynamic_healthcheck_tcp<PeersT, PeerT>::on_send(state);
+        return helper.send(state);
     }
 
     virtual ngx_int_t
     on_recv(ngx_dynamic_hc_local_node_t *state)
     {
-        return helper.receive(this->shared, state);
+        return helper.receive(this->shared, &this->event->conf->regex,
+                              state);
     }
     
 public:
@@ -114,19 +114,53 @@ ngx_dynamic_healthcheck_peer::abort()
 void
 ngx_dynamic_healthcheck_peer::fail(ngx_flag_t skip)
 {
+    if (retry())
+        return;
+
     close();
 
-    state.shared->fall_total++;
-    if (++state.shared->fall >= opts->fall) {
-        state.shared->rise = 0;
+    ngx_dynamic_hc_peer_stat_t  *stat = state.shared->stat;
+
+    ngx_atomic_fetch_add(&stat->fall_total, 1);
+    if ((ngx_int_t) ngx_atomic_fetch_add(&stat->fall, 1) + 1 >= opts->fall) {
+        stat->rise = 0;
         down(skip);
-        state.shared->down = 1;
+        stat->down = 1;
     }
 
     completed();
 }
 
 
+/*
+ * The peer may drop an idle keepalive connection silently, the loss
+ * is seen only by the next request. The check is repeated once on
+ * a new connection if nothing is received on the reused one.
+ */
+
+ngx_flag_t
+ngx_dynamic_healthcheck_peer::retry()
+{
+    if (!reused || responded || ngx_stopping())
+        return 0;
+
+    ngx_log_error(NGX_LOG_INFO, event->log, 0,
+                  "[%V] %V: %V addr=%V keepalive connection lost, reconnect",
+                  &module, &upstream, &server, &name);
+
+    reused = 0;
+
+    close();
+
+    state.local->buf->pos = state.local->buf->last = state.local->buf->start;
+    state.local->discarded = 0;
+
+    connect();
+
+    return 1;
+}
+
+
 void
 ngx_dynamic_healthcheck_peer::success()
 {
@@ -136,19 +170,29 @@ ngx_dynamic_healthcheck_peer::success()
     if (state.local->pc.connection)
         state.local->pc.connection->requests++;
 
+    ngx_dynamic_hc_peer_stat_t  *stat = state.shared->stat;
+
     set_keepalive();
 
-    state.shared->rise_total++;
-    if (++state.shared->rise >= opts->rise || state.shared->fall_total == 0) {
-        state.shared->fall = 0;
+    ngx_atomic_fetch_add(&stat->rise_total, 1);
+    if ((ngx_int_t) ngx_atomic_fetch_add(&stat->rise, 1) + 1 >= opts->rise
+        || stat->fall_total == 0) {
+        stat->fall = 0;
+        if (stat->down)
+            ngx_memzero(stat->passive, sizeof(stat->passive));
         up();
-        state.shared->down = 0;
+        stat->down = 0;
     }
 
     completed();
 }
 
 
+/*
+ * Idle connection lives until the peer closes it or 'keepalive'
+ * requests are done, the timer only watches for the worker exit.
+ */
+
 void
 ngx_dynamic_healthcheck_peer::handle_idle(ngx_event_t *ev)
 {
@@ -163,13 +207,13 @@ ngx_dynamic_healthcheck_peer::handle_idle(ngx_event_t *ev)
                    &state->module, &state->upstream,
                    &state->server, &state->name, c->fd);
 
-    if (handle_event(ev) == NGX_ERROR)
+    if (ngx_stopping())
         goto close;
 
-    if (state->expired <= current_msec())
+    if (!ev->write && ev->ready && state->idle(state) != NGX_AGAIN)
         goto close;
 
-    if (ngx_stopping())
+    if (handle_event(ev) == NGX_ERROR)
         goto close;
 
     ngx_add_timer(c->write, 1000);
@@ -178,11 +222,28 @@ ngx_dynamic_healthcheck_peer::handle_idle(ngx_event_t *ev)
 
 close:
 
-    ngx_close_connection(c);
+    ngx_dynamic_healthcheck_close_connection(c);
     ngx_memzero(&state->pc, sizeof(ngx_peer_connection_t));
 }
 
 
+/*
+ * A record of the TLS layer without data leaves the connection idle,
+ * eof, error or unexpected data closes it.
+ */
+
+ngx_int_t
+ngx_dynamic_healthcheck_peer::idle(ngx_dynamic_hc_local_node_t *state)
+{
+    ngx_connection_t  *c = state->pc.connection;
+    u_char             buf[1];
+
+    state->buf->pos = state->buf->last = state->buf->start;
+
+    return c->recv(c, buf, 1) == NGX_AGAIN ? NGX_AGAIN : NGX_ERROR;
+}
+
+
 void
 ngx_dynamic_healthcheck_peer::handle_connect(ngx_event_t *ev)
 {
@@ -268,11 +329,19 @@ ngx_dynamic_healthcheck_peer::handle_write(ngx_event_t *ev)
 
     peer->check_state = st_sending;
 
-    ngx_shmtx_lock(&peer->state.shared->state->slab->mutex);
+#if (NGX_SSL)
+    if (peer->tls) {
+        rc = peer->ssl_handshake();
 
-    rc = peer->on_send(peer->state.local);
+        if (rc == NGX_AGAIN)
+            return;
 
-    ngx_shmtx_unlock(&peer->state.shared->state->slab->mutex);
+        if (rc != NGX_OK)
+            return peer->fail();
+    }
+#endif
+
+    rc = peer->on_send(peer->state.local);
 
     ngx_log_debug6(NGX_LOG_DEBUG_HTTP, c->log, 0,
                    "[%V] %V: %V addr=%V, fd=%d on_send(), rc=%d",
@@ -309,6 +378,7 @@ ngx_dynamic_healthcheck_peer::handle_write(ngx_event_t *ev)
 
     peer->state.local->buf->pos = peer->state.local->buf->start;
     peer->state.local->buf->last = peer->state.local->buf->start;
+    peer->state.local->discarded = 0;
 
     ngx_add_timer(c->read, peer->opts->timeout);
     ngx_dynamic_healthcheck_peer::handle_read(c->read);
@@ -352,11 +422,11 @@ ngx_dynamic_healthcheck_peer::handle_read(ngx_event_t *ev)
 
     peer->check_state = st_receiving;
 
-    ngx_shmtx_lock(&peer->state.shared->state->slab->mutex);
-
     rc = peer->on_recv(peer->state.local);
 
-    ngx_shmtx_unlock(&peer->state.shared->state->slab->mutex);
+    if (peer->state.local->buf->last != peer->state.local->buf->start
+        || peer->state.local->discarded)
+        peer->responded = 1;
 
     ngx_log_debug6(NGX_LOG_DEBUG_HTTP, c->log, 0,
                    "[%V] %V: %V addr=%V, fd=%d on_recv(), rc=%d",
@@ -415,6 +485,150 @@ ngx_dynamic_healthcheck_peer::handle_dummy(ngx_event_t *ev)
 }
 
 
+#if (NGX_SSL)
+
+void
+ngx_dynamic_healthcheck_peer::handle_ssl(ngx_connection_t *c)
+{
+    c->read->handler = &ngx_dynamic_healthcheck_peer::handle_dummy;
+    c->write->handler = &ngx_dynamic_healthcheck_peer::handle_write;
+
+    ngx_dynamic_healthcheck_peer::handle_write(c->write);
+}
+
+
+/*
+ * The handshake resumes the session of the previous one,
+ * handle_ssl() continues the check when it completes.
+ */
+
+ngx_int_t
+ngx_dynamic_healthcheck_peer::ssl_handshake()
+{
+    ngx_connection_t  *c = state.local->pc.connection;
+    ngx_ssl_t         *ssl = event->conf->ssl;
+    ngx_str_t          host;
+    u_char             sni[256];
+    ngx_int_t          rc;
+
+    host = event->conf->config.ssl_name;
+    if (host.len == 0)
+        host = get_host(&server);
+
+    if (c->ssl != NULL) {
+        if (!c->ssl->handshaked)
+            return NGX_ERROR;
+
+        // keepalive connection or the handshake has just completed
+
+        goto done;
+    }
+
+    if (ssl == NULL) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "[%V] %V: %V addr=%V, fd=%d no ssl context",
+                      &module, &upstream, &server, &name, c->fd);
+        return NGX_ERROR;
+    }
+
+    if (ngx_ssl_create_connection(ssl, c, NGX_SSL_BUFFER|NGX_SSL_CLIENT)
+            != NGX_OK)
+        return NGX_ERROR;
+
+#ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+
+    if (alpn_h2 && SSL_set_alpn_protos(c->ssl->connection,
+                                       (const unsigned char *) "\x02h2", 3)
+                   != 0) {
+        ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
+                      (char *) "SSL_set_alpn_protos() failed");
+        return NGX_ERROR;
+    }
+
+#endif
+
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+
+    if (host.len != 0 && host.len < sizeof(sni) && host.data[0] != '['
+        && ngx_inet_addr(host.data, host.len) == INADDR_NONE
+        && !(server.len > 5 && ngx_strncmp(server.data, "unix:", 5) == 0)) {
+
+        *ngx_cpymem(sni, host.data, host.len) = '\0';
+
+        if (SSL_set_tlsext_host_name(c->ssl->connection, (char *) sni) == 0) {
+            ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
+                          (char *) "SSL_set_tlsext_host_name(\"%V\") failed",
+                          &host);
+            return NGX_ERROR;
+        }
+    }
+
+#endif
+
+    if (ngx_dynamic_healthcheck_ssl_set_session(c, state.local) != NGX_OK)
+        return NGX_ERROR;
+
+    c->log->action = (char *) "SSL handshaking";
+
+    rc = ngx_ssl_handshake(c);
+
+    if (rc == NGX_AGAIN) {
+        c->ssl->handler = &ngx_dynamic_healthcheck_peer::handle_ssl;
+        return NGX_AGAIN;
+    }
+
+    if (rc != NGX_OK)
+        return NGX_ERROR;
+
+done:
+
+    c->log->action = (char *) "sending request";
+
+    if (event->conf->config.ssl_verify && ssl_verify(c, &host) != NGX_OK)
+        return NGX_ERROR;
+
+    // resumed TLSv1.2 session gets no new one, it is kept for the next
+
+    if (SSL_session_reused(c->ssl->connection)
+#ifdef TLS1_3_VERSION
+        && SSL_version(c->ssl->connection) != TLS1_3_VERSION
+#endif
+        && state.local->ssl_session == NULL)
+        state.local->ssl_session = ngx_ssl_get_session(c);
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_dynamic_healthcheck_peer::ssl_verify(ngx_connection_t *c, ngx_str_t *host)
+{
+    long  rc;
+
+    rc = SSL_get_verify_result(c->ssl->connection);
+
+    if (rc != X509_V_OK) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "[%V] %V: %V addr=%V, fd=%d certificate verify error:"
+                      " (%l:%s)", &module, &upstream, &server, &name, c->fd,
+                      rc, X509_verify_cert_error_string(rc));
+        return NGX_ERROR;
+    }
+
+    if (ngx_ssl_check_host(c, host) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "[%V] %V: %V addr=%V, fd=%d certificate does not match"
+                      " \"%V\"", &module, &upstream, &server, &name, c->fd,
+                      host);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
 ngx_int_t
 ngx_dynamic_healthcheck_peer::peek()
 {
@@ -448,7 +662,7 @@ ngx_dynamic_healthcheck_peer::close()
         ngx_log_debug5(NGX_LOG_DEBUG_HTTP, c->log, 0,
                        "[%V] %V: %V addr=%V, fd=%d close()",
                        &module, &upstream, &server, &name, c->fd);
-        ngx_close_connection(c);
+        ngx_dynamic_healthcheck_close_connection(c);
     }
 
     ngx_memzero(&state.local->pc, sizeof(ngx_peer_connection_t));
@@ -477,15 +691,21 @@ ngx_dynamic_healthcheck_peer::set_keepalive()
                       c->requests, opts->keepalive);
     }
 
-    if (c->error || c->requests >= opts->keepalive)
+    if (c->error || c->close || c->requests >= opts->keepalive)
         goto close;
 
-    state.local->expired = current_msec() + 4 * opts->interval * 1000;
-
     c->write->handler = &ngx_dynamic_healthcheck_peer::handle_idle;
     c->read->handler = &ngx_dynamic_healthcheck_peer::handle_idle;
     c->data = state.local;
 
+    // the data received after the response is read by the protocol
+
+    state.local->idle = on_idle();
+
+    if (state.local->idle(state.local) != NGX_AGAIN
+        || ngx_handle_read_event(c->read, 0) != NGX_OK)
+        goto close;
+
     return ngx_add_timer(c->write, 1000);
 
 close:
@@ -509,6 +729,7 @@ ngx_dynamic_healthcheck_peer::connect()
                            " reuse connection",
                            &module, &upstream, &server, &name,
                            c->fd);
+            reused = 1;
             goto connected;
         }
 
@@ -574,27 +795,132 @@ connected:
 }
 
 
+/*
+ * Due peers are spread over 'splay' percents of the round period
+ * by the hash of the peer address, so the same peer is probed
+ * at the same offset every round.
+ */
+
+void
+ngx_dynamic_healthcheck_peer::schedule()
+{
+    ngx_msec_t  window;
+
+    window = ngx_dynamic_healthcheck_period(opts,
+                 NGX_DYNAMIC_HEALTHCHECK_ROUND) * opts->splay / 100;
+
+    if (window == 0)
+        return start();
+
+    delayed.handler = &ngx_dynamic_healthcheck_peer::handle_delayed;
+    delayed.data = this;
+    delayed.log = event->log;
+
+    ngx_add_timer(&delayed, ngx_crc32_short(name.data, name.len) % window);
+}
+
+
+void
+ngx_dynamic_healthcheck_peer::handle_delayed(ngx_event_t *ev)
+{
+    ngx_dynamic_healthcheck_peer  *peer =
+        (ngx_dynamic_healthcheck_peer *) ev->data;
+
+    if (ngx_stopping())
+        return peer->abort();
+
+    peer->start();
+}
+
+
+void
+ngx_dynamic_healthcheck_peer::start()
+{
+    if (opts->concurrency != 0 && event->active >= opts->concurrency) {
+        wait.peer = this;
+        ngx_queue_insert_tail(&event->waiting, &wait.queue);
+        waiting = 1;
+        return;
+    }
+
+    event->active++;
+    active = 1;
+
+    started = ngx_current_msec;
+
+    connect();
+}
+
+
+void
+ngx_dynamic_healthcheck_peer::release()
+{
+    ngx_queue_t                   *q;
+    ngx_dynamic_healthcheck_peer  *peer;
+
+    if (waiting) {
+        ngx_queue_remove(&wait.queue);
+        waiting = 0;
+    }
+
+    if (!active)
+        return;
+
+    event->active--;
+    active = 0;
+
+    event->cost += ngx_current_msec - started;
+
+    if (ngx_queue_empty(&event->waiting))
+        return;
+
+    q = ngx_queue_head(&event->waiting);
+    ngx_queue_remove(q);
+
+    peer = ((ngx_wait_t *) q)->peer;
+    peer->waiting = 0;
+
+    // posted to avoid the recursion when probes fail synchronously
+
+    peer->delayed.handler = &ngx_dynamic_healthcheck_peer::handle_delayed;
+    peer->delayed.data = peer;
+    peer->delayed.log = event->log;
+
+    ngx_post_event(&peer->delayed, &ngx_posted_events);
+}
+
+
 void
 ngx_dynamic_healthcheck_peer::completed()
 {
     check_state = st_done;
 
+    release();
+
     ngx_log_error(NGX_LOG_INFO, event->log, 0,
                   "[%V] %V: %V addr=%V completed",
                   &module, &upstream, &server, &name);
 
     this->~ngx_dynamic_healthcheck_peer();
 
-    ngx_free(this);
+    ngx_dynamic_healthcheck_free(this);
 }
 
 
 ngx_dynamic_healthcheck_peer::ngx_dynamic_healthcheck_peer
     (ngx_dynamic_healthcheck_event_t *ev, ngx_dynamic_hc_state_node_t s)
-        : opts(ev->conf->shared), state(s), event(ev)
+        : opts(ev->opts), state(s), event(ev)
 {
     ngx_connection_t  *c = state.local->pc.connection;
 
+    ngx_memzero(&delayed, sizeof(ngx_event_t));
+    active = 0;
+    waiting = 0;
+    reused = 0;
+    responded = 0;
+    tls = 0;
+    alpn_h2 = 0;
+
     if (c != NULL) {
         if (c->write->timer_set)
             ngx_del_timer(c->write);
@@ -609,6 +935,7 @@ ngx_dynamic_healthcheck_peer::ngx_dynamic_healthcheck_peer
     }
 
     state.local->buf->pos = state.local->buf->last = state.local->buf->start;
+    state.local->discarded = 0;
 }
 
 
@@ -616,8 +943,7 @@ void
 ngx_dynamic_healthcheck_peer::check()
 {
     static const ngx_str_t skip_addr = ngx_string("0.0.0.0");
-
-    ngx_time_t  *tp = ngx_timeofday();
+    ngx_atomic_uint_t      ejected;
 
     if (ngx_stopping()) {
 
@@ -642,10 +968,28 @@ ngx_dynamic_healthcheck_peer::check()
         || ngx_peer_excluded(&server, event->conf))
         goto excluded;
 
-    if (state.shared->checked + opts->interval > tp->sec)
+    ejected = state.shared->stat->ejected;
+
+    if (ejected != 0) {
+
+        if (ejected > current_msec()) {
+            close();
+            down();
+            state.shared->stat->down = 1;
+            goto end;
+        }
+
+        // ejection is over, the peer and stat->down go up by the active check
+
+        (void) ngx_atomic_cmp_set(&state.shared->stat->ejected, ejected, 0);
+
+        return schedule();
+    }
+
+    if (state.shared->stat->checked + opts->interval > current_msec())
         goto end;
 
-    return connect();
+    return schedule();
 
 disabled:
 
@@ -668,56 +1012,50 @@ end:
 
     this->~ngx_dynamic_healthcheck_peer();
 
-    ngx_free(this);
+    ngx_dynamic_healthcheck_free(this);
 }
 
 
 ngx_dynamic_healthcheck_peer::~ngx_dynamic_healthcheck_peer()
 {
-    ngx_time_t  *tp = ngx_timeofday();
-    if (state.shared->checked + opts->interval <= tp->sec)
-        state.shared->checked = tp->sec;
+    ngx_msec_t  now = current_msec();
+
+    if (delayed.timer_set)
+        ngx_del_timer(&delayed);
+
+    if (delayed.posted)
+        ngx_delete_posted_event(&delayed);
+
+    if (state.shared->stat->checked + opts->interval <= now)
+        state.shared->stat->checked = now;
 }
 
 
 ngx_int_t
-ngx_dynamic_healthcheck_match_buffer(ngx_str_t *pattern, ngx_str_t *s)
+ngx_dynamic_healthcheck_match_buffer(ngx_dynamic_hc_regex_t *re,
+    ngx_dynamic_healthcheck_opts_t *opts, ngx_str_t *s)
 {
-    ngx_regex_compile_t   rc;
-    u_char                errstr[NGX_MAX_CONF_ERRSTR];
-
-    ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
-
     if (s->data == NULL) {
         s->len = 0;
         s->data = (u_char *) "";
     }
 
-    rc.pattern = *pattern;
-    rc.err.len = NGX_MAX_CONF_ERRSTR;
-    rc.err.data = errstr;
-#ifdef NGX_REGEX_DOTALL
-    rc.options = NGX_REGEX_DOTALL;
-#endif
-
-    rc.pool = ngx_create_pool(1024, ngx_cycle->log);
-    if (rc.pool == NULL) {
-        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, 0, "match: no memory");
+    if (ngx_dynamic_healthcheck_regex_compile(re, &opts->response_body,
+            opts->generation, ngx_cycle->log) != NGX_OK)
         return NGX_ERROR;
-    }
 
-    if (ngx_regex_compile(&rc) != NGX_OK) {
-        ngx_destroy_pool(rc.pool);
-        return NGX_ERROR;
-    }
-
-    int captures[(1 + rc.captures) * 3];
-    int m = ngx_regex_exec(rc.regex, s, captures, (1 + rc.captures) * 3);
+    return ngx_dynamic_healthcheck_regex_exec(re, s);
+}
 
-    ngx_destroy_pool(rc.pool);
 
-    if (m == NGX_REGEX_NO_MATCHED)
-        return NGX_DECLINED;
+ngx_int_t
+ngx_dynamic_healthcheck_match_stream(ngx_dynamic_hc_regex_t *re,
+    ngx_dynamic_healthcheck_opts_t *opts, ngx_buf_t *b,
+    ngx_flag_t *discarded)
+{
+    if (ngx_dynamic_healthcheck_regex_compile(re, &opts->response_body,
+            opts->generation, ngx_cycle->log) != NGX_OK)
+        return NGX_ERROR;
 
-    return m >= 0 ? NGX_OK : NGX_ERROR;
+    return ngx_dynamic_healthcheck_regex_exec_partial(re, b, discarded);
 }
@@ -13,6 +13,7 @@ extern "C" {
 
 #include "ngx_dynamic_healthcheck.h"
 #include "ngx_dynamic_healthcheck_state.h"
+#include "ngx_dynamic_healthcheck_alloc.h"
 
 
 class ngx_dynamic_healthcheck_peer
@@ -20,7 +21,6 @@ class ngx_dynamic_healthcheck_peer
 private:
 
     ngx_dynamic_healthcheck_opts_t   *opts;
-    ngx_dynamic_hc_state_node_t       state;
 
     typedef enum {
         st_none,
@@ -32,9 +32,29 @@ private:
         st_done
     } ngx_check_state_t;
     ngx_check_state_t                 check_state;
-    
+
+    ngx_event_t                       delayed;
+
+    typedef struct {
+        ngx_queue_t                   queue;
+        ngx_dynamic_healthcheck_peer *peer;
+    } ngx_wait_t;
+    ngx_wait_t                        wait;
+
+    ngx_msec_t                        started;
+
+    unsigned                          active:1;
+    unsigned                          waiting:1;
+
+    // the check goes over an idle keepalive connection,
+    // nothing is received on it yet
+    unsigned                          reused:1;
+    unsigned                          responded:1;
+
 protected:
 
+    ngx_dynamic_hc_state_node_t       state;
+
     ngx_str_t         name;
     ngx_str_t         server;
     ngx_str_t         upstream;
@@ -42,11 +62,22 @@ protected:
 
     ngx_dynamic_healthcheck_event_t  *event;
 
+    // the request goes over TLS, the handshake precedes on_send()
+
+    unsigned                          tls:1;
+
+    // HTTP/2 is offered by ALPN on the TLS connection
+
+    unsigned                          alpn_h2:1;
+
 private:
 
     static void
     handle_idle(ngx_event_t *ev);
 
+    static ngx_int_t
+    idle(ngx_dynamic_hc_local_node_t *state);
+
     static void
     handle_connect(ngx_event_t *ev);
 
@@ -59,6 +90,20 @@ private:
     static void
     handle_dummy(ngx_event_t *ev);
 
+    static void
+    handle_delayed(ngx_event_t *ev);
+
+#if (NGX_SSL)
+    static void
+    handle_ssl(ngx_connection_t *c);
+
+    ngx_int_t
+    ssl_handshake();
+
+    ngx_int_t
+    ssl_verify(ngx_connection_t *c, ngx_str_t *host);
+#endif
+
     ngx_int_t
     handle_io(ngx_event_t *ev);
 
@@ -68,6 +113,9 @@ private:
     void
     fail(ngx_flag_t skip = 0);
 
+    ngx_flag_t
+    retry();
+
     void
     success();
 
@@ -83,6 +131,15 @@ private:
     void
     connect();
 
+    void
+    schedule();
+
+    void
+    start();
+
+    void
+    release();
+
     void
     completed();
 
@@ -100,6 +157,12 @@ protected:
     virtual ngx_int_t
     on_recv(ngx_dynamic_hc_local_node_t *state) = 0;
 
+    virtual ngx_dynamic_hc_idle_pt
+    on_idle()
+    {
+        return &ngx_dynamic_healthcheck_peer::idle;
+    }
+
 public:
 
     ngx_dynamic_healthcheck_peer(ngx_dynamic_healthcheck_event_t *ev,
@@ -115,104 +178,200 @@ public:
 template <class PeersT, class PeerT> class ngx_dynamic_healthcheck_peer_wrap :
     public ngx_dynamic_healthcheck_peer
 {
-    PeersT  *primary;
+    /*
+     * Results are applied to the peers list by one walk for all peers
+     * marked in the same event loop iteration, the list is matched
+     * against a hash of the marked names. Only a change of the state
+     * known on the round start is marked.
+     */
 
-    PeerT *
-    find_peer()
+    static void
+    apply(ngx_event_t *ev)
     {
-        PeersT      *peers = primary;
-        PeerT       *peer;
-        ngx_uint_t   i;
+        ngx_dynamic_healthcheck_event_t  *event;
+        ngx_dynamic_hc_mark_t            *marks, *m, **hash;
+        PeersT                           *primary, *peers;
+        PeerT                            *peer;
+        ngx_uint_t                        i, k, size;
+
+        event = (ngx_dynamic_healthcheck_event_t *) ev->data;
+        marks = (ngx_dynamic_hc_mark_t *) event->marks->elts;
+
+        for (size = 8; size < event->marks->nelts * 2; size <<= 1);
+
+        hash = (ngx_dynamic_hc_mark_t **) ngx_pcalloc(event->pool,
+            size * sizeof(ngx_dynamic_hc_mark_t *));
+        if (hash == NULL) {
+            ngx_log_error(NGX_LOG_ERR, event->log, 0,
+                          "[%V] %V: no memory", &event->opts->module,
+                          &event->opts->upstream);
+            event->marks->nelts = 0;
+            return;
+        }
 
-        for (i = 0; peers && i < 2; peers = peers->next, i++) {
+        // the last mark of the peer wins
+
+        for (i = 0; i < event->marks->nelts; i++) {
 
-            for (peer = peers->peer; peer; peer = peer->next)
+            m = &marks[i];
 
-                if (ngx_memn2cmp(server.data, peer->server.data,
-                                 server.len, peer->server.len) == 0
-                    && ngx_memn2cmp(name.data, peer->name.data,
-                                    name.len, peer->name.len) == 0)
-                    return peer;
+            for (k = ngx_hash_key(m->name.data, m->name.len) & (size - 1);
+                 hash[k] != NULL;
+                 k = (k + 1) & (size - 1))
+                if (ngx_memn2cmp(hash[k]->name.data, m->name.data,
+                                 hash[k]->name.len, m->name.len) == 0
+                    && ngx_memn2cmp(hash[k]->server.data, m->server.data,
+                                    hash[k]->server.len, m->server.len) == 0)
+                    break;
+
+            hash[k] = m;
         }
 
-        return NULL;
-    }
+        event->marks->nelts = 0;
 
-protected:
+        primary = (PeersT *) event->primary;
+        peers = primary;
 
-    virtual void
-    up()
-    {
         ngx_rwlock_rlock(&primary->rwlock);
 
-        PeerT  *peer = find_peer();
-
-        if (peer != NULL) {
+        for (i = 0; peers && i < 2; peers = peers->next, i++) {
 
-            ngx_rwlock_wlock(&peer->lock);
+            for (peer = peers->peer; peer; peer = peer->next) {
+
+                for (k = ngx_hash_key(peer->name.data, peer->name.len)
+                             & (size - 1);
+                     hash[k] != NULL;
+                     k = (k + 1) & (size - 1))
+                    if (ngx_memn2cmp(hash[k]->name.data, peer->name.data,
+                                     hash[k]->name.len, peer->name.len) == 0
+                        && ngx_memn2cmp(hash[k]->server.data,
+                                        peer->server.data,
+                                        hash[k]->server.len,
+                                        peer->server.len) == 0)
+                        break;
+
+                m = hash[k];
+                if (m == NULL)
+                    continue;
+
+                ngx_rwlock_wlock(&peer->lock);
+
+                if (peer->down != m->down) {
+
+                    peer->down = m->down;
+
+                    if (!m->down)
+                        ngx_log_error(NGX_LOG_NOTICE, event->log, 0,
+                                      "[%V] %V: %V addr=%V up",
+                                      &event->opts->module,
+                                      &event->opts->upstream,
+                                      &m->server, &m->name);
+                    else if (!m->skip)
+                        ngx_log_error(NGX_LOG_WARN, event->log, 0,
+                                      "[%V] %V: %V addr=%V down",
+                                      &event->opts->module,
+                                      &event->opts->upstream,
+                                      &m->server, &m->name);
+                }
 
-            if (peer->down) {
-                peer->down = 0;
-                ngx_log_error(NGX_LOG_NOTICE, event->log, 0,
-                              "[%V] %V: %V addr=%V up",
-                              &module, &upstream, &server, &name);
+                ngx_rwlock_unlock(&peer->lock);
             }
-
-            ngx_rwlock_unlock(&peer->lock);
         }
 
         ngx_rwlock_unlock(&primary->rwlock);
     }
 
-    virtual void
-    down(ngx_flag_t skip = 0)
+    void
+    mark(ngx_flag_t down, ngx_flag_t skip)
     {
-        ngx_rwlock_rlock(&primary->rwlock);
+        ngx_dynamic_hc_mark_t  *m;
 
-        PeerT  *peer = find_peer();
+        if (event->marks == NULL) {
+            event->marks = ngx_array_create(event->pool, 4,
+                                            sizeof(ngx_dynamic_hc_mark_t));
+            if (event->marks == NULL)
+                goto nomem;
+        }
 
-        if (peer != NULL) {
+        m = (ngx_dynamic_hc_mark_t *) ngx_array_push(event->marks);
+        if (m == NULL)
+            goto nomem;
 
-            ngx_rwlock_wlock(&peer->lock);
+        m->server = server;
+        m->name = name;
+        m->down = down;
+        m->skip = skip;
 
-            if (!peer->down) {
-                peer->down = 1;
-                if (!skip) {
-                    ngx_log_error(NGX_LOG_WARN, event->log, 0,
-                                  "[%V] %V: %V addr=%V down",
-                                  &module, &upstream, &server, &name);
-                }
-            }
+        if (!event->apply.posted)
+            ngx_post_event(&event->apply, &ngx_posted_events);
+
+        return;
 
-            ngx_rwlock_unlock(&peer->lock);
+nomem:
+
+        ngx_log_error(NGX_LOG_ERR, event->log, 0,
+                      "[%V] %V: %V addr=%V no memory",
+                      &module, &upstream, &server, &name);
+    }
+
+protected:
+
+    virtual void
+    up()
+    {
+        if (state.local->down) {
+            mark(0, 0);
+            state.local->down = 0;
         }
+    }
 
-        ngx_rwlock_unlock(&primary->rwlock);
+    virtual void
+    down(ngx_flag_t skip = 0)
+    {
+        if (!state.local->down) {
+            mark(1, skip);
+            state.local->down = 1;
+        }
     }
 
 public:
 
     ngx_dynamic_healthcheck_peer_wrap(PeersT *peers,
         ngx_dynamic_healthcheck_event_t *event, ngx_dynamic_hc_state_node_t s)
-        : ngx_dynamic_healthcheck_peer(event, s), primary(peers)
+        : ngx_dynamic_healthcheck_peer(event, s)
     {
         name     = s.local->name;
         server   = s.local->server;
         upstream = s.local->upstream;
         module   = s.local->module;
 
+        if (event->apply.handler == NULL) {
+            event->primary = peers;
+            event->apply.handler = apply;
+            event->apply.data = event;
+            event->apply.log = event->log;
+        }
+
         event->remains++;
+        event->peers++;
     }
 
     virtual ~ngx_dynamic_healthcheck_peer_wrap()
     {
-        event->remains--;
+        if (--event->remains == 0 && event->in_progress)
+            ngx_post_event(&event->conf->event, &ngx_posted_events);
     }
 };
 
 
 ngx_int_t
-ngx_dynamic_healthcheck_match_buffer(ngx_str_t *pattern, ngx_str_t *s);
+ngx_dynamic_healthcheck_match_buffer(ngx_dynamic_hc_regex_t *re,
+    ngx_dynamic_healthcheck_opts_t *opts, ngx_str_t *s);
+
+ngx_int_t
+ngx_dynamic_healthcheck_match_stream(ngx_dynamic_hc_regex_t *re,
+    ngx_dynamic_healthcheck_opts_t *opts, ngx_buf_t *b,
+    ngx_flag_t *discarded);
 
 #endif /* NGX_DYNAMIC_HEALTHCHECK_PEER_H */
 
@@ -0,0 +1,367 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+#include "ngx_dynamic_healthcheck_redis.h"
+
+extern "C" {
+
+#include <ngx_core.h>
+
+}
+
+
+#define NGX_REDIS_MAX_DEPTH    4
+
+
+static ngx_str_t redis_auth = ngx_string("AUTH");
+static ngx_str_t redis_ping = ngx_string("PING");
+static ngx_str_t redis_role = ngx_string("ROLE");
+
+static ngx_str_t redis_pong      = ngx_string("PONG");
+static ngx_str_t redis_master    = ngx_string("master");
+static ngx_str_t redis_slave     = ngx_string("slave");
+static ngx_str_t redis_connected = ngx_string("connected");
+
+
+static size_t
+redis_bulk_len(ngx_str_t *s)
+{
+    return sizeof("$\r\n\r\n") - 1 + NGX_SIZE_T_LEN + s->len;
+}
+
+
+static u_char *
+redis_write_bulk(u_char *p, ngx_str_t *s)
+{
+    return ngx_sprintf(p, "$%uz\r\n%V\r\n", s->len, s);
+}
+
+
+static ngx_flag_t
+redis_str_eq(ngx_str_t *s, ngx_str_t *v)
+{
+    return s->len == v->len && ngx_strncasecmp(s->data, v->data, v->len) == 0;
+}
+
+
+// partial reply leaves *pos untouched and is parsed again with more data
+
+static ngx_int_t
+redis_line(u_char **pos, u_char *last, ngx_str_t *line)
+{
+    u_char  *p;
+
+    p = ngx_strlchr(*pos, last, LF);
+    if (p == NULL)
+        return NGX_AGAIN;
+
+    if (p == *pos || p[-1] != CR)
+        return NGX_ERROR;
+
+    line->data = *pos;
+    line->len = p - 1 - *pos;
+
+    *pos = p + 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+redis_len(ngx_str_t *line)
+{
+    if (line->len == 2 && line->data[0] == '-' && line->data[1] == '1')
+        return -1;
+
+    return ngx_atoi(line->data, line->len);
+}
+
+
+static ngx_int_t
+redis_parse(u_char **pos, u_char *last, ngx_uint_t depth,
+    ngx_dynamic_hc_redis_reply_t *r)
+{
+    u_char                        *p = *pos;
+    u_char                         type;
+    ngx_str_t                      line;
+    ngx_int_t                      n, i, rc;
+    ngx_dynamic_hc_redis_reply_t   elt;
+
+    if (depth > NGX_REDIS_MAX_DEPTH)
+        return NGX_ERROR;
+
+    if (p == last)
+        return NGX_AGAIN;
+
+    type = *p++;
+
+    rc = redis_line(&p, last, &line);
+    if (rc != NGX_OK)
+        return rc;
+
+    if (r != NULL) {
+        r->type = type;
+        r->str = line;
+        r->nelts = 0;
+    }
+
+    switch (type) {
+
+        case '+':
+        case '-':
+        case ':':
+            break;
+
+        case '$':
+            n = redis_len(&line);
+
+            if (n == NGX_ERROR)
+                return NGX_ERROR;
+
+            if (n == -1) {
+                if (r != NULL)
+                    ngx_str_null(&r->str);
+                break;
+            }
+
+            if (last - p < n + 2)
+                return NGX_AGAIN;
+
+            if (p[n] != CR || p[n + 1] != LF)
+                return NGX_ERROR;
+
+            if (r != NULL) {
+                r->str.data = p;
+                r->str.len = n;
+            }
+
+            p += n + 2;
+            break;
+
+        case '*':
+            n = redis_len(&line);
+
+            if (n == NGX_ERROR)
+                return NGX_ERROR;
+
+            for (i = 0; i < n; i++) {
+
+                rc = redis_parse(&p, last, depth + 1,
+                                 r != NULL && i < 4 ? &elt : NULL);
+                if (rc != NGX_OK)
+                    return rc;
+
+                if (r != NULL && i < 4)
+                    r->elts[r->nelts++] = elt.str;
+            }
+
+            break;
+
+        default:
+            return NGX_ERROR;
+    }
+
+    *pos = p;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+healthcheck_redis_helper::make_request(ngx_dynamic_healthcheck_opts_t *conf,
+    ngx_dynamic_hc_local_node_t *state)
+{
+    ngx_buf_t         *buf = state->buf;
+    ngx_connection_t  *c = state->pc.connection;
+    u_char            *p;
+    size_t             len;
+
+    auth = c->requests == 0 && conf->redis_password.len != 0;
+
+    len = sizeof("*1\r\n") - 1 + redis_bulk_len(&redis_ping);
+
+    if (auth)
+        len += sizeof("*3\r\n") - 1 + redis_bulk_len(&redis_auth)
+               + redis_bulk_len(&conf->redis_user)
+               + redis_bulk_len(&conf->redis_password);
+
+    if ((size_t) (buf->end - buf->last) < len) {
+        ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                      "[%V] %V: %V addr=%V, fd=%d redis "
+                      "healthcheck_buffer_size too small for the request",
+                      &module, &upstream, &server, &name, c->fd);
+        return NGX_ERROR;
+    }
+
+    p = buf->last;
+
+    // AUTH stays with the connection, keepalive checks send PING only
+
+    if (auth) {
+
+        if (conf->redis_user.len != 0) {
+            p = ngx_cpymem(p, "*3\r\n", 4);
+            p = redis_write_bulk(p, &redis_auth);
+            p = redis_write_bulk(p, &conf->redis_user);
+        } else {
+            p = ngx_cpymem(p, "*2\r\n", 4);
+            p = redis_write_bulk(p, &redis_auth);
+        }
+
+        p = redis_write_bulk(p, &conf->redis_password);
+    }
+
+    p = ngx_cpymem(p, "*1\r\n", 4);
+    p = redis_write_bulk(p, conf->redis_role == NGX_DYNAMIC_HC_REDIS_ANY
+                            ? &redis_ping : &redis_role);
+
+    buf->last = p;
+
+    replies = auth ? 2 : 1;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+healthcheck_redis_helper::reply(ngx_connection_t *c,
+    ngx_dynamic_healthcheck_opts_t *conf, ngx_dynamic_hc_redis_reply_t *r)
+{
+    if (r->type == '-') {
+        ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                      "[%V] %V: %V addr=%V, fd=%d redis error: %V",
+                      &module, &upstream, &server, &name, c->fd, &r->str);
+        return NGX_ERROR;
+    }
+
+    if (auth) {
+
+        auth = 0;
+
+        if (r->type == '+')
+            return NGX_AGAIN;
+
+        goto invalid;
+    }
+
+    if (conf->redis_role == NGX_DYNAMIC_HC_REDIS_ANY) {
+
+        if (r->type == '+' && redis_str_eq(&r->str, &redis_pong))
+            return NGX_OK;
+
+        goto invalid;
+    }
+
+    if (r->type != '*' || r->nelts == 0)
+        goto invalid;
+
+    if (conf->redis_role == NGX_DYNAMIC_HC_REDIS_MASTER) {
+
+        if (redis_str_eq(&r->elts[0], &redis_master))
+            return NGX_OK;
+
+    } else {
+
+        // replica with the link to the master up
+
+        if (redis_str_eq(&r->elts[0], &redis_slave)
+            && r->nelts >= 4
+            && redis_str_eq(&r->elts[3], &redis_connected))
+            return NGX_OK;
+    }
+
+    ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                  "[%V] %V: %V addr=%V, fd=%d redis role '%V' "
+                  "does not match",
+                  &module, &upstream, &server, &name, c->fd, &r->elts[0]);
+
+    return NGX_ERROR;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                  "[%V] %V: %V addr=%V, fd=%d redis unexpected reply",
+                  &module, &upstream, &server, &name, c->fd);
+
+    return NGX_ERROR;
+}
+
+
+ngx_int_t
+healthcheck_redis_helper::receive(ngx_dynamic_healthcheck_opts_t *conf,
+    ngx_dynamic_hc_local_node_t *state)
+{
+    ngx_connection_t              *c = state->pc.connection;
+    ngx_buf_t                     *buf = state->buf;
+    ngx_dynamic_hc_redis_reply_t   r;
+    ssize_t                        size;
+    size_t                         n;
+    ngx_int_t                      rc;
+    u_char                        *p;
+
+    for ( ;; ) {
+
+        if (buf->pos == buf->last)
+            buf->pos = buf->last = buf->start;
+
+        if (buf->last == buf->end) {
+
+            // incomplete reply is moved to the buffer start
+
+            n = buf->last - buf->pos;
+
+            if (buf->pos == buf->start) {
+                ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                              "[%V] %V: %V addr=%V, fd=%d redis "
+                              "healthcheck_buffer_size too small for a reply",
+                              &module, &upstream, &server, &name, c->fd);
+                return NGX_ERROR;
+            }
+
+            ngx_memmove(buf->start, buf->pos, n);
+            buf->pos = buf->start;
+            buf->last = buf->start + n;
+        }
+
+        size = c->recv(c, buf->last, buf->end - buf->last);
+
+        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "[%V] %V: %V addr=%V, fd=%d redis on_recv() recv: %z",
+                       &module, &upstream, &server, &name, c->fd, size);
+
+        if (size == NGX_AGAIN)
+            return NGX_AGAIN;
+
+        if (size == NGX_ERROR || size == 0)
+            return NGX_ERROR;
+
+        buf->last += size;
+
+        while (replies != 0) {
+
+            p = buf->pos;
+
+            rc = redis_parse(&p, buf->last, 0, &r);
+
+            if (rc == NGX_AGAIN)
+                break;
+
+            if (rc == NGX_ERROR) {
+                ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                              "[%V] %V: %V addr=%V, fd=%d redis "
+                              "protocol error",
+                              &module, &upstream, &server, &name, c->fd);
+                return NGX_ERROR;
+            }
+
+            buf->pos = p;
+            replies--;
+
+            rc = reply(c, conf, &r);
+
+            if (rc != NGX_AGAIN)
+                return rc;
+        }
+    }
+}
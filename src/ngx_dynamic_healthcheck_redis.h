@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+#ifndef NGX_DYNAMIC_HEALTHCHECK_REDIS_H
+#define NGX_DYNAMIC_HEALTHCHECK_REDIS_H
+
+
+#include "ngx_dynamic_healthcheck_tcp.h"
+
+
+typedef struct ngx_dynamic_hc_redis_reply_s ngx_dynamic_hc_redis_reply_t;
+
+struct ngx_dynamic_hc_redis_reply_s {
+    u_char                         type;
+    ngx_str_t                      str;
+    ngx_str_t                      elts[4];
+    ngx_uint_t                     nelts;
+};
+
+
+/*
+ * AUTH is sent on a new connection only, then PING or ROLE
+ * if the role of the peer is checked. The commands are pipelined.
+ */
+
+class healthcheck_redis_helper {
+
+private:
+
+    ngx_str_t   name;
+    ngx_str_t   server;
+    ngx_str_t   upstream;
+    ngx_str_t   module;
+
+    ngx_uint_t  replies;
+    ngx_flag_t  auth;
+
+private:
+
+    ngx_int_t reply(ngx_connection_t *c, ngx_dynamic_healthcheck_opts_t *conf,
+        ngx_dynamic_hc_redis_reply_t *r);
+
+public:
+
+    healthcheck_redis_helper(ngx_dynamic_hc_state_node_t s)
+        : replies(0), auth(0)
+    {
+        name     = s.local->name;
+        server   = s.local->server;
+        upstream = s.local->upstream;
+        module   = s.local->module;
+    }
+
+    ngx_int_t make_request(ngx_dynamic_healthcheck_opts_t *conf,
+        ngx_dynamic_hc_local_node_t *state);
+
+    ngx_int_t receive(ngx_dynamic_healthcheck_opts_t *conf,
+        ngx_dynamic_hc_local_node_t *state);
+};
+
+
+template <class PeersT, class PeerT> class ngx_dynamic_healthcheck_redis :
+    public ngx_dynamic_healthcheck_tcp<PeersT, PeerT>
+{
+
+    healthcheck_redis_helper helper;
+
+protected:
+
+    // the request is not logged, it may contain the password
+
+    virtual ngx_int_t
+    on_send(ngx_dynamic_hc_local_node_t *state)
+    {
+        ngx_buf_t         *buf = state->buf;
+        ngx_connection_t  *c = state->pc.connection;
+        ssize_t            size;
+
+        if (buf->last == buf->start)
+            if (helper.make_request(this->event->opts, state)
+                    == NGX_ERROR)
+                return NGX_ERROR;
+
+        size = c->send(c, buf->pos, buf->last - buf->pos);
+
+        if (size == NGX_ERROR)
+            return NGX_ERROR;
+
+        if (size == NGX_AGAIN)
+            return NGX_AGAIN;
+
+        buf->pos += size;
+
+        return buf->pos == buf->last ? NGX_OK : NGX_AGAIN;
+    }
+
+    virtual ngx_int_t
+    on_recv(ngx_dynamic_hc_local_node_t *state)
+    {
+        return helper.receive(this->event->opts, state);
+    }
+
+public:
+
+    ngx_dynamic_healthcheck_redis(PeersT *peers,
+        ngx_dynamic_healthcheck_event_t *event, ngx_dynamic_hc_state_node_t s)
+        : ngx_dynamic_healthcheck_tcp<PeersT, PeerT>(peers, event, s),
+          helper(s)
+    {}
+};
+
+
+#endif /* NGX_DYNAMIC_HEALTHCHECK_REDIS_H */
@@ -0,0 +1,294 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+#include "ngx_dynamic_healthcheck_regex.h"
+
+
+/*
+ * Drops the scanned data which can not be a part of a match anymore.
+ * 'start' is the offset of the earliest partial match (or the end of
+ * data if there is none), the lookbehind of the pattern is kept before it.
+ * The next scan resumes from 'start', so each byte outside of a pending
+ * partial match is scanned only once. Once the data is dropped the buffer
+ * start is not the subject start anymore, '*discarded' is set for NOTBOL.
+ */
+
+static ngx_int_t
+ngx_dynamic_healthcheck_regex_slide(ngx_dynamic_hc_regex_t *re, ngx_buf_t *b,
+    size_t start, ngx_flag_t *discarded)
+{
+    size_t  keep = 0;
+
+    if (start > re->lookbehind)
+        keep = start - re->lookbehind;
+
+    if (keep != 0) {
+        b->last = ngx_movemem(b->start, b->start + keep,
+                              b->last - b->start - keep);
+        start -= keep;
+        *discarded = 1;
+    }
+
+    b->pos = b->start + start;
+
+    return NGX_AGAIN;
+}
+
+
+#if (NGX_PCRE2)
+
+/*
+ * Patterns are compiled with the default pcre2 contexts (libc allocator),
+ * not with ngx_regex_compile(): nginx allocates runtime regexes from
+ * a pool which is not available later for pcre2_jit_compile().
+ */
+
+ngx_int_t
+ngx_dynamic_healthcheck_regex_compile(ngx_dynamic_hc_regex_t *re,
+    ngx_str_t *pattern, ngx_uint_t generation, ngx_log_t *log)
+{
+    int         errcode;
+    PCRE2_SIZE  erroff;
+    uint32_t    lookbehind;
+    u_char      errstr[NGX_MAX_CONF_ERRSTR];
+
+    if (re->compiled && re->generation == generation)
+        return re->code != NULL ? NGX_OK : NGX_ERROR;
+
+    ngx_dynamic_healthcheck_regex_free(re);
+
+    re->code = pcre2_compile((PCRE2_SPTR) pattern->data, pattern->len,
+                             PCRE2_DOTALL, &errcode, &erroff, NULL);
+    if (re->code == NULL) {
+        pcre2_get_error_message(errcode, errstr, NGX_MAX_CONF_ERRSTR);
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "healthcheck: pattern '%V' compile error: %s at %uz",
+                      pattern, errstr, (size_t) erroff);
+        goto failed;
+    }
+
+    re->jit = pcre2_jit_compile(re->code, PCRE2_JIT_COMPLETE
+                                          |PCRE2_JIT_PARTIAL_SOFT) == 0;
+
+    if (pcre2_pattern_info(re->code, PCRE2_INFO_MAXLOOKBEHIND, &lookbehind)
+            == 0)
+        re->lookbehind = lookbehind;
+
+    re->match_data = pcre2_match_data_create_from_pattern(re->code, NULL);
+    if (re->match_data == NULL) {
+        ngx_dynamic_healthcheck_regex_free(re);
+        ngx_log_error(NGX_LOG_CRIT, log, 0, "match: no memory");
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "healthcheck: pattern '%V' compiled, jit=%d",
+                   pattern, re->jit);
+
+failed:
+
+    re->compiled = 1;
+    re->generation = generation;
+
+    return re->code != NULL ? NGX_OK : NGX_ERROR;
+}
+
+
+ngx_int_t
+ngx_dynamic_healthcheck_regex_exec(ngx_dynamic_hc_regex_t *re, ngx_str_t *s)
+{
+    int  rc;
+
+    if (re->code == NULL)
+        return NGX_ERROR;
+
+    rc = pcre2_match(re->code, (PCRE2_SPTR) s->data, s->len, 0, 0,
+                     re->match_data, NULL);
+
+    if (rc == PCRE2_ERROR_NOMATCH)
+        return NGX_DECLINED;
+
+    return rc >= 0 ? NGX_OK : NGX_ERROR;
+}
+
+
+ngx_int_t
+ngx_dynamic_healthcheck_regex_exec_partial(ngx_dynamic_hc_regex_t *re,
+    ngx_buf_t *b, ngx_flag_t *discarded)
+{
+    int          rc;
+    size_t       start;
+
+    if (re->code == NULL)
+        return NGX_ERROR;
+
+    rc = pcre2_match(re->code, (PCRE2_SPTR) b->start, b->last - b->start,
+                     b->pos - b->start,
+                     PCRE2_PARTIAL_SOFT|(*discarded ? PCRE2_NOTBOL : 0),
+                     re->match_data, NULL);
+
+    if (rc >= 0)
+        return NGX_OK;
+
+    switch (rc) {
+
+        case PCRE2_ERROR_PARTIAL:
+            start = pcre2_get_ovector_pointer(re->match_data)[0];
+            break;
+
+        case PCRE2_ERROR_NOMATCH:
+            start = b->last - b->start;
+            break;
+
+        default:
+            return NGX_ERROR;
+    }
+
+    return ngx_dynamic_healthcheck_regex_slide(re, b, start, discarded);
+}
+
+
+void
+ngx_dynamic_healthcheck_regex_free(ngx_dynamic_hc_regex_t *re)
+{
+    if (re->match_data != NULL)
+        pcre2_match_data_free(re->match_data);
+
+    if (re->code != NULL)
+        pcre2_code_free(re->code);
+
+    re->match_data = NULL;
+    re->code = NULL;
+    re->compiled = 0;
+    re->jit = 0;
+    re->lookbehind = 0;
+}
+
+#else
+
+ngx_int_t
+ngx_dynamic_healthcheck_regex_compile(ngx_dynamic_hc_regex_t *re,
+    ngx_str_t *pattern, ngx_uint_t generation, ngx_log_t *log)
+{
+    ngx_regex_compile_t   rc;
+    u_char                errstr[NGX_MAX_CONF_ERRSTR];
+#ifdef PCRE_INFO_MAXLOOKBEHIND
+    int                   lookbehind;
+#endif
+
+    if (re->compiled && re->generation == generation)
+        return re->regex != NULL ? NGX_OK : NGX_ERROR;
+
+    ngx_dynamic_healthcheck_regex_free(re);
+
+    re->pool = ngx_create_pool(1024, log);
+    if (re->pool == NULL) {
+        ngx_log_error(NGX_LOG_CRIT, log, 0, "match: no memory");
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
+
+    rc.pattern = *pattern;
+    rc.err.len = NGX_MAX_CONF_ERRSTR;
+    rc.err.data = errstr;
+    rc.pool = re->pool;
+#ifdef NGX_REGEX_DOTALL
+    rc.options = NGX_REGEX_DOTALL;
+#endif
+
+    if (ngx_regex_compile(&rc) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "healthcheck: pattern '%V' compile error: %V",
+                      pattern, &rc.err);
+        ngx_destroy_pool(re->pool);
+        re->pool = NULL;
+        goto failed;
+    }
+
+    re->regex = rc.regex;
+
+#ifdef PCRE_INFO_MAXLOOKBEHIND
+    if (pcre_fullinfo(re->regex->code, re->regex->extra,
+                      PCRE_INFO_MAXLOOKBEHIND, &lookbehind) == 0)
+        re->lookbehind = lookbehind;
+#endif
+
+failed:
+
+    re->compiled = 1;
+    re->generation = generation;
+
+    return re->regex != NULL ? NGX_OK : NGX_ERROR;
+}
+
+
+ngx_int_t
+ngx_dynamic_healthcheck_regex_exec(ngx_dynamic_hc_regex_t *re, ngx_str_t *s)
+{
+    ngx_int_t  rc;
+
+    if (re->regex == NULL)
+        return NGX_ERROR;
+
+    rc = ngx_regex_exec(re->regex, s, NULL, 0);
+
+    if (rc == NGX_REGEX_NO_MATCHED)
+        return NGX_DECLINED;
+
+    return rc >= 0 ? NGX_OK : NGX_ERROR;
+}
+
+
+ngx_int_t
+ngx_dynamic_healthcheck_regex_exec_partial(ngx_dynamic_hc_regex_t *re,
+    ngx_buf_t *b, ngx_flag_t *discarded)
+{
+    int     rc;
+    int     captures[3];
+    size_t  start;
+
+    if (re->regex == NULL)
+        return NGX_ERROR;
+
+    rc = pcre_exec(re->regex->code, re->regex->extra, (const char *) b->start,
+                   b->last - b->start, b->pos - b->start,
+                   PCRE_PARTIAL_SOFT|(*discarded ? PCRE_NOTBOL : 0),
+                   captures, 3);
+
+    if (rc >= 0)
+        return NGX_OK;
+
+    switch (rc) {
+
+        case PCRE_ERROR_PARTIAL:
+            start = captures[0];
+            break;
+
+        case PCRE_ERROR_NOMATCH:
+            start = b->last - b->start;
+            break;
+
+        default:
+            return NGX_ERROR;
+    }
+
+    return ngx_dynamic_healthcheck_regex_slide(re, b, start, discarded);
+}
+
+
+void
+ngx_dynamic_healthcheck_regex_free(ngx_dynamic_hc_regex_t *re)
+{
+    if (re->pool != NULL)
+        ngx_destroy_pool(re->pool);
+
+    re->pool = NULL;
+    re->regex = NULL;
+    re->compiled = 0;
+    re->jit = 0;
+    re->lookbehind = 0;
+}
+
+#endif
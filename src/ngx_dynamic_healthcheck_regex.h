@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+#ifndef NGX_DYNAMIC_HEALTHCHECK_REGEX_H
+#define NGX_DYNAMIC_HEALTHCHECK_REGEX_H
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include <ngx_core.h>
+
+
+/*
+ * Worker local compiled 'check_response_body' pattern.
+ * Recompiled only when the options generation changes.
+ */
+
+typedef struct {
+    ngx_uint_t                     generation;
+    size_t                         lookbehind;
+    unsigned                       compiled:1;
+    unsigned                       jit:1;
+#if (NGX_PCRE2)
+    pcre2_code                    *code;
+    pcre2_match_data              *match_data;
+#else
+    ngx_regex_t                   *regex;
+    ngx_pool_t                    *pool;
+#endif
+} ngx_dynamic_hc_regex_t;
+
+
+ngx_int_t
+ngx_dynamic_healthcheck_regex_compile(ngx_dynamic_hc_regex_t *re,
+    ngx_str_t *pattern, ngx_uint_t generation, ngx_log_t *log);
+
+ngx_int_t
+ngx_dynamic_healthcheck_regex_exec(ngx_dynamic_hc_regex_t *re, ngx_str_t *s);
+
+ngx_int_t
+ngx_dynamic_healthcheck_regex_exec_partial(ngx_dynamic_hc_regex_t *re,
+    ngx_buf_t *b, ngx_flag_t *discarded);
+
+void
+ngx_dynamic_healthcheck_regex_free(ngx_dynamic_hc_regex_t *re);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* NGX_DYNAMIC_HEALTHCHECK_REGEX_H */
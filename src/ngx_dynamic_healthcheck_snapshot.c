@@ -0,0 +1,380 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+#include "ngx_dynamic_healthcheck_snapshot.h"
+#include "ngx_dynamic_healthcheck_workers.h"
+
+
+/*
+ * a writer which has died in the middle of publishing leaves 'seq' odd,
+ * readers take the lock after this number of attempts
+ */
+#define NGX_DYNAMIC_HC_SNAPSHOT_SPINS  1024
+
+
+static size_t
+ngx_dynamic_healthcheck_str_size(ngx_str_t *s)
+{
+    return s->len != 0 ? ngx_align(s->len + 1, sizeof(void *)) : 0;
+}
+
+
+static size_t
+ngx_dynamic_healthcheck_str_array_size(ngx_str_array_t *a)
+{
+    size_t      size;
+    ngx_uint_t  i;
+
+    size = a->len * sizeof(ngx_str_t);
+
+    for (i = 0; i < a->len; i++)
+        size += ngx_dynamic_healthcheck_str_size(&a->data[i]);
+
+    return size;
+}
+
+
+static size_t
+ngx_dynamic_healthcheck_snapshot_size(ngx_dynamic_healthcheck_opts_t *sh)
+{
+    size_t         size;
+    ngx_uint_t     i;
+    ngx_keyval_t  *kv;
+
+    size = ngx_align(sizeof(ngx_dynamic_hc_snapshot_t), sizeof(void *))
+           + ngx_dynamic_healthcheck_str_size(&sh->module)
+           + ngx_dynamic_healthcheck_str_size(&sh->upstream)
+           + ngx_dynamic_healthcheck_str_size(&sh->type)
+           + ngx_dynamic_healthcheck_str_size(&sh->request_uri)
+           + ngx_dynamic_healthcheck_str_size(&sh->request_method)
+           + ngx_dynamic_healthcheck_str_size(&sh->request_body)
+           + ngx_dynamic_healthcheck_str_size(&sh->response_body)
+           + ngx_dynamic_healthcheck_str_size(&sh->persistent)
+           + sh->response_codes.len * sizeof(ngx_int_t)
+           + sh->request_headers.len * sizeof(ngx_keyval_t)
+           + ngx_dynamic_healthcheck_str_array_size(&sh->disabled_hosts_global)
+           + ngx_dynamic_healthcheck_str_array_size(&sh->disabled_hosts)
+           + ngx_dynamic_healthcheck_str_array_size(&sh->disabled_hosts_manual)
+           + ngx_dynamic_healthcheck_str_array_size(&sh->excluded_hosts);
+
+    for (i = 0; i < sh->request_headers.len; i++) {
+        kv = &sh->request_headers.data[i];
+        size += ngx_dynamic_healthcheck_str_size(&kv->key)
+                + ngx_dynamic_healthcheck_str_size(&kv->value);
+    }
+
+    return size;
+}
+
+
+static void
+ngx_dynamic_healthcheck_put_str(ngx_str_t *dst, ngx_str_t *src, u_char *base,
+    u_char **p)
+{
+    dst->len = src->len;
+    dst->data = NULL;
+
+    if (src->len == 0)
+        return;
+
+    ngx_memcpy(*p, src->data, src->len);
+    (*p)[src->len] = 0;
+
+    dst->data = (u_char *) (*p - base);
+
+    *p += ngx_dynamic_healthcheck_str_size(src);
+}
+
+
+static void
+ngx_dynamic_healthcheck_put_str_array(ngx_str_array_t *dst,
+    ngx_str_array_t *src, u_char *base, u_char **p)
+{
+    ngx_str_t   *a = (ngx_str_t *) *p;
+    ngx_uint_t   i;
+
+    dst->len = src->len;
+    dst->reserved = src->len;
+    dst->data = NULL;
+
+    if (src->len == 0)
+        return;
+
+    *p += src->len * sizeof(ngx_str_t);
+
+    for (i = 0; i < src->len; i++)
+        ngx_dynamic_healthcheck_put_str(&a[i], &src->data[i], base, p);
+
+    dst->data = (ngx_str_t *) ((u_char *) a - base);
+}
+
+
+static void
+ngx_dynamic_healthcheck_snapshot_fill(u_char *base,
+    ngx_dynamic_healthcheck_opts_t *sh, size_t size)
+{
+    ngx_dynamic_hc_snapshot_t       *snap = (ngx_dynamic_hc_snapshot_t *) base;
+    ngx_dynamic_healthcheck_opts_t  *opts = &snap->opts;
+    ngx_keyval_t                    *kv;
+    u_char                          *p;
+    ngx_uint_t                       i;
+
+    snap->size = size;
+
+    *opts = *sh;
+
+    ngx_memzero(&opts->state, sizeof(ngx_dynamic_hc_shared_t));
+    opts->snapshot = NULL;
+    opts->seq = 0;
+
+    // changed by the rounds without a publish, read from the zone only
+
+    opts->updated = 0;
+    opts->last = 0;
+    opts->round = 0;
+    opts->loaded = 0;
+    opts->npeers = 0;
+    opts->cost = 0;
+
+    p = base + ngx_align(sizeof(ngx_dynamic_hc_snapshot_t), sizeof(void *));
+
+    ngx_dynamic_healthcheck_put_str(&opts->module, &sh->module, base, &p);
+    ngx_dynamic_healthcheck_put_str(&opts->upstream, &sh->upstream, base, &p);
+    ngx_dynamic_healthcheck_put_str(&opts->type, &sh->type, base, &p);
+    ngx_dynamic_healthcheck_put_str(&opts->request_uri, &sh->request_uri,
+                                    base, &p);
+    ngx_dynamic_healthcheck_put_str(&opts->request_method,
+                                    &sh->request_method, base, &p);
+    ngx_dynamic_healthcheck_put_str(&opts->request_body, &sh->request_body,
+                                    base, &p);
+    ngx_dynamic_healthcheck_put_str(&opts->response_body, &sh->response_body,
+                                    base, &p);
+    ngx_dynamic_healthcheck_put_str(&opts->persistent, &sh->persistent,
+                                    base, &p);
+
+    opts->response_codes.reserved = sh->response_codes.len;
+    opts->response_codes.data = NULL;
+
+    if (sh->response_codes.len != 0) {
+        ngx_memcpy(p, sh->response_codes.data,
+                   sh->response_codes.len * sizeof(ngx_int_t));
+        opts->response_codes.data = (ngx_int_t *) (p - base);
+        p += sh->response_codes.len * sizeof(ngx_int_t);
+    }
+
+    opts->request_headers.reserved = sh->request_headers.len;
+    opts->request_headers.data = NULL;
+
+    if (sh->request_headers.len != 0) {
+
+        kv = (ngx_keyval_t *) p;
+        p += sh->request_headers.len * sizeof(ngx_keyval_t);
+
+        for (i = 0; i < sh->request_headers.len; i++) {
+            ngx_dynamic_healthcheck_put_str(&kv[i].key,
+                &sh->request_headers.data[i].key, base, &p);
+            ngx_dynamic_healthcheck_put_str(&kv[i].value,
+                &sh->request_headers.data[i].value, base, &p);
+        }
+
+        opts->request_headers.data = (ngx_keyval_t *) ((u_char *) kv - base);
+    }
+
+    ngx_dynamic_healthcheck_put_str_array(&opts->disabled_hosts_global,
+        &sh->disabled_hosts_global, base, &p);
+    ngx_dynamic_healthcheck_put_str_array(&opts->disabled_hosts,
+        &sh->disabled_hosts, base, &p);
+    ngx_dynamic_healthcheck_put_str_array(&opts->disabled_hosts_manual,
+        &sh->disabled_hosts_manual, base, &p);
+    ngx_dynamic_healthcheck_put_str_array(&opts->excluded_hosts,
+        &sh->excluded_hosts, base, &p);
+}
+
+
+#define ngx_dynamic_healthcheck_rebase(base, p)                              \
+    if ((p) != NULL)                                                         \
+        (p) = (void *) ((base) + (uintptr_t) (p))
+
+
+static void
+ngx_dynamic_healthcheck_rebase_str_array(ngx_str_array_t *a, u_char *base)
+{
+    ngx_uint_t  i;
+
+    ngx_dynamic_healthcheck_rebase(base, a->data);
+
+    for (i = 0; i < a->len; i++)
+        ngx_dynamic_healthcheck_rebase(base, a->data[i].data);
+}
+
+
+static ngx_dynamic_healthcheck_opts_t *
+ngx_dynamic_healthcheck_snapshot_rebase(u_char *base)
+{
+    ngx_dynamic_healthcheck_opts_t  *opts;
+    ngx_keyval_t                    *kv;
+    ngx_uint_t                       i;
+
+    opts = &((ngx_dynamic_hc_snapshot_t *) base)->opts;
+
+    ngx_dynamic_healthcheck_rebase(base, opts->module.data);
+    ngx_dynamic_healthcheck_rebase(base, opts->upstream.data);
+    ngx_dynamic_healthcheck_rebase(base, opts->type.data);
+    ngx_dynamic_healthcheck_rebase(base, opts->request_uri.data);
+    ngx_dynamic_healthcheck_rebase(base, opts->request_method.data);
+    ngx_dynamic_healthcheck_rebase(base, opts->request_body.data);
+    ngx_dynamic_healthcheck_rebase(base, opts->response_body.data);
+    ngx_dynamic_healthcheck_rebase(base, opts->persistent.data);
+    ngx_dynamic_healthcheck_rebase(base, opts->response_codes.data);
+    ngx_dynamic_healthcheck_rebase(base, opts->request_headers.data);
+
+    for (i = 0; i < opts->request_headers.len; i++) {
+        kv = &opts->request_headers.data[i];
+        ngx_dynamic_healthcheck_rebase(base, kv->key.data);
+        ngx_dynamic_healthcheck_rebase(base, kv->value.data);
+    }
+
+    ngx_dynamic_healthcheck_rebase_str_array(&opts->disabled_hosts_global,
+                                             base);
+    ngx_dynamic_healthcheck_rebase_str_array(&opts->disabled_hosts, base);
+    ngx_dynamic_healthcheck_rebase_str_array(&opts->disabled_hosts_manual,
+                                             base);
+    ngx_dynamic_healthcheck_rebase_str_array(&opts->excluded_hosts, base);
+
+    return opts;
+}
+
+
+/*
+ * Called with the zone mutex held after each change of the options.
+ * On allocation error the snapshot is dropped, readers copy the options
+ * under the lock until the next successful publish.
+ */
+
+ngx_int_t
+ngx_dynamic_healthcheck_snapshot_publish(ngx_dynamic_healthcheck_opts_t *sh)
+{
+    ngx_slab_pool_t            *slab = sh->state.slab;
+    ngx_dynamic_hc_snapshot_t  *snap, *old;
+    size_t                      size;
+
+    size = ngx_dynamic_healthcheck_snapshot_size(sh);
+
+    snap = ngx_slab_alloc_locked(slab, size);
+    if (snap != NULL)
+        ngx_dynamic_healthcheck_snapshot_fill((u_char *) snap, sh, size);
+
+    old = sh->snapshot;
+
+    sh->seq++;
+    ngx_memory_barrier();
+
+    sh->snapshot = snap;
+
+    ngx_memory_barrier();
+    sh->seq++;
+
+    // memory of the zone stays mapped, late readers fail on 'seq'
+
+    if (old != NULL)
+        ngx_slab_free_locked(slab, old);
+
+    if (snap == NULL) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                      "[%V] %V: no memory for options snapshot",
+                      &sh->module, &sh->upstream);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_dynamic_healthcheck_opts_t *
+ngx_dynamic_healthcheck_snapshot_locked(ngx_dynamic_healthcheck_opts_t *sh,
+    ngx_pool_t *pool)
+{
+    ngx_slab_pool_t  *slab = sh->state.slab;
+    u_char           *base;
+    size_t            size;
+
+    ngx_dynamic_healthcheck_shmtx_lock(&slab->mutex);
+
+    size = ngx_dynamic_healthcheck_snapshot_size(sh);
+
+    base = ngx_palloc(pool, size);
+    if (base != NULL)
+        ngx_dynamic_healthcheck_snapshot_fill(base, sh, size);
+
+    ngx_dynamic_healthcheck_shmtx_unlock(&slab->mutex);
+
+    if (base == NULL)
+        return NULL;
+
+    return ngx_dynamic_healthcheck_snapshot_rebase(base);
+}
+
+
+ngx_dynamic_healthcheck_opts_t *
+ngx_dynamic_healthcheck_snapshot_read(ngx_dynamic_healthcheck_opts_t *sh,
+    ngx_pool_t *pool)
+{
+    ngx_slab_pool_t            *slab = sh->state.slab;
+    ngx_dynamic_hc_snapshot_t  *snap;
+    ngx_atomic_uint_t           seq;
+    ngx_uint_t                  spin;
+    u_char                     *base = NULL;
+    size_t                      size, reserved = 0;
+
+    for (spin = 0; spin < NGX_DYNAMIC_HC_SNAPSHOT_SPINS; spin++) {
+
+        if (spin != 0)
+            ngx_cpu_pause();
+
+        seq = sh->seq;
+        ngx_memory_barrier();
+
+        if (seq & 1)
+            continue;
+
+        snap = sh->snapshot;
+        if (snap == NULL)
+            break;
+
+        // the snapshot may be freed under our feet, do not leave the zone
+
+        if ((u_char *) snap < slab->start
+            || (u_char *) snap + sizeof(ngx_dynamic_hc_snapshot_t) > slab->end)
+            continue;
+
+        size = snap->size;
+
+        if (size < sizeof(ngx_dynamic_hc_snapshot_t)
+            || size > (size_t) (slab->end - (u_char *) snap))
+            continue;
+
+        // a size read from a freed snapshot is garbage, do not allocate it
+
+        ngx_memory_barrier();
+
+        if (sh->seq != seq)
+            continue;
+
+        if (size > reserved) {
+            base = ngx_palloc(pool, size);
+            if (base == NULL)
+                return NULL;
+            reserved = size;
+        }
+
+        ngx_memcpy(base, snap, size);
+
+        ngx_memory_barrier();
+
+        if (sh->seq == seq)
+            return ngx_dynamic_healthcheck_snapshot_rebase(base);
+    }
+
+    return ngx_dynamic_healthcheck_snapshot_locked(sh, pool);
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+#ifndef NGX_DYNAMIC_HEALTHCHECK_SNAPSHOT_H
+#define NGX_DYNAMIC_HEALTHCHECK_SNAPSHOT_H
+
+
+#include "ngx_dynamic_healthcheck.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/*
+ * Immutable copy of the options in the shared zone. Strings and arrays
+ * follow the header, pointers are stored as offsets from the header,
+ * so a reader takes it with a single memcpy().
+ *
+ * Writers hold the zone mutex, build a new snapshot and swap
+ * the pointer between two increments of 'seq'. Readers do not lock,
+ * they copy the snapshot and retry if 'seq' has changed meanwhile.
+ *
+ * The state of the rounds ('updated', 'last', 'round', 'loaded',
+ * 'npeers', 'cost') changes without a publish, it is zeroed in
+ * the snapshot and read from the zone.
+ */
+
+struct ngx_dynamic_healthcheck_snapshot_s {
+    size_t                           size;
+    ngx_dynamic_healthcheck_opts_t   opts;
+};
+
+
+ngx_int_t
+ngx_dynamic_healthcheck_snapshot_publish(ngx_dynamic_healthcheck_opts_t *sh);
+
+ngx_dynamic_healthcheck_opts_t *
+ngx_dynamic_healthcheck_snapshot_read(ngx_dynamic_healthcheck_opts_t *sh,
+    ngx_pool_t *pool);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* NGX_DYNAMIC_HEALTHCHECK_SNAPSHOT_H */
@@ -3,43 +3,518 @@
  */
 
 #include "ngx_dynamic_healthcheck_state.h"
+#include "ngx_dynamic_healthcheck_workers.h"
 
 
 #define ngx_stack_alloc(n) alloca(n)
 
 
+#define NGX_DYNAMIC_HC_PEER_STAT_SIZE                                        \
+    ngx_align(sizeof(ngx_dynamic_hc_peer_stat_t), NGX_CPU_CACHE_LINE)
+
+
+// requests to observe before the peer is compared with others
+#define NGX_DYNAMIC_HC_OUTLIER_MIN        20
+
+// ejection time doubles up to 2^6 times
+#define NGX_DYNAMIC_HC_OUTLIER_BACKOFF    6
+
+// index builds without the lock before the lock is taken
+#define NGX_DYNAMIC_HC_INDEX_ATTEMPTS     4
+
+// red-black tree of all nodes a zone may hold is not deeper
+#define NGX_DYNAMIC_HC_INDEX_DEPTH        128
+
+
+static ngx_dynamic_hc_peer_stat_t *
+ngx_dynamic_healthcheck_stat_alloc(ngx_dynamic_hc_shared_t *state)
+{
+    ngx_dynamic_hc_peer_stat_t  *stat = state->free;
+
+    if (stat == NULL)
+        return ngx_slab_calloc_locked(state->slab,
+                                      NGX_DYNAMIC_HC_PEER_STAT_SIZE);
+
+    state->free = stat->next;
+
+    stat->reuse++;
+
+    ngx_memory_barrier();
+
+    ngx_memzero(stat, offsetof(ngx_dynamic_hc_peer_stat_t, reuse));
+
+    return stat;
+}
+
+
+static ngx_flag_t
+ngx_dynamic_healthcheck_in_zone(ngx_slab_pool_t *slab, void *p, size_t size)
+{
+    return (u_char *) p >= slab->start
+           && (u_char *) p <= slab->end
+           && size <= (size_t) (slab->end - (u_char *) p);
+}
+
+
+/*
+ * The tree may be changed by another worker during the walk without
+ * the lock: the nodes are checked to be in the zone and the walk is
+ * bounded, the result is thrown away if the generation has changed.
+ */
+
+static ngx_int_t
+ngx_dynamic_healthcheck_index_collect(ngx_dynamic_hc_shared_t *shared,
+    ngx_rbtree_node_t *node, ngx_array_t *a, ngx_uint_t depth, ngx_uint_t max)
+{
+    ngx_dynamic_hc_shared_node_t  *n = (ngx_dynamic_hc_shared_node_t *) node;
+    ngx_dynamic_hc_index_entry_t  *e;
+    ngx_dynamic_hc_peer_stat_t    *stat;
+    ngx_slab_pool_t               *slab = shared->slab;
+    ngx_str_t                      key;
+    ngx_int_t                      rc;
+
+    if (node == &shared->sentinel)
+        return NGX_OK;
+
+    if (depth == NGX_DYNAMIC_HC_INDEX_DEPTH
+        || a->nelts == max
+        || !ngx_dynamic_healthcheck_in_zone(slab, n, sizeof(*n)))
+        return NGX_DECLINED;
+
+    key = n->key.str;
+    stat = n->stat;
+
+    if (key.len == 0
+        || !ngx_dynamic_healthcheck_in_zone(slab, key.data, key.len)
+        || !ngx_dynamic_healthcheck_in_zone(slab, stat, sizeof(*stat)))
+        return NGX_DECLINED;
+
+    e = ngx_array_push(a);
+    if (e == NULL)
+        return NGX_ERROR;
+
+    e->key.data = ngx_pnalloc(a->pool, key.len);
+    if (e->key.data == NULL)
+        return NGX_ERROR;
+
+    ngx_memcpy(e->key.data, key.data, key.len);
+    e->key.len = key.len;
+
+    e->node = n;
+    e->stat = stat;
+    e->reuse = stat->reuse;
+
+    e->name.data = e->key.data;
+    e->name.len = ngx_min(n->name_len, key.len);
+
+    rc = ngx_dynamic_healthcheck_index_collect(shared, node->left, a,
+                                               depth + 1, max);
+    if (rc != NGX_OK)
+        return rc;
+
+    return ngx_dynamic_healthcheck_index_collect(shared, node->right, a,
+                                                 depth + 1, max);
+}
+
+
+static ngx_dynamic_hc_index_entry_t *
+ngx_dynamic_healthcheck_index_find(ngx_dynamic_hc_index_t *index,
+    ngx_str_t *key)
+{
+    ngx_uint_t                     i;
+    ngx_dynamic_hc_index_entry_t  *e;
+
+    for (i = ngx_hash_key(key->data, key->len) & index->mask;
+         ;
+         i = (i + 1) & index->mask)
+    {
+        e = &index->entries[i];
+
+        if (e->node == NULL)
+            return e;
+
+        if (e->key.len == key->len
+            && ngx_memcmp(e->key.data, key->data, key->len) == 0)
+            return e;
+    }
+}
+
+
+static ngx_dynamic_hc_index_entry_t **
+ngx_dynamic_healthcheck_index_find_name(ngx_dynamic_hc_index_t *index,
+    ngx_str_t *name, ngx_uint_t hash)
+{
+    ngx_uint_t                     i;
+    ngx_dynamic_hc_index_entry_t  *e;
+
+    for (i = hash & index->mask; ; i = (i + 1) & index->mask) {
+
+        e = index->names[i];
+
+        if (e == NULL)
+            return &index->names[i];
+
+        if (e->hash == hash
+            && e->name.len == name->len
+            && ngx_memcmp(e->name.data, name->data, name->len) == 0)
+            return &index->names[i];
+    }
+}
+
+
+/*
+ * Builds the index into a new pool, it replaces the old one only
+ * if the tree has not been changed meanwhile. The keys are copied,
+ * the nodes are dereferenced by the readers after the generation
+ * check only.
+ */
+
+static ngx_int_t
+ngx_dynamic_healthcheck_index_build(ngx_dynamic_hc_state_t *state)
+{
+    ngx_dynamic_hc_index_t         index;
+    ngx_dynamic_hc_index_entry_t  *src, *e, **head;
+    ngx_dynamic_hc_shared_t       *shared = state->shared;
+    ngx_array_t                    a;
+    ngx_atomic_uint_t              generation;
+    ngx_uint_t                     i, max, size = 8;
+    ngx_int_t                      rc;
+
+    generation = shared->generation;
+    ngx_memory_barrier();
+
+    // odd while the tree is being changed
+
+    if (generation & 1)
+        return NGX_DECLINED;
+
+    ngx_memzero(&index, sizeof(ngx_dynamic_hc_index_t));
+
+    index.pool = ngx_create_pool(ngx_pagesize, ngx_cycle->log);
+    if (index.pool == NULL)
+        return NGX_ERROR;
+
+    if (ngx_array_init(&a, index.pool, 64,
+                       sizeof(ngx_dynamic_hc_index_entry_t)) != NGX_OK)
+        goto nomem;
+
+    // a tree of garbage has no more nodes than the zone may hold
+
+    max = (shared->slab->end - shared->slab->start)
+          / sizeof(ngx_dynamic_hc_shared_node_t);
+
+    rc = ngx_dynamic_healthcheck_index_collect(shared, shared->rbtree.root,
+                                               &a, 0, max);
+    if (rc == NGX_ERROR)
+        goto nomem;
+
+    ngx_memory_barrier();
+
+    if (rc != NGX_OK || shared->generation != generation) {
+        ngx_destroy_pool(index.pool);
+        return NGX_DECLINED;
+    }
+
+    while (size < 2 * a.nelts)
+        size <<= 1;
+
+    index.entries = ngx_pcalloc(index.pool,
+                                size * sizeof(ngx_dynamic_hc_index_entry_t));
+    if (index.entries == NULL)
+        goto nomem;
+
+    index.names = ngx_pcalloc(index.pool,
+                              size * sizeof(ngx_dynamic_hc_index_entry_t *));
+    if (index.names == NULL)
+        goto nomem;
+
+    index.mask = size - 1;
+
+    src = a.elts;
+
+    for (i = 0; i < a.nelts; i++) {
+
+        e = ngx_dynamic_healthcheck_index_find(&index, &src[i].key);
+        *e = src[i];
+
+        e->hash = ngx_hash_key(e->name.data, e->name.len);
+
+        head = ngx_dynamic_healthcheck_index_find_name(&index, &e->name,
+                                                       e->hash);
+        e->next = *head;
+        *head = e;
+    }
+
+    index.generation = generation;
+    index.built = 1;
+
+    if (state->index.pool != NULL)
+        ngx_destroy_pool(state->index.pool);
+
+    state->index = index;
+
+    return NGX_OK;
+
+nomem:
+
+    ngx_destroy_pool(index.pool);
+
+    return NGX_ERROR;
+}
+
+
+/*
+ * Returns the generation of the tree the index is valid for,
+ * the caller reads through the index and compares the generation again.
+ * The index is built without the zone lock, the lock is taken only
+ * if the tree keeps changing.
+ */
+
+static ngx_int_t
+ngx_dynamic_healthcheck_index_sync(ngx_dynamic_hc_state_t *state,
+    ngx_atomic_uint_t *generation)
+{
+    ngx_dynamic_hc_index_t  *index = &state->index;
+    ngx_slab_pool_t         *slab = state->shared->slab;
+    ngx_uint_t               attempt;
+    ngx_int_t                rc = NGX_DECLINED;
+
+    *generation = state->shared->generation;
+    ngx_memory_barrier();
+
+    if (index->built && index->generation == *generation)
+        return NGX_OK;
+
+    for (attempt = 0;
+         attempt < NGX_DYNAMIC_HC_INDEX_ATTEMPTS && rc == NGX_DECLINED;
+         attempt++)
+    {
+        if (attempt != 0)
+            ngx_cpu_pause();
+
+        rc = ngx_dynamic_healthcheck_index_build(state);
+    }
+
+    if (rc == NGX_DECLINED) {
+        ngx_dynamic_healthcheck_shmtx_lock(&slab->mutex);
+        rc = ngx_dynamic_healthcheck_index_build(state);
+        ngx_dynamic_healthcheck_shmtx_unlock(&slab->mutex);
+    }
+
+    *generation = index->generation;
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_dynamic_healthcheck_state_stat_locked(ngx_dynamic_hc_shared_t *shared,
+    ngx_str_t *key, ngx_dynamic_hc_stat_t *stat)
+{
+    ngx_dynamic_hc_shared_node_t  *n;
+    ngx_slab_pool_t               *slab = shared->slab;
+
+    ngx_dynamic_healthcheck_shmtx_lock(&slab->mutex);
+
+    n = (ngx_dynamic_hc_shared_node_t *)
+        ngx_str_rbtree_lookup(&shared->rbtree, key, 0);
+
+    if (n != NULL) {
+        stat->fall = n->stat->fall;
+        stat->rise = n->stat->rise;
+        stat->fall_total = n->stat->fall_total;
+        stat->rise_total = n->stat->rise_total;
+        stat->down = n->stat->down;
+    }
+
+    ngx_dynamic_healthcheck_shmtx_unlock(&slab->mutex);
+
+    return n != NULL ? NGX_OK : NGX_DECLINED;
+}
+
+
 ngx_int_t
 ngx_dynamic_healthcheck_state_stat(ngx_dynamic_hc_state_t *state,
     ngx_str_t *server, ngx_str_t *name, ngx_dynamic_hc_stat_t *stat)
 {
-    ngx_dynamic_hc_shared_node_t  *shared;
-    ngx_rbtree_t                  *rbtree = &state->shared->rbtree;
-    ngx_slab_pool_t               *slab = state->shared->slab;
+    ngx_dynamic_hc_index_entry_t  *e;
+    ngx_atomic_uint_t              generation;
     ngx_str_t                      key;
+    ngx_uint_t                     attempt;
 
     key.len = server->len + name->len + 1;
     key.data = ngx_stack_alloc(key.len);
     ngx_snprintf(key.data, key.len, "%V/%V", name, server);
 
-    ngx_shmtx_lock(&slab->mutex);
+    for (attempt = 0; attempt < 2; attempt++) {
 
-    shared = (ngx_dynamic_hc_shared_node_t *)
-        ngx_str_rbtree_lookup(rbtree, &key, 0);
+        if (ngx_dynamic_healthcheck_index_sync(state, &generation) != NGX_OK)
+            break;
+
+        e = ngx_dynamic_healthcheck_index_find(&state->index, &key);
+
+        if (e->node != NULL) {
+            stat->fall = e->stat->fall;
+            stat->rise = e->stat->rise;
+            stat->fall_total = e->stat->fall_total;
+            stat->rise_total = e->stat->rise_total;
+            stat->down = e->stat->down;
+        }
+
+        ngx_memory_barrier();
+
+        // the peer may be removed by the gc while we were reading
+
+        if (state->shared->generation == generation)
+            return e->node != NULL ? NGX_OK : NGX_DECLINED;
+    }
+
+    // the tree keeps changing, a live peer is looked up under the lock
+
+    return ngx_dynamic_healthcheck_state_stat_locked(state->shared, &key,
+                                                     stat);
+}
+
+
+void
+ngx_dynamic_healthcheck_close_connection(ngx_connection_t *c)
+{
+#if (NGX_SSL)
+    if (c->ssl != NULL) {
+        c->ssl->no_wait_shutdown = 1;
+        (void) ngx_ssl_shutdown(c);
+    }
+#endif
+
+    ngx_close_connection(c);
+}
+
+
+#if (NGX_SSL)
+
+static int  ngx_dynamic_healthcheck_ssl_index = -1;
+
+
+static int
+ngx_dynamic_healthcheck_ssl_new_session(ngx_ssl_conn_t *ssl_conn,
+    ngx_ssl_session_t *sess)
+{
+    ngx_dynamic_hc_local_node_t  *n;
+
+    n = SSL_get_ex_data(ssl_conn, ngx_dynamic_healthcheck_ssl_index);
+    if (n == NULL)
+        return 0;
+
+    if (n->ssl_session != NULL)
+        ngx_ssl_free_session(n->ssl_session);
+
+    n->ssl_session = sess;
+
+    return 1;
+}
+
+
+/*
+ * Sessions are saved by the callback as the nginx upstreams do:
+ * TLSv1.3 tickets arrive after the handshake is completed.
+ */
+
+ngx_int_t
+ngx_dynamic_healthcheck_ssl_session_cache(ngx_ssl_t *ssl)
+{
+    if (ngx_dynamic_healthcheck_ssl_index == -1) {
+
+        ngx_dynamic_healthcheck_ssl_index = SSL_get_ex_new_index(0, NULL,
+                                                                 NULL, NULL,
+                                                                 NULL);
+        if (ngx_dynamic_healthcheck_ssl_index == -1) {
+            ngx_ssl_error(NGX_LOG_ALERT, ssl->log, 0,
+                          "SSL_get_ex_new_index() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    SSL_CTX_set_session_cache_mode(ssl->ctx, SSL_SESS_CACHE_CLIENT
+                                             |SSL_SESS_CACHE_NO_INTERNAL);
+
+    SSL_CTX_sess_set_new_cb(ssl->ctx, ngx_dynamic_healthcheck_ssl_new_session);
+
+    return NGX_OK;
+}
+
+
+/*
+ * The saved session is offered once, TLSv1.3 tickets are single use
+ * and the next one is saved by the callback.
+ */
+
+ngx_int_t
+ngx_dynamic_healthcheck_ssl_set_session(ngx_connection_t *c,
+    ngx_dynamic_hc_local_node_t *n)
+{
+    ngx_ssl_session_t  *sess = n->ssl_session;
+    ngx_int_t           rc;
+
+    if (SSL_set_ex_data(c->ssl->connection, ngx_dynamic_healthcheck_ssl_index,
+                        n) == 0) {
+        ngx_ssl_error(NGX_LOG_ALERT, c->log, 0, "SSL_set_ex_data() failed");
+        return NGX_ERROR;
+    }
+
+    if (sess == NULL)
+        return NGX_OK;
+
+    n->ssl_session = NULL;
 
-    if (shared == NULL) {
+    rc = ngx_ssl_set_session(c, sess);
 
-        ngx_shmtx_unlock(&slab->mutex);
+    ngx_ssl_free_session(sess);
 
+    return rc;
+}
+
+#endif
+
+
+/*
+ * Address to check is the peer address with 'port' if it is set.
+ * Returns NGX_DECLINED if it is not changed since the last round.
+ */
+
+static ngx_int_t
+ngx_dynamic_healthcheck_set_addr(ngx_dynamic_hc_local_node_t *n,
+    struct sockaddr *sockaddr, socklen_t socklen, ngx_uint_t port)
+{
+    if (n->origin != NULL
+        && n->socklen == socklen
+        && n->port == port
+        && ngx_memcmp(n->origin, sockaddr, socklen) == 0)
         return NGX_DECLINED;
+
+    if (n->origin == NULL || n->socklen < socklen) {
+
+        n->origin = ngx_pcalloc(n->pool, socklen);
+        if (n->origin == NULL)
+            return NGX_ERROR;
+
+        n->sockaddr = ngx_pcalloc(n->pool, socklen);
+        if (n->sockaddr == NULL)
+            return NGX_ERROR;
     }
 
-    stat->fall = shared->fall;
-    stat->rise = shared->rise;
-    stat->fall_total = shared->fall_total;
-    stat->rise_total = shared->rise_total;
-    stat->down = shared->down;
+    ngx_memcpy(n->origin, sockaddr, socklen);
+    ngx_memcpy(n->sockaddr, sockaddr, socklen);
+
+    n->socklen = socklen;
+    n->port = port;
+
+#if (NGX_HAVE_UNIX_DOMAIN)
+    if (sockaddr->sa_family == AF_UNIX)
+        return NGX_OK;
+#endif
 
-    ngx_shmtx_unlock(&slab->mutex);
+    if (port != 0)
+        ngx_inet_set_port(n->sockaddr, (in_port_t) port);
 
     return NGX_OK;
 }
@@ -47,7 +522,8 @@ ngx_dynamic_healthcheck_state_stat(ngx_dynamic_hc_state_t *state,
 
 static ngx_dynamic_hc_local_node_t *
 ngx_dynamic_healthcheck_create_local(ngx_str_t *server, ngx_str_t *name,
-    size_t buffer_size, struct sockaddr *sockaddr, socklen_t socklen)
+    size_t buffer_size, struct sockaddr *sockaddr, socklen_t socklen,
+    ngx_uint_t port)
 {
     ngx_pool_t                   *pool;
     ngx_dynamic_hc_local_node_t  *n;
@@ -87,13 +563,10 @@ ngx_dynamic_healthcheck_create_local(ngx_str_t *server, ngx_str_t *name,
     if (n->buf == NULL)
         goto nomem;
 
-    n->sockaddr = ngx_pcalloc(pool, socklen);
-    if (n->sockaddr == NULL)
+    if (ngx_dynamic_healthcheck_set_addr(n, sockaddr, socklen, port)
+            == NGX_ERROR)
         goto nomem;
 
-    ngx_memcpy(n->sockaddr, sockaddr, socklen);
-    n->socklen = socklen;
-
     return n;
 
 nomem:
@@ -103,17 +576,61 @@ nomem:
 }
 
 
+/*
+ * Local node lives while the peer is in the upstream,
+ * the buffer and the address are updated in place.
+ */
+
+static ngx_int_t
+ngx_dynamic_healthcheck_update_local(ngx_dynamic_hc_local_node_t *n,
+    size_t buffer_size, struct sockaddr *sockaddr, socklen_t socklen,
+    ngx_uint_t port)
+{
+    ngx_buf_t  *buf;
+
+    if ((size_t) (n->buf->end - n->buf->start) < buffer_size + ngx_pagesize) {
+
+        buf = ngx_create_temp_buf(n->pool, buffer_size + ngx_pagesize);
+        if (buf == NULL)
+            return NGX_ERROR;
+
+        n->buf = buf;
+    }
+
+    switch (ngx_dynamic_healthcheck_set_addr(n, sockaddr, socklen, port)) {
+
+        case NGX_DECLINED:
+            return NGX_OK;
+
+        case NGX_ERROR:
+            return NGX_ERROR;
+
+        default:
+            break;
+    }
+
+    // keepalive connection to the old address
+
+    if (n->pc.connection != NULL) {
+        ngx_dynamic_healthcheck_close_connection(n->pc.connection);
+        ngx_memzero(&n->pc, sizeof(ngx_peer_connection_t));
+    }
+
+    return NGX_OK;
+}
+
+
 ngx_dynamic_hc_state_node_t
 ngx_dynamic_healthcheck_state_get(ngx_dynamic_hc_state_t *state,
     ngx_str_t *server, ngx_str_t *name,
-    struct sockaddr *sockaddr, socklen_t socklen, size_t buffer_size)
+    struct sockaddr *sockaddr, socklen_t socklen, ngx_uint_t port,
+    size_t buffer_size)
 {
     ngx_dynamic_hc_state_node_t   n;
     ngx_rbtree_node_t            *node;
     ngx_rbtree_t                 *local = &state->local.rbtree;
     ngx_rbtree_t                 *shared = &state->shared->rbtree;
     ngx_slab_pool_t              *slab = state->shared->slab;
-    ngx_flag_t                    nomem = 0;
     ngx_str_t                     key;
 
     key.len = server->len + name->len + 1;
@@ -122,34 +639,19 @@ ngx_dynamic_healthcheck_state_get(ngx_dynamic_hc_state_t *state,
 
     ngx_memzero(&n, sizeof(ngx_dynamic_hc_state_node_t));
 
-    ngx_shmtx_lock(&slab->mutex);
+    // worker local
 
-    n.shared = (ngx_dynamic_hc_shared_node_t *)
-        ngx_str_rbtree_lookup(shared, &key, 0);
-
-    if (n.shared != NULL) {
-
-        n.local = (ngx_dynamic_hc_local_node_t *)
-            ngx_str_rbtree_lookup(local, &key, 0);
-
-        if (n.local != NULL) {
-
-            if (n.local->pc.connection == NULL) {
-
-                ngx_rbtree_delete(local, (ngx_rbtree_node_t *) n.local);
-
-                ngx_destroy_pool(n.local->pool);
-                n.local = NULL;
+    n.local = (ngx_dynamic_hc_local_node_t *)
+        ngx_str_rbtree_lookup(local, &key, 0);
 
-            } else
-                goto done;
-        }
+    if (n.local == NULL) {
 
         n.local = ngx_dynamic_healthcheck_create_local(server, name,
                                                        buffer_size,
-                                                       sockaddr, socklen);
+                                                       sockaddr, socklen,
+                                                       port);
         if (n.local == NULL)
-            goto done;
+            return n;
 
         n.local->state = &state->local;
 
@@ -158,167 +660,324 @@ ngx_dynamic_healthcheck_state_get(ngx_dynamic_hc_state_t *state,
 
         ngx_rbtree_insert(local, node);
 
-        goto done;
+    } else if (ngx_dynamic_healthcheck_update_local(n.local, buffer_size,
+                   sockaddr, socklen, port) != NGX_OK) {
+        n.local = NULL;
+        return n;
     }
 
-    // alloc shared state
+    n.local->touched = ngx_current_msec;
+
+    // shared
+
+    ngx_dynamic_healthcheck_shmtx_lock(&slab->mutex);
+
+    n.shared = (ngx_dynamic_hc_shared_node_t *)
+        ngx_str_rbtree_lookup(shared, &key, 0);
+
+    if (n.shared != NULL)
+        goto done;
 
     n.shared = ngx_slab_calloc_locked(slab,
                                       sizeof(ngx_dynamic_hc_shared_node_t));
     if (n.shared == NULL)
-        goto done;
+        goto nomem;
 
     n.shared->key.str.data = ngx_slab_calloc_locked(slab, key.len);
     if (n.shared->key.str.data == NULL) {
-        nomem = 1;
-        goto done;
+        ngx_slab_free_locked(slab, n.shared);
+        goto nomem;
     }
+
     ngx_memcpy(n.shared->key.str.data, key.data, key.len);
     n.shared->key.str.len = key.len;
 
-    n.shared->state = state->shared;
-
-    // alloc worker local
-
-    n.local = ngx_dynamic_healthcheck_create_local(server, name,
-                                                   buffer_size,
-                                                   sockaddr, socklen);
-    if (n.local == NULL) {
-        nomem = 1;
-        goto done;
+    n.shared->stat = ngx_dynamic_healthcheck_stat_alloc(state->shared);
+    if (n.shared->stat == NULL) {
+        ngx_slab_free_locked(slab, n.shared->key.str.data);
+        ngx_slab_free_locked(slab, n.shared);
+        goto nomem;
     }
 
-    n.local->state = &state->local;
-
-    // insert nodes
+    n.shared->name_len = name->len;
+    n.shared->state = state->shared;
 
     node = (ngx_rbtree_node_t *) n.shared;
     node->key = 0;
 
-    ngx_rbtree_insert(shared, node);
+    // odd generation while the tree is changed, see index_build()
 
-    node = (ngx_rbtree_node_t *) n.local;
-    node->key = 0;
+    state->shared->generation++;
+    ngx_memory_barrier();
+
+    ngx_rbtree_insert(shared, node);
 
-    ngx_rbtree_insert(local, node);
+    ngx_memory_barrier();
+    state->shared->generation++;
 
 done:
 
-    if (nomem) {
+    n.shared->touched = ngx_current_msec;
 
-        if (n.shared->key.str.data != NULL)
-            ngx_slab_free_locked(slab, n.shared->key.str.data);
+    ngx_dynamic_healthcheck_shmtx_unlock(&slab->mutex);
 
-        ngx_slab_free_locked(slab, n.shared);
+    return n;
 
-        if (n.local != NULL)
-            ngx_destroy_pool(n.local->pool);
+nomem:
 
-        n.shared = NULL;
-        n.local = NULL;
-    }
+    ngx_dynamic_healthcheck_shmtx_unlock(&slab->mutex);
 
-    if (n.shared != NULL && n.local != NULL)
-        n.shared->touched = ngx_current_msec;
+    // local node is kept for the next round
 
-    ngx_shmtx_unlock(&slab->mutex);
+    n.shared = NULL;
+    n.local = NULL;
 
     return n;
 }
 
 
+void
+ngx_dynamic_healthcheck_state_touch(ngx_dynamic_hc_state_t *state,
+    ngx_str_t *server, ngx_str_t *name)
+{
+    ngx_dynamic_hc_shared_node_t  *shared;
+    ngx_rbtree_t                  *rbtree = &state->shared->rbtree;
+    ngx_slab_pool_t               *slab = state->shared->slab;
+    ngx_str_t                      key;
+
+    key.len = server->len + name->len + 1;
+    key.data = ngx_stack_alloc(key.len);
+    ngx_snprintf(key.data, key.len, "%V/%V", name, server);
+
+    ngx_dynamic_healthcheck_shmtx_lock(&slab->mutex);
+
+    shared = (ngx_dynamic_hc_shared_node_t *)
+        ngx_str_rbtree_lookup(rbtree, &key, 0);
+
+    if (shared != NULL)
+        shared->touched = ngx_current_msec;
+
+    ngx_dynamic_healthcheck_shmtx_unlock(&slab->mutex);
+}
+
+
+static void
+ngx_dynamic_healthcheck_state_free_local(ngx_dynamic_hc_local_node_t *n)
+{
+    if (n->pc.connection != NULL)
+        ngx_dynamic_healthcheck_close_connection(n->pc.connection);
+
+#if (NGX_SSL)
+    if (n->ssl_session != NULL)
+        ngx_ssl_free_session(n->ssl_session);
+#endif
+
+    ngx_rbtree_delete(&n->state->rbtree, (ngx_rbtree_node_t *) n);
+
+    ngx_destroy_pool(n->pool);
+}
+
+
+static void
+ngx_dynamic_healthcheck_state_free_shared(ngx_slab_pool_t *slab,
+    ngx_dynamic_hc_shared_node_t *n)
+{
+    ngx_rbtree_delete(&n->state->rbtree, (ngx_rbtree_node_t *) n);
+
+    n->stat->next = n->state->free;
+    n->state->free = n->stat;
+
+    ngx_slab_free_locked(slab, n->key.str.data);
+    ngx_slab_free_locked(slab, n);
+}
+
+
 void
 ngx_dynamic_healthcheck_state_delete(ngx_dynamic_hc_state_node_t state)
 {
     ngx_slab_pool_t  *slab = state.shared->state->slab;
 
-    ngx_shmtx_lock(&slab->mutex);
+    if (state.local != NULL)
+        ngx_dynamic_healthcheck_state_free_local(state.local);
 
-    if (state.local != NULL) {
+    ngx_dynamic_healthcheck_shmtx_lock(&slab->mutex);
 
-        ngx_rbtree_delete(&state.local->state->rbtree,
-            (ngx_rbtree_node_t *) state.local);
-        ngx_destroy_pool(state.local->pool);
-    }
-
-    ngx_rbtree_delete(&state.shared->state->rbtree,
-        (ngx_rbtree_node_t *) state.shared);
+    state.shared->state->generation++;
+    ngx_memory_barrier();
 
-    ngx_slab_free_locked(slab, state.shared->key.str.data);
+    ngx_dynamic_healthcheck_state_free_shared(slab, state.shared);
 
-    ngx_shmtx_unlock(&slab->mutex);
+    ngx_memory_barrier();
+    state.shared->state->generation++;
 
-    ngx_slab_free(slab, state.shared);
+    ngx_dynamic_healthcheck_shmtx_unlock(&slab->mutex);
 }
 
 
+/*
+ * Single pass under one lock hold, the successor is taken before
+ * the node is removed (rbtree delete relinks nodes, does not move them).
+ */
+
 void
 ngx_dynamic_healthcheck_state_gc(ngx_dynamic_hc_shared_t *state,
     ngx_msec_t touched)
 {
     ngx_dynamic_hc_shared_node_t  *n;
-    ngx_rbtree_node_t             *node, *root, *sentinel;
+    ngx_rbtree_node_t             *node, *next, *sentinel;
     ngx_slab_pool_t               *slab = state->slab;
-    ngx_dynamic_hc_state_node_t    del;
-
-    del.local = NULL;
+    ngx_uint_t                     collected = 0;
+    uint64_t                       start;
 
-again:
+    start = ngx_dynamic_healthcheck_usec();
 
-    ngx_shmtx_lock(&slab->mutex);
+    ngx_dynamic_healthcheck_shmtx_lock(&slab->mutex);
 
     sentinel = state->rbtree.sentinel;
-    root = state->rbtree.root;
 
-    if (root == sentinel) {
-        ngx_shmtx_unlock(&slab->mutex);
-        return;
-    }
+    if (state->rbtree.root == sentinel)
+        goto done;
 
-    for (node = ngx_rbtree_min(root, sentinel);
+    for (node = ngx_rbtree_min(state->rbtree.root, sentinel);
          node;
-         node = ngx_rbtree_next(&state->rbtree, node))
+         node = next)
     {
+        next = ngx_rbtree_next(&state->rbtree, node);
+
         n = (ngx_dynamic_hc_shared_node_t *) node;
 
         if (n->touched < touched) {
-            ngx_shmtx_unlock(&slab->mutex);
-            del.shared = n;
-            ngx_dynamic_healthcheck_state_delete(del);
-            goto again;
+
+            if (collected++ == 0) {
+                state->generation++;
+                ngx_memory_barrier();
+            }
+
+            ngx_dynamic_healthcheck_state_free_shared(slab, n);
         }
     }
 
-    ngx_shmtx_unlock(&slab->mutex);
+    if (collected != 0) {
+        ngx_memory_barrier();
+        state->generation++;
+    }
+
+done:
+
+    ngx_dynamic_healthcheck_shmtx_unlock(&slab->mutex);
+
+    ngx_dynamic_healthcheck_workers_gc(collected,
+        ngx_dynamic_healthcheck_usec() - start);
 }
 
 
-static void
-traverse_tree(ngx_rbtree_node_t *node,
-    ngx_rbtree_node_t *sentinel, ngx_str_t *name)
+void
+ngx_dynamic_healthcheck_state_gc_local(ngx_dynamic_hc_local_t *state,
+    ngx_msec_t touched)
 {
-    ngx_time_t                    *tp = ngx_timeofday();
-    ngx_int_t                      rc;
-    ngx_dynamic_hc_shared_node_t  *n;
+    ngx_dynamic_hc_local_node_t  *n;
+    ngx_rbtree_node_t            *node, *next, *sentinel;
 
-    if (node == sentinel)
+    sentinel = state->rbtree.sentinel;
+
+    if (state->rbtree.root == sentinel)
         return;
 
-    n = (ngx_dynamic_hc_shared_node_t *) node;
+    for (node = ngx_rbtree_min(state->rbtree.root, sentinel);
+         node;
+         node = next)
+    {
+        next = ngx_rbtree_next(&state->rbtree, node);
+
+        n = (ngx_dynamic_hc_local_node_t *) node;
+
+        if (n->touched < touched)
+            ngx_dynamic_healthcheck_state_free_local(n);
+    }
+}
+
+
+typedef ngx_int_t (*ngx_dynamic_hc_stat_pt)(ngx_dynamic_hc_peer_stat_t *stat,
+    ngx_atomic_uint_t reuse, void *data);
+
+
+/*
+ * Lock free: stat blocks are never returned to the slab, but a block
+ * of a removed peer may be reused by a new one. Entries whose block
+ * changed hands are skipped. The walk is repeated over the new index
+ * if peers were added or removed meanwhile, blocks passed to
+ * the handler on the first walk are not passed again.
+ */
+
+static ngx_int_t
+ngx_dynamic_healthcheck_state_foreach(ngx_dynamic_hc_state_t *state,
+    ngx_str_t *name, ngx_dynamic_hc_stat_pt handler, void *data)
+{
+    ngx_dynamic_hc_index_entry_t   *e, *head;
+    ngx_dynamic_hc_peer_stat_t    **done = NULL;
+    ngx_atomic_uint_t               generation;
+    ngx_uint_t                      attempt, hash, i, n = 0, ndone = 0;
+    ngx_int_t                       rc = NGX_DECLINED;
+
+    hash = ngx_hash_key(name->data, name->len);
+
+    for (attempt = 0; attempt < 2; attempt++) {
+
+        if (ngx_dynamic_healthcheck_index_sync(state, &generation) != NGX_OK)
+            return NGX_ERROR;
+
+        head = *ngx_dynamic_healthcheck_index_find_name(&state->index,
+                                                        name, hash);
+
+        if (done == NULL) {
+            for (e = head; e; e = e->next)
+                n++;
+            done = ngx_stack_alloc((n + 1) * sizeof(*done));
+        }
+
+        for (e = head; e; e = e->next) {
 
-    if (name->len > n->key.str.len)
-        return traverse_tree(node->right, sentinel, name);
+            if (e->stat->reuse != e->reuse)
+                continue;
 
-    rc = ngx_memcmp(name->data, n->key.str.data, name->len);
+            for (i = 0; i < ndone && done[i] != e->stat; i++);
 
-    if (rc == 0)
-        n->checked = tp->sec;
+            if (i < ndone)
+                continue;
 
-    if (rc <= 0)
-        traverse_tree(node->left, sentinel, name);
+            if (ndone < n)
+                done[ndone++] = e->stat;
 
-    if (rc >= 0)
-        traverse_tree(node->right, sentinel, name);
+            if (handler(e->stat, e->reuse, data) == NGX_OK)
+                rc = NGX_OK;
+        }
+
+        ngx_memory_barrier();
+
+        if (state->shared->generation == generation)
+            break;
+    }
+
+    return rc;
+}
+
+
+// the store into a block reused meanwhile is undone
+
+static ngx_int_t
+ngx_dynamic_healthcheck_state_checked_handler(ngx_dynamic_hc_peer_stat_t *stat,
+    ngx_atomic_uint_t reuse, void *data)
+{
+    ngx_msec_t  now = *(ngx_msec_t *) data;
+
+    stat->checked = now;
+
+    ngx_memory_barrier();
+
+    if (stat->reuse != reuse)
+        (void) ngx_atomic_cmp_set(&stat->checked, now, 0);
+
+    return NGX_OK;
 }
 
 
@@ -326,12 +985,313 @@ void
 ngx_dynamic_healthcheck_state_checked(ngx_dynamic_hc_state_t *state,
     ngx_str_t *name)
 {
-    ngx_rbtree_t     *rbtree = &state->shared->rbtree;
-    ngx_slab_pool_t  *slab = state->shared->slab;
+    ngx_msec_t   now;
+    ngx_time_t  *tp = ngx_timeofday();
 
-    ngx_shmtx_lock(&slab->mutex);
+    now = tp->sec * 1000 + tp->msec;
 
-    traverse_tree(rbtree->root, rbtree->sentinel, name);
+    (void) ngx_dynamic_healthcheck_state_foreach(state, name,
+        ngx_dynamic_healthcheck_state_checked_handler, &now);
+}
+
+
+static ngx_uint_t
+ngx_dynamic_healthcheck_passive_fail(ngx_dynamic_hc_peer_stat_t *stat,
+    ngx_msec_t now, ngx_msec_t window)
+{
+    ngx_atomic_t       *slot;
+    ngx_atomic_uint_t   epoch, old, value;
+    ngx_uint_t          i, fails = 0;
+
+    window = ngx_max(window / NGX_DYNAMIC_HC_PASSIVE_SLOTS, 1);
+
+    slot = &stat->passive[(now / window) % NGX_DYNAMIC_HC_PASSIVE_SLOTS];
+
+    // the high bits of the epoch are lost, epochs are compared modulo
+
+    epoch = (ngx_atomic_uint_t) (now / window) << NGX_DYNAMIC_HC_PASSIVE_BITS;
+
+    do {
+        old = *slot;
+
+        if ((old & ~NGX_DYNAMIC_HC_PASSIVE_FAILS) != epoch)
+            value = epoch | 1;
+        else if ((old & NGX_DYNAMIC_HC_PASSIVE_FAILS)
+                     != NGX_DYNAMIC_HC_PASSIVE_FAILS)
+            value = old + 1;
+        else
+            break;
+
+    } while (!ngx_atomic_cmp_set(slot, old, value));
+
+    for (i = 0; i < NGX_DYNAMIC_HC_PASSIVE_SLOTS; i++) {
+
+        old = stat->passive[i];
+
+        if (((epoch - (old & ~NGX_DYNAMIC_HC_PASSIVE_FAILS))
+                >> NGX_DYNAMIC_HC_PASSIVE_BITS) < NGX_DYNAMIC_HC_PASSIVE_SLOTS)
+            fails += old & NGX_DYNAMIC_HC_PASSIVE_FAILS;
+    }
+
+    return fails;
+}
+
+
+typedef struct {
+    ngx_msec_t  now;
+    ngx_msec_t  window;
+    ngx_int_t   fall;
+} ngx_dynamic_hc_fail_ctx_t;
+
+
+// a block reused meanwhile is not marked down
+
+static ngx_int_t
+ngx_dynamic_healthcheck_state_fail_handler(ngx_dynamic_hc_peer_stat_t *stat,
+    ngx_atomic_uint_t reuse, void *data)
+{
+    ngx_dynamic_hc_fail_ctx_t  *ctx = data;
+
+    ngx_atomic_fetch_add(&stat->fall_total, 1);
+
+    if (ngx_dynamic_healthcheck_passive_fail(stat, ctx->now, ctx->window)
+            < (ngx_uint_t) ctx->fall)
+        return NGX_DECLINED;
+
+    ngx_memory_barrier();
+
+    if (stat->reuse != reuse || !ngx_atomic_cmp_set(&stat->down, 0, 1))
+        return NGX_DECLINED;
+
+    stat->rise = 0;
+    stat->fall = ctx->fall;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Failure of the real traffic, returns NGX_OK when 'fall' failures
+ * are seen in the window and the peer must be marked down.
+ */
+
+ngx_int_t
+ngx_dynamic_healthcheck_state_fail(ngx_dynamic_hc_state_t *state,
+    ngx_str_t *name, ngx_msec_t window, ngx_int_t fall)
+{
+    ngx_dynamic_hc_fail_ctx_t   ctx;
+    ngx_time_t                 *tp = ngx_timeofday();
+
+    ctx.now = tp->sec * 1000 + tp->msec;
+    ctx.window = window;
+    ctx.fall = fall;
+
+    return ngx_dynamic_healthcheck_state_foreach(state, name,
+        ngx_dynamic_healthcheck_state_fail_handler, &ctx);
+}
+
+
+/*
+ * Concurrent updates may be lost, the average is approximate anyway.
+ */
+
+static void
+ngx_dynamic_healthcheck_ewma(ngx_atomic_t *v, ngx_atomic_uint_t x,
+    ngx_flag_t first)
+{
+    ngx_atomic_uint_t  old, avg;
+
+    old = *v;
+
+    if (first)
+        avg = x;
+    else if (x >= old)
+        avg = old + (x - old) / 8;
+    else
+        avg = old - (old - x) / 8;
+
+    (void) ngx_atomic_cmp_set(v, old, avg);
+}
+
+
+typedef struct {
+    ngx_msec_t  latency;
+    ngx_flag_t  failed;
+} ngx_dynamic_hc_observe_ctx_t;
+
+
+static ngx_int_t
+ngx_dynamic_healthcheck_state_observe_handler(ngx_dynamic_hc_peer_stat_t *stat,
+    ngx_atomic_uint_t reuse, void *data)
+{
+    ngx_dynamic_hc_observe_ctx_t  *ctx = data;
+    ngx_atomic_uint_t              x, avg;
+    ngx_flag_t                     first;
+
+    first = ngx_atomic_fetch_add(&stat->observed, 1) == 0;
+
+    ngx_dynamic_healthcheck_ewma(&stat->errors, ctx->failed ? 1024 : 0,
+                                 first);
+
+    if (ctx->failed || ctx->latency == (ngx_msec_t) -1)
+        return NGX_OK;
+
+    x = (ngx_atomic_uint_t) ctx->latency << 4;
+    avg = stat->latency;
+
+    ngx_dynamic_healthcheck_ewma(&stat->latency, x, first);
+    ngx_dynamic_healthcheck_ewma(&stat->deviation,
+                                 x > avg ? x - avg : avg - x, first);
+
+    return NGX_OK;
+}
+
+
+void
+ngx_dynamic_healthcheck_state_observe(ngx_dynamic_hc_state_t *state,
+    ngx_str_t *name, ngx_msec_t latency, ngx_flag_t failed)
+{
+    ngx_dynamic_hc_observe_ctx_t  ctx;
+
+    ctx.latency = latency;
+    ctx.failed = failed;
+
+    (void) ngx_dynamic_healthcheck_state_foreach(state, name,
+        ngx_dynamic_healthcheck_state_observe_handler, &ctx);
+}
+
+
+static int ngx_libc_cdecl
+ngx_dynamic_healthcheck_cmp_uint(const void *one, const void *two)
+{
+    ngx_atomic_uint_t  a = *(ngx_atomic_uint_t *) one;
+    ngx_atomic_uint_t  b = *(ngx_atomic_uint_t *) two;
+
+    return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+
+static ngx_atomic_uint_t
+ngx_dynamic_healthcheck_median(ngx_atomic_uint_t *v, ngx_uint_t n)
+{
+    ngx_qsort(v, n, sizeof(ngx_atomic_uint_t),
+              ngx_dynamic_healthcheck_cmp_uint);
+
+    return v[n / 2];
+}
+
+
+/*
+ * Compares the peers seen by the real traffic with the median
+ * of the upstream: tail latency (average + 2 deviations) above 'factor'
+ * medians or error rate 'errors' percents above the median ejects
+ * the peer for 'ejection' doubled on each repeated ejection.
+ * At most half of the peers are ejected at once.
+ */
+
+ngx_uint_t
+ngx_dynamic_healthcheck_state_outliers(ngx_dynamic_hc_state_t *state,
+    ngx_uint_t factor, ngx_uint_t errors, ngx_msec_t ejection,
+    ngx_pool_t *pool)
+{
+    ngx_dynamic_hc_index_t        *index = &state->index;
+    ngx_dynamic_hc_index_entry_t  *e;
+    ngx_dynamic_hc_peer_stat_t    *stat;
+    ngx_atomic_uint_t              generation, tail_median, err_median;
+    ngx_atomic_uint_t             *tail, *err, t;
+    ngx_uint_t                     i, n = 0, nejected = 0, count = 0;
+    ngx_uint_t                     backoff;
+    ngx_msec_t                     now;
+    ngx_time_t                    *tp = ngx_timeofday();
+    ngx_flag_t                     outlier;
+
+    now = tp->sec * 1000 + tp->msec;
+
+    if (ngx_dynamic_healthcheck_index_sync(state, &generation) != NGX_OK)
+        return 0;
+
+    tail = ngx_palloc(pool, 2 * (index->mask + 1) * sizeof(ngx_atomic_uint_t));
+    if (tail == NULL)
+        return 0;
+
+    err = tail + index->mask + 1;
+
+    for (i = 0; i <= index->mask; i++) {
+
+        e = &index->entries[i];
+
+        if (e->node == NULL)
+            continue;
+
+        if (e->stat->ejected != 0) {
+            nejected++;
+            continue;
+        }
+
+        if (e->stat->observed < NGX_DYNAMIC_HC_OUTLIER_MIN)
+            continue;
+
+        tail[n] = e->stat->latency + 2 * e->stat->deviation;
+        err[n] = e->stat->errors;
+        n++;
+    }
+
+    if (n < 3)
+        return 0;
+
+    tail_median = ngx_dynamic_healthcheck_median(tail, n);
+    err_median = ngx_dynamic_healthcheck_median(err, n);
+
+    for (i = 0; i <= index->mask; i++) {
+
+        e = &index->entries[i];
+        stat = e->stat;
+
+        if (e->node == NULL
+            || stat->ejected != 0
+            || stat->observed < NGX_DYNAMIC_HC_OUTLIER_MIN)
+            continue;
+
+        t = stat->latency + 2 * stat->deviation;
+
+        outlier = (factor != 0 && t > ngx_max(tail_median, 16) * factor)
+                  || (errors != 0
+                      && stat->errors > err_median + errors * 1024 / 100);
+
+        if (!outlier) {
+
+            // the peer is good for a round, forget one ejection
+
+            if (stat->ejections != 0)
+                (void) ngx_atomic_cmp_set(&stat->ejections, stat->ejections,
+                                          stat->ejections - 1);
+            continue;
+        }
+
+        if (2 * (nejected + 1) > n + nejected)
+            break;
+
+        backoff = ngx_min(stat->ejections, NGX_DYNAMIC_HC_OUTLIER_BACKOFF);
+
+        if (!ngx_atomic_cmp_set(&stat->ejected, 0, now + (ejection << backoff)))
+            continue;
+
+        ngx_atomic_fetch_add(&stat->ejections, 1);
+
+        // the peer is compared again after it has got new traffic
+
+        stat->observed = 0;
+        stat->rise = 0;
+        stat->down = 1;
+
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "%V ejected for %Mms, latency=%uAms errors=%ui%%",
+                      &e->key, ejection << backoff, t >> 4,
+                      (ngx_uint_t) (stat->errors * 100 / 1024));
+
+        nejected++;
+        count++;
+    }
 
-    ngx_shmtx_unlock(&slab->mutex);
+    return count;
 }
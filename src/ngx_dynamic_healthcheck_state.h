@@ -17,10 +17,61 @@ extern "C" {
 #include <ngx_rbtree.h>
 
 
+/*
+ * Counters of the peer are updated with atomics by any worker,
+ * the block is allocated on cache lines of its own. Blocks are never
+ * returned to the slab, removed ones are kept in the free list
+ * of the zone, so a late lock free store can't hit other data.
+ */
+
+typedef struct ngx_dynamic_hc_peer_stat_s  ngx_dynamic_hc_peer_stat_t;
+
+
+/*
+ * Passive failures are counted in a sliding window of slots,
+ * a slot is reused when its epoch is over. The epoch is kept in
+ * the high bits of the slot and the failures in the low ones,
+ * the slot is reset and counted by one compare and swap.
+ */
+#define NGX_DYNAMIC_HC_PASSIVE_SLOTS  8
+#define NGX_DYNAMIC_HC_PASSIVE_BITS   16
+#define NGX_DYNAMIC_HC_PASSIVE_FAILS                                         \
+    (((ngx_atomic_uint_t) 1 << NGX_DYNAMIC_HC_PASSIVE_BITS) - 1)
+
+
+struct ngx_dynamic_hc_peer_stat_s {
+    ngx_atomic_t                   fall;
+    ngx_atomic_t                   rise;
+    ngx_atomic_t                   fall_total;
+    ngx_atomic_t                   rise_total;
+    ngx_atomic_t                   down;
+    ngx_atomic_t                   checked;
+    ngx_atomic_t                   passive[NGX_DYNAMIC_HC_PASSIVE_SLOTS];
+
+    // outlier detection: ewma of latency (ms << 4), of its deviation
+    // and of errors (1024 is 100%)
+    ngx_atomic_t                   latency;
+    ngx_atomic_t                   deviation;
+    ngx_atomic_t                   errors;
+    ngx_atomic_t                   observed;
+    ngx_atomic_t                   ejected;
+    ngx_atomic_t                   ejections;
+
+    ngx_dynamic_hc_peer_stat_t    *next;
+
+    // bumped each time the block is taken from the free list,
+    // the last field: it is not cleared with the counters
+    ngx_atomic_t                   reuse;
+};
+
+
 typedef struct {
     ngx_rbtree_t                   rbtree;
     ngx_rbtree_node_t              sentinel;
     ngx_slab_pool_t               *slab;
+    // odd while nodes are added or removed
+    ngx_atomic_uint_t              generation;
+    ngx_dynamic_hc_peer_stat_t    *free;
 } ngx_dynamic_hc_shared_t;
 
 
@@ -30,29 +81,66 @@ typedef struct {
 } ngx_dynamic_hc_local_t;
 
 
-typedef struct {
-    ngx_dynamic_hc_shared_t       *shared;
-    ngx_dynamic_hc_local_t         local;
-} ngx_dynamic_hc_state_t;
-
-
 typedef struct {
     ngx_str_node_t                 key;
 
-    ngx_int_t                      fall;
-    ngx_int_t                      rise;
-    ngx_int_t                      fall_total;
-    ngx_int_t                      rise_total;
+    ngx_dynamic_hc_peer_stat_t    *stat;
+
+    // 'name/server', length of the name
+    size_t                         name_len;
 
     ngx_msec_t                     touched;
-    time_t                         checked;
-    ngx_flag_t                     down;
 
     ngx_dynamic_hc_shared_t       *state;
 } ngx_dynamic_hc_shared_node_t;
 
 
+typedef struct ngx_dynamic_hc_index_entry_s  ngx_dynamic_hc_index_entry_t;
+
+struct ngx_dynamic_hc_index_entry_s {
+    ngx_str_t                      key;
+    ngx_str_t                      name;
+    ngx_uint_t                     hash;
+    ngx_dynamic_hc_shared_node_t  *node;
+    ngx_dynamic_hc_peer_stat_t    *stat;
+    ngx_atomic_uint_t              reuse;
+    ngx_dynamic_hc_index_entry_t  *next;
+};
+
+
+/*
+ * Worker local hash of the shared nodes, valid while the generation
+ * of the shared tree is the same. Readers look up the peer without
+ * the zone lock and check the generation again after the read.
+ * The index is built without the lock as well, from a walk of the tree
+ * checked against the generation.
+ * 'names' chains the entries of the same peer address of all servers.
+ */
+
+typedef struct {
+    ngx_atomic_uint_t              generation;
+    unsigned                       built:1;
+    ngx_pool_t                    *pool;
+    ngx_dynamic_hc_index_entry_t  *entries;
+    ngx_dynamic_hc_index_entry_t **names;
+    ngx_uint_t                     mask;
+} ngx_dynamic_hc_index_t;
+
+
 typedef struct {
+    ngx_dynamic_hc_shared_t       *shared;
+    ngx_dynamic_hc_local_t         local;
+    ngx_dynamic_hc_index_t         index;
+} ngx_dynamic_hc_state_t;
+
+
+typedef struct ngx_dynamic_hc_local_node_s  ngx_dynamic_hc_local_node_t;
+
+// reads the connection kept alive between checks, NGX_AGAIN keeps it
+typedef ngx_int_t (*ngx_dynamic_hc_idle_pt)(ngx_dynamic_hc_local_node_t *state);
+
+
+struct ngx_dynamic_hc_local_node_s {
     ngx_str_node_t                 key;
 
     ngx_str_t                      module;
@@ -62,15 +150,28 @@ typedef struct {
     ngx_str_t                      name;
     struct sockaddr               *sockaddr;
     socklen_t                      socklen;
+    struct sockaddr               *origin;
+    ngx_uint_t                     port;
 
     ngx_peer_connection_t          pc;
     ngx_pool_t                    *pool;
     ngx_buf_t                     *buf;
+    // the response head was dropped from 'buf' by the stream match
+    ngx_flag_t                     discarded;
+    ngx_dynamic_hc_idle_pt         idle;
 
-    ngx_msec_t                     expired;
+#if (NGX_SSL)
+    // session saved by the last connection, resumed by the next one
+    ngx_ssl_session_t             *ssl_session;
+#endif
+
+    ngx_msec_t                     touched;
+
+    // peer->down seen on the round start and marked since
+    ngx_flag_t                     down;
 
     ngx_dynamic_hc_local_t        *state;
-} ngx_dynamic_hc_local_node_t;
+};
 
 
 typedef struct {
@@ -88,16 +189,35 @@ typedef struct ngx_dynamic_hc_stat_s {
 } ngx_dynamic_hc_stat_t;
 
 
+void
+ngx_dynamic_healthcheck_close_connection(ngx_connection_t *c);
+
+#if (NGX_SSL)
+
+ngx_int_t
+ngx_dynamic_healthcheck_ssl_session_cache(ngx_ssl_t *ssl);
+
+ngx_int_t
+ngx_dynamic_healthcheck_ssl_set_session(ngx_connection_t *c,
+    ngx_dynamic_hc_local_node_t *n);
+
+#endif
+
 ngx_dynamic_hc_state_node_t
 ngx_dynamic_healthcheck_state_get(ngx_dynamic_hc_state_t *state,
     ngx_str_t *server, ngx_str_t *name,
-    struct sockaddr *sockaddr, socklen_t socklen, size_t buffer_size);
+    struct sockaddr *sockaddr, socklen_t socklen, ngx_uint_t port,
+    size_t buffer_size);
 
 
 ngx_int_t
 ngx_dynamic_healthcheck_state_stat(ngx_dynamic_hc_state_t *state,
     ngx_str_t *server, ngx_str_t *name, ngx_dynamic_hc_stat_t *stat);
 
+void
+ngx_dynamic_healthcheck_state_touch(ngx_dynamic_hc_state_t *state,
+    ngx_str_t *server, ngx_str_t *name);
+
 void
 ngx_dynamic_healthcheck_state_delete(ngx_dynamic_hc_state_node_t state);
 
@@ -106,10 +226,27 @@ void
 ngx_dynamic_healthcheck_state_gc(ngx_dynamic_hc_shared_t *state,
     ngx_msec_t touched);
 
+void
+ngx_dynamic_healthcheck_state_gc_local(ngx_dynamic_hc_local_t *state,
+    ngx_msec_t touched);
+
 void
 ngx_dynamic_healthcheck_state_checked(ngx_dynamic_hc_state_t *state,
     ngx_str_t *name);
 
+ngx_int_t
+ngx_dynamic_healthcheck_state_fail(ngx_dynamic_hc_state_t *state,
+    ngx_str_t *name, ngx_msec_t window, ngx_int_t fall);
+
+void
+ngx_dynamic_healthcheck_state_observe(ngx_dynamic_hc_state_t *state,
+    ngx_str_t *name, ngx_msec_t latency, ngx_flag_t failed);
+
+ngx_uint_t
+ngx_dynamic_healthcheck_state_outliers(ngx_dynamic_hc_state_t *state,
+    ngx_uint_t factor, ngx_uint_t errors, ngx_msec_t ejection,
+    ngx_pool_t *pool);
+
 
 #ifdef __cplusplus
 }
@@ -95,11 +95,12 @@ protected:
 
         buf->last += size;
 
-        s.data = buf->start;
-        s.len = (size_t) (buf->last - buf->start);
+        // data before buf->pos is already scanned,
+        // the buffer slides over a long response
 
-        switch(ngx_dynamic_healthcheck_match_buffer(&shared->response_body,
-                                                    &s)) {
+        switch(ngx_dynamic_healthcheck_match_stream(&this->event->conf->regex,
+                                                    shared, buf,
+                                                    &state->discarded)) {
             case NGX_OK:
                 ngx_log_error(NGX_LOG_DEBUG, c->log, 0,
                               "[%V] %V: %V addr=%V, fd=%d pattern '%V' found",
@@ -116,15 +117,15 @@ protected:
                               c->fd, &shared->response_body);
                 return NGX_ERROR;
 
-            case NGX_DECLINED:
+            case NGX_AGAIN:
             default:
                 break;
         }
 
         if (buf->last == buf->end) {
             ngx_log_error(NGX_LOG_WARN, c->log, 0,
-                          "[%V] %V: %V addr=%V, fd=%d pattern '%V' is not found"
-                          "or 'healthcheck_buffer_size' is not enought",
+                          "[%V] %V: %V addr=%V, fd=%d pattern '%V' partial "
+                          "match exceeds 'healthcheck_buffer_size'",
                           &this->module, &this->upstream,
                           &this->server, &this->name, c->fd,
                           &shared->response_body);
@@ -143,7 +144,7 @@ public:
         ngx_dynamic_healthcheck_event_t *event, ngx_dynamic_hc_state_node_t s)
         : ngx_dynamic_healthcheck_peer_wrap<PeersT, PeerT>(peers, event, s)
     {
-        shared = event->conf->shared;
+        shared = event->opts;
     }
 };
 
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+#ifndef NGX_DYNAMIC_HEALTHCHECK_TLS_H
+#define NGX_DYNAMIC_HEALTHCHECK_TLS_H
+
+
+#include "ngx_dynamic_healthcheck_tcp.h"
+#include "ngx_dynamic_healthcheck_http.h"
+#include "ngx_dynamic_healthcheck_grpc.h"
+
+
+/*
+ * tcp check over TLS: the handshake must complete (with the certificate
+ * verified if 'ssl_verify' is set) before the request is sent.
+ */
+
+template <class PeersT, class PeerT> class ngx_dynamic_healthcheck_tls :
+    public ngx_dynamic_healthcheck_tcp<PeersT, PeerT>
+{
+public:
+
+    ngx_dynamic_healthcheck_tls(PeersT *peers,
+        ngx_dynamic_healthcheck_event_t *event, ngx_dynamic_hc_state_node_t s)
+        : ngx_dynamic_healthcheck_tcp<PeersT, PeerT>(peers, event, s)
+    {
+        this->tls = 1;
+    }
+};
+
+
+/*
+ * http check over TLS, keepalive connections keep the TLS session
+ * so the handshake is paid once per 'keepalive' requests.
+ */
+
+template <class PeersT, class PeerT> class ngx_dynamic_healthcheck_https :
+    public ngx_dynamic_healthcheck_http<PeersT, PeerT>
+{
+public:
+
+    ngx_dynamic_healthcheck_https(PeersT *peers,
+        ngx_dynamic_healthcheck_event_t *event, ngx_dynamic_hc_state_node_t s)
+        : ngx_dynamic_healthcheck_http<PeersT, PeerT>(peers, event, s)
+    {
+        this->tls = 1;
+    }
+};
+
+
+/*
+ * grpc check over TLS, HTTP/2 is negotiated by ALPN.
+ */
+
+template <class PeersT, class PeerT> class ngx_dynamic_healthcheck_grpcs :
+    public ngx_dynamic_healthcheck_grpc<PeersT, PeerT>
+{
+public:
+
+    ngx_dynamic_healthcheck_grpcs(PeersT *peers,
+        ngx_dynamic_healthcheck_event_t *event, ngx_dynamic_hc_state_node_t s)
+        : ngx_dynamic_healthcheck_grpc<PeersT, PeerT>(peers, event, s)
+    {
+        this->tls = 1;
+        this->alpn_h2 = 1;
+    }
+};
+
+#endif /* NGX_DYNAMIC_HEALTHCHECK_TLS_H */
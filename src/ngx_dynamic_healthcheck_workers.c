@@ -0,0 +1,365 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+#include "ngx_dynamic_healthcheck_workers.h"
+
+
+static ngx_str_t  workers_zone_name = ngx_string("dynamic_healthcheck:workers");
+
+static ngx_uint_t  workers_zone_tag;
+
+static ngx_dynamic_hc_workers_t  *workers = NULL;
+static ngx_slab_pool_t           *workers_slab = NULL;
+
+static ngx_dynamic_hc_lock_stat_t  lock_stat;
+static ngx_uint_t                  lock_depth = 0;
+static uint64_t                    lock_start;
+
+static ngx_dynamic_hc_gc_stat_t    gc_stat;
+
+
+static ngx_int_t
+ngx_dynamic_healthcheck_workers_init_zone(ngx_shm_zone_t *zone, void *old)
+{
+    ngx_slab_pool_t           *slab;
+    ngx_dynamic_hc_workers_t  *sh;
+
+    slab = (ngx_slab_pool_t *) zone->shm.addr;
+
+    if (old != NULL) {
+        zone->data = slab->data;
+        return NGX_OK;
+    }
+
+    sh = ngx_slab_calloc(slab, sizeof(ngx_dynamic_hc_workers_t));
+    if (sh == NULL)
+        return NGX_ERROR;
+
+    slab->data = sh;
+    zone->data = sh;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_dynamic_healthcheck_workers_add(ngx_conf_t *cf)
+{
+    ngx_shm_zone_t  *zone;
+    size_t           size;
+
+    size = ngx_align(sizeof(ngx_dynamic_hc_workers_t), ngx_pagesize)
+           + 8 * ngx_pagesize;
+
+    zone = ngx_shared_memory_add(cf, &workers_zone_name, size,
+                                 &workers_zone_tag);
+    if (zone == NULL)
+        return NGX_ERROR;
+
+    zone->init = ngx_dynamic_healthcheck_workers_init_zone;
+    zone->noreuse = 0;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_dynamic_healthcheck_workers_init(ngx_cycle_t *cycle)
+{
+    ngx_list_part_t  *part;
+    ngx_shm_zone_t   *zone;
+    ngx_uint_t        i;
+
+    part = &cycle->shared_memory.part;
+    zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL)
+                break;
+            part = part->next;
+            zone = part->elts;
+            i = 0;
+        }
+
+        if (zone[i].tag == &workers_zone_tag) {
+            workers = zone[i].data;
+            workers_slab = (ngx_slab_pool_t *) zone[i].shm.addr;
+            return NGX_OK;
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+
+ngx_dynamic_hc_workers_t *
+ngx_dynamic_healthcheck_workers(void)
+{
+    return workers;
+}
+
+
+void
+ngx_dynamic_healthcheck_workers_heartbeat(ngx_msec_t now, ngx_uint_t load)
+{
+    ngx_dynamic_hc_worker_t  *w;
+
+    if (workers == NULL || ngx_worker >= NGX_MAX_PROCESSES)
+        return;
+
+    w = &workers->workers[ngx_worker];
+
+    ngx_shmtx_lock(&workers_slab->mutex);
+
+    w->pid = ngx_pid;
+    w->heartbeat = now;
+    w->load = load;
+
+    ngx_dynamic_healthcheck_alloc_stat(&w->alloc);
+
+    w->lock = lock_stat;
+    w->gc = gc_stat;
+
+    ngx_shmtx_unlock(&workers_slab->mutex);
+}
+
+
+void
+ngx_dynamic_healthcheck_workers_exit(void)
+{
+    ngx_dynamic_hc_worker_t  *w;
+
+    if (workers == NULL || ngx_worker >= NGX_MAX_PROCESSES)
+        return;
+
+    w = &workers->workers[ngx_worker];
+
+    ngx_shmtx_lock(&workers_slab->mutex);
+
+    // the slot may be already taken by the worker of the new cycle
+
+    if (w->pid == ngx_pid) {
+        w->heartbeat = 0;
+        w->load = 0;
+    }
+
+    ngx_shmtx_unlock(&workers_slab->mutex);
+}
+
+
+void
+ngx_dynamic_healthcheck_workers_touch(void)
+{
+    if (workers != NULL)
+        (void) ngx_atomic_fetch_add(&workers->updated, 1);
+}
+
+
+ngx_atomic_uint_t
+ngx_dynamic_healthcheck_workers_updated(void)
+{
+    return workers != NULL ? workers->updated : 0;
+}
+
+
+ngx_uint_t
+ngx_dynamic_healthcheck_workers_alive(ngx_msec_t now, ngx_uint_t *alive,
+    ngx_uint_t n)
+{
+    ngx_uint_t                i, count = 0;
+    ngx_dynamic_hc_worker_t  *w;
+
+    if (workers == NULL)
+        return 0;
+
+    ngx_shmtx_lock(&workers_slab->mutex);
+
+    for (i = 0; i < n && i < NGX_MAX_PROCESSES; i++) {
+
+        w = &workers->workers[i];
+
+        if (i == ngx_worker
+            || (w->heartbeat != 0
+                && w->heartbeat + NGX_DYNAMIC_HC_WORKER_ALIVE > now))
+            alive[count++] = i;
+    }
+
+    ngx_shmtx_unlock(&workers_slab->mutex);
+
+    return count;
+}
+
+
+ngx_flag_t
+ngx_dynamic_healthcheck_workers_pid_alive(ngx_pid_t pid, ngx_msec_t now)
+{
+    ngx_uint_t                i;
+    ngx_flag_t                found = 0;
+    ngx_dynamic_hc_worker_t  *w;
+
+    if (pid == ngx_pid)
+        return 1;
+
+    if (workers == NULL)
+        return 0;
+
+    ngx_shmtx_lock(&workers_slab->mutex);
+
+    for (i = 0; i < NGX_MAX_PROCESSES; i++) {
+
+        w = &workers->workers[i];
+
+        if (w->pid == pid && w->heartbeat != 0
+            && w->heartbeat + NGX_DYNAMIC_HC_WORKER_ALIVE > now) {
+            found = 1;
+            break;
+        }
+    }
+
+    ngx_shmtx_unlock(&workers_slab->mutex);
+
+    return found;
+}
+
+
+/*
+ * Views of the alive workers taken by each worker at its own round time
+ * may differ, the peers of a sharded upstream are then checked twice or
+ * not at all. The view is published once per heartbeat period in the
+ * zone instead, every worker finds its shard in the same one. A worker
+ * out of the view checks nothing until the next publication.
+ */
+
+ngx_uint_t
+ngx_dynamic_healthcheck_workers_shards(ngx_msec_t now, ngx_uint_t n,
+    ngx_uint_t *shard)
+{
+    ngx_uint_t                i, count = 0, nshards, epoch = 0;
+    ngx_uint_t                alive[NGX_MAX_PROCESSES];
+    ngx_dynamic_hc_worker_t  *w;
+
+    if (workers == NULL)
+        return 0;
+
+    ngx_shmtx_lock(&workers_slab->mutex);
+
+    if (workers->published == 0
+        || now >= workers->published + NGX_DYNAMIC_HC_WORKER_HEARTBEAT) {
+
+        for (i = 0; i < n && i < NGX_MAX_PROCESSES; i++) {
+
+            w = &workers->workers[i];
+
+            if (i == ngx_worker
+                || (w->heartbeat != 0
+                    && w->heartbeat + NGX_DYNAMIC_HC_WORKER_ALIVE > now))
+                alive[count++] = i;
+        }
+
+        if (count != workers->nshards
+            || ngx_memcmp(alive, workers->shards,
+                          count * sizeof(ngx_uint_t)) != 0) {
+            ngx_memcpy(workers->shards, alive, count * sizeof(ngx_uint_t));
+            workers->nshards = count;
+            epoch = ++workers->epoch;
+        }
+
+        workers->published = now;
+    }
+
+    nshards = workers->nshards;
+
+    for (i = 0; i < nshards && workers->shards[i] != ngx_worker; i++);
+
+    ngx_shmtx_unlock(&workers_slab->mutex);
+
+    *shard = i;
+
+    if (epoch != 0)
+        ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
+                      "healthcheck: shards epoch %ui, %ui workers",
+                      epoch, nshards);
+
+    return nshards;
+}
+
+
+/*
+ * Jump consistent hash (Lamping, Veach): only 1/n of the keys
+ * move when the number of buckets changes.
+ */
+
+ngx_uint_t
+ngx_dynamic_healthcheck_workers_shard(ngx_str_t *key, ngx_uint_t n)
+{
+    uint64_t  h;
+    int64_t   b = -1, j = 0;
+
+    h = ngx_crc32_short(key->data, key->len);
+
+    while (j < (int64_t) n) {
+        b = j;
+        h = h * 2862933555777941757ULL + 1;
+        j = (int64_t) ((b + 1) * ((double) (1LL << 31)
+                                  / (double) ((h >> 33) + 1)));
+    }
+
+    return (ngx_uint_t) b;
+}
+
+
+uint64_t
+ngx_dynamic_healthcheck_usec(void)
+{
+    struct timeval  tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+/*
+ * Only the outermost lock is timed, the zones of different upstreams
+ * may be locked one inside another.
+ */
+
+void
+ngx_dynamic_healthcheck_shmtx_lock(ngx_shmtx_t *mtx)
+{
+    ngx_shmtx_lock(mtx);
+
+    if (lock_depth++ == 0)
+        lock_start = ngx_dynamic_healthcheck_usec();
+}
+
+
+void
+ngx_dynamic_healthcheck_shmtx_unlock(ngx_shmtx_t *mtx)
+{
+    uint64_t  hold;
+
+    if (lock_depth != 0 && --lock_depth == 0) {
+
+        hold = ngx_dynamic_healthcheck_usec() - lock_start;
+
+        lock_stat.acquired++;
+        lock_stat.hold += hold;
+        lock_stat.max = ngx_max(lock_stat.max, hold);
+    }
+
+    ngx_shmtx_unlock(mtx);
+}
+
+
+void
+ngx_dynamic_healthcheck_workers_gc(ngx_uint_t collected, uint64_t time)
+{
+    gc_stat.runs++;
+    gc_stat.collected += collected;
+    gc_stat.time += time;
+    gc_stat.max = ngx_max(gc_stat.max, time);
+}
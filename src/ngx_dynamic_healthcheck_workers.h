@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+#ifndef NGX_DYNAMIC_HEALTHCHECK_WORKERS_H
+#define NGX_DYNAMIC_HEALTHCHECK_WORKERS_H
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include <ngx_core.h>
+
+#include "ngx_dynamic_healthcheck_alloc.h"
+
+
+/*
+ * worker is considered dead if it has not refreshed timers
+ * for this period
+ */
+#define NGX_DYNAMIC_HC_WORKER_ALIVE      3000
+
+#define NGX_DYNAMIC_HC_WORKER_HEARTBEAT  (NGX_DYNAMIC_HC_WORKER_ALIVE / 3)
+
+
+/*
+ * time the shared zones mutexes are held by this worker, usec
+ */
+
+typedef struct {
+    ngx_uint_t                     acquired;
+    uint64_t                       hold;
+    uint64_t                       max;
+} ngx_dynamic_hc_lock_stat_t;
+
+
+/*
+ * state collection of the shared zones by this worker, usec
+ */
+
+typedef struct {
+    ngx_uint_t                     runs;
+    ngx_uint_t                     collected;
+    uint64_t                       time;
+    uint64_t                       max;
+} ngx_dynamic_hc_gc_stat_t;
+
+
+typedef struct {
+    ngx_pid_t                      pid;
+    ngx_msec_t                     heartbeat;
+    ngx_uint_t                     load;
+    ngx_dynamic_hc_alloc_stat_t    alloc;
+    ngx_dynamic_hc_lock_stat_t     lock;
+    ngx_dynamic_hc_gc_stat_t       gc;
+} ngx_dynamic_hc_worker_t;
+
+
+typedef struct {
+    ngx_dynamic_hc_worker_t        workers[NGX_MAX_PROCESSES];
+    // bumped on each update of the options of any upstream
+    ngx_atomic_t                   updated;
+    // alive workers the sharded upstreams are split between,
+    // one view for all workers, bumps the epoch on each change
+    ngx_uint_t                     shards[NGX_MAX_PROCESSES];
+    ngx_uint_t                     nshards;
+    ngx_uint_t                     epoch;
+    ngx_msec_t                     published;
+} ngx_dynamic_hc_workers_t;
+
+
+ngx_int_t
+ngx_dynamic_healthcheck_workers_add(ngx_conf_t *cf);
+
+ngx_int_t
+ngx_dynamic_healthcheck_workers_init(ngx_cycle_t *cycle);
+
+ngx_dynamic_hc_workers_t *
+ngx_dynamic_healthcheck_workers(void);
+
+void
+ngx_dynamic_healthcheck_workers_heartbeat(ngx_msec_t now, ngx_uint_t load);
+
+void
+ngx_dynamic_healthcheck_workers_exit(void);
+
+void
+ngx_dynamic_healthcheck_workers_touch(void);
+
+ngx_atomic_uint_t
+ngx_dynamic_healthcheck_workers_updated(void);
+
+ngx_flag_t
+ngx_dynamic_healthcheck_workers_pid_alive(ngx_pid_t pid, ngx_msec_t now);
+
+ngx_uint_t
+ngx_dynamic_healthcheck_workers_alive(ngx_msec_t now, ngx_uint_t *alive,
+    ngx_uint_t n);
+
+ngx_uint_t
+ngx_dynamic_healthcheck_workers_shards(ngx_msec_t now, ngx_uint_t n,
+    ngx_uint_t *shard);
+
+ngx_uint_t
+ngx_dynamic_healthcheck_workers_shard(ngx_str_t *key, ngx_uint_t n);
+
+void
+ngx_dynamic_healthcheck_shmtx_lock(ngx_shmtx_t *mtx);
+
+void
+ngx_dynamic_healthcheck_shmtx_unlock(ngx_shmtx_t *mtx);
+
+uint64_t
+ngx_dynamic_healthcheck_usec(void);
+
+void
+ngx_dynamic_healthcheck_workers_gc(ngx_uint_t collected, uint64_t time);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* NGX_DYNAMIC_HEALTHCHECK_WORKERS_H */
@@ -4,6 +4,7 @@
 
 #include "ngx_dynamic_shm.h"
 #include "ngx_dynamic_healthcheck.h"
+#include "ngx_dynamic_healthcheck_snapshot.h"
 
 
 static void
@@ -346,6 +347,15 @@ ngx_init_shm_zone(ngx_shm_zone_t *zone, void *old)
     if (!(sh->flags & NGX_DYNAMIC_UPDATE_OPT_PASSIVE))
         sh->passive = opts->passive;
 
+    sh->passive_window = opts->passive_window;
+    sh->passive_latency = opts->passive_latency;
+    ngx_memcpy(sh->passive_codes, opts->passive_codes,
+               sizeof(sh->passive_codes));
+
+    sh->outlier = opts->outlier;
+    sh->outlier_errors = opts->outlier_errors;
+    sh->outlier_ejection = opts->outlier_ejection;
+
     if (!(sh->flags & NGX_DYNAMIC_UPDATE_OPT_TYPE))
         b = b && NGX_OK == ngx_shm_str_copy(&sh->type, &opts->type, slab);
     if (!(sh->flags & NGX_DYNAMIC_UPDATE_OPT_URI))
@@ -383,8 +393,15 @@ ngx_init_shm_zone(ngx_shm_zone_t *zone, void *old)
 
     sh->state.slab = slab;
     sh->buffer_size = opts->buffer_size;
+    sh->splay = opts->splay;
+    sh->concurrency = opts->concurrency;
+    sh->shard = opts->shard;
 
     sh->updated = 1;
+    sh->generation++;
+
+    if (b)
+        b = ngx_dynamic_healthcheck_snapshot_publish(sh) == NGX_OK;
 
     ngx_shmtx_unlock(&slab->mutex);
 
@@ -15,6 +15,8 @@ extern "C" {
 #include "ngx_dynamic_healthcheck_config.h"
 #include "ngx_dynamic_healthcheck_api.h"
 #include "ngx_dynamic_healthcheck_state.h"
+#include "ngx_dynamic_healthcheck_workers.h"
+#include "ngx_dynamic_healthcheck_snapshot.h"
 
 
 static char *
@@ -160,6 +162,27 @@ static ngx_command_t ngx_http_dynamic_healthcheck_commands[] = {
       offsetof(ngx_dynamic_healthcheck_opts_t, persistent),
       NULL },
 
+    { ngx_string("check_ssl_trusted_certificate"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_dynamic_healthcheck_opts_t, ssl_trusted_certificate),
+      NULL },
+
+    { ngx_string("check_ssl_certificate"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_dynamic_healthcheck_opts_t, ssl_certificate),
+      NULL },
+
+    { ngx_string("check_ssl_certificate_key"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_dynamic_healthcheck_opts_t, ssl_certificate_key),
+      NULL },
+
     { ngx_string("healthcheck_get"),
       NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
       ngx_http_dynamic_healthcheck_get,
@@ -273,11 +296,39 @@ ngx_stream_dynamic_healthcheck_create_module(lua_State *L);
 #endif
 
 
+static ngx_flag_t
+ngx_http_dynamic_healthcheck_failed(ngx_dynamic_healthcheck_opts_t *opts,
+    ngx_http_upstream_state_t *state)
+{
+    // connect error or timeout, the status is set when the attempt
+    // has failed, not when the client has gone before the connect
+
+    if (state->connect_time == (ngx_msec_t) -1)
+        return state->status == NGX_HTTP_BAD_GATEWAY
+               || state->status == NGX_HTTP_GATEWAY_TIME_OUT;
+
+    if (ngx_dynamic_healthcheck_passive_code(opts, state->status))
+        return 1;
+
+    return opts->passive_latency != 0
+           && state->response_time != (ngx_msec_t) -1
+           && state->response_time > opts->passive_latency;
+}
+
+
+/*
+ * Each upstream attempt of the request is accounted, including
+ * the ones passed to the next peer.
+ */
+
 static ngx_int_t
 ngx_http_dynamic_healthcheck_touch(ngx_http_request_t *r)
 {
     ngx_dynamic_healthcheck_conf_t  *uscf;
+    ngx_dynamic_healthcheck_opts_t  *opts;
     ngx_http_upstream_state_t       *state;
+    ngx_uint_t                       i;
+    ngx_flag_t                       failed, outlier;
 
     if (r->upstream == NULL
         || r->upstream->upstream == NULL
@@ -291,16 +342,52 @@ ngx_http_dynamic_healthcheck_touch(ngx_http_request_t *r)
     if (uscf == NULL || uscf->shared == NULL)
         return NGX_OK;
 
-    if (!uscf->shared->passive)
+    opts = uscf->shared;
+    outlier = opts->outlier || opts->outlier_errors;
+
+    if ((!opts->passive && !outlier) || r->upstream_states == NULL)
         return NGX_OK;
 
-    state = r->upstream->state;
+    state = (ngx_http_upstream_state_t *) r->upstream_states->elts;
 
-    if (state == NULL || state->peer == NULL)
-        return NGX_OK;
+    for (i = 0; i < r->upstream_states->nelts; i++) {
+
+        if (state[i].peer == NULL)
+            continue;
 
-    if (state->status < NGX_HTTP_SPECIAL_RESPONSE)
-        ngx_dynamic_healthcheck_state_checked(&uscf->peers, state->peer);
+        failed = ngx_http_dynamic_healthcheck_failed(opts, &state[i]);
+
+        // the client has gone before the connect, nothing to account
+
+        if (!failed && state[i].connect_time == (ngx_msec_t) -1)
+            continue;
+
+        if (outlier)
+            ngx_dynamic_healthcheck_state_observe(&uscf->peers, state[i].peer,
+                state[i].response_time, failed);
+
+        if (!opts->passive)
+            continue;
+
+        if (!failed) {
+            if (state[i].status < NGX_HTTP_SPECIAL_RESPONSE)
+                ngx_dynamic_healthcheck_state_checked(&uscf->peers,
+                                                      state[i].peer);
+            continue;
+        }
+
+        if (ngx_dynamic_healthcheck_state_fail(&uscf->peers, state[i].peer,
+                opts->passive_window, opts->fall) != NGX_OK)
+            continue;
+
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "[%V] %V: addr=%V down by passive check",
+                      &uscf->config.module, &uscf->config.upstream,
+                      state[i].peer);
+
+        ngx_dynamic_healthcheck_api_base::passive_down(
+            (ngx_http_upstream_srv_conf_t *) uscf->uscf, state[i].peer);
+    }
 
     return NGX_OK;
 }
@@ -360,8 +447,19 @@ ngx_http_dynamic_healthcheck_create_conf(ngx_conf_t *cf)
     conf->config.timeout     = NGX_CONF_UNSET_UINT;
     conf->config.interval    = NGX_CONF_UNSET;
     conf->config.keepalive   = NGX_CONF_UNSET_UINT;
+    conf->config.splay       = NGX_CONF_UNSET_UINT;
+    conf->config.concurrency = NGX_CONF_UNSET_UINT;
+    conf->config.shard       = NGX_CONF_UNSET;
     conf->config.buffer_size = NGX_CONF_UNSET_SIZE;
 
+    conf->config.passive_window   = NGX_CONF_UNSET_MSEC;
+    conf->config.passive_latency  = NGX_CONF_UNSET_MSEC;
+    conf->config.outlier          = NGX_CONF_UNSET_UINT;
+    conf->config.outlier_errors   = NGX_CONF_UNSET_UINT;
+    conf->config.outlier_ejection = NGX_CONF_UNSET_MSEC;
+    conf->config.ssl_verify       = NGX_CONF_UNSET;
+    conf->config.redis_role       = NGX_CONF_UNSET_UINT;
+
     return conf;
 }
 
@@ -439,11 +537,18 @@ ngx_http_dynamic_healthcheck_init_srv_conf(ngx_conf_t *cf,
     ngx_conf_merge_value(conf->config.timeout,
         main_conf->config.timeout, 1000);
     ngx_conf_merge_value(conf->config.interval,
-        main_conf->config.interval, 10);
+        main_conf->config.interval, 10000);
     ngx_conf_merge_uint_value(conf->config.keepalive,
         main_conf->config.keepalive, 1);
     ngx_conf_merge_value(conf->config.passive,
         main_conf->config.passive, 0);
+    ngx_dynamic_healthcheck_merge_passive(&conf->config, &main_conf->config);
+    ngx_conf_merge_uint_value(conf->config.splay,
+        main_conf->config.splay, 0);
+    ngx_conf_merge_uint_value(conf->config.concurrency,
+        main_conf->config.concurrency, 0);
+    ngx_conf_merge_value(conf->config.shard,
+        main_conf->config.shard, 0);
     ngx_conf_merge_str_value(conf->config.request_uri,
         main_conf->config.request_uri);
     ngx_conf_merge_str_value(conf->config.request_method,
@@ -462,6 +567,14 @@ ngx_http_dynamic_healthcheck_init_srv_conf(ngx_conf_t *cf,
         main_conf->config.disabled_hosts);
     ngx_conf_merge_str_value(conf->config.persistent,
         main_conf->config.persistent);
+    ngx_conf_merge_str_value(conf->config.grpc_service,
+        main_conf->config.grpc_service);
+    ngx_conf_merge_str_value(conf->config.redis_user,
+        main_conf->config.redis_user);
+    ngx_conf_merge_str_value(conf->config.redis_password,
+        main_conf->config.redis_password);
+    ngx_conf_merge_uint_value(conf->config.redis_role,
+        main_conf->config.redis_role, NGX_DYNAMIC_HC_REDIS_ANY);
 
     if (conf->config.type.data != NULL
         && ngx_strncmp(conf->config.type.data, "http", 4) == 0)
@@ -487,6 +600,10 @@ ngx_http_dynamic_healthcheck_init_srv_conf(ngx_conf_t *cf,
         return NGX_ERROR;
     }
 
+    if (ngx_dynamic_healthcheck_init_ssl(cf, conf, &main_conf->config)
+            != NGX_OK)
+        return NGX_ERROR;
+
     conf->uscf = uscf;
     conf->post_init = ngx_http_dynamic_healthcheck_init_peers;
     conf->zone = ngx_shm_create_zone(cf, conf,
@@ -515,6 +632,9 @@ ngx_http_dynamic_healthcheck_init_main_conf(ngx_conf_t *cf, void *conf)
         if (ngx_http_dynamic_healthcheck_init_srv_conf(cf, *b) != NGX_OK)
             return (char *) NGX_CONF_ERROR;
 
+    if (ngx_dynamic_healthcheck_workers_add(cf) != NGX_OK)
+        return (char *) NGX_CONF_ERROR;
+
     ngx_log_error(NGX_LOG_NOTICE, cf->log, 0,
                   "http dynamic healthcheck module loaded");
 
@@ -672,6 +792,8 @@ ngx_http_dynamic_healthcheck_get_hc(ngx_http_request_t *r,
         shared->excluded_hosts
     };
 
+    u_char interval[NGX_INT_T_LEN + 5];
+
     if (out == NULL)
         return NULL;
 
@@ -680,14 +802,15 @@ ngx_http_dynamic_healthcheck_get_hc(ngx_http_request_t *r,
         return NULL;
 
     if (shared != NULL) {
-        SCOPED_SLAB_LOCK(shared->state.slab);
+        *ngx_dynamic_healthcheck_print_interval(interval,
+            interval + sizeof(interval) - 1, shared->interval) = 0;
 
         out->buf->last = ngx_snprintf(out->buf->last,
                                       out->buf->end - out->buf->last,
             "{"                                   CRLF
             "%V    \"rise\":%d,"                  CRLF
             "%V    \"fall\":%d,"                  CRLF
-            "%V    \"interval\":%d,"              CRLF
+            "%V    \"interval\":%s,"              CRLF
             "%V    \"keepalive\":%d,"             CRLF
             "%V    \"timeout\":%d,"               CRLF
             "%V    \"type\":\"%V\","              CRLF
@@ -696,7 +819,7 @@ ngx_http_dynamic_healthcheck_get_hc(ngx_http_request_t *r,
             "%V    \"command\":{"                 CRLF,
                 &tab, shared->rise,
                 &tab, shared->fall,
-                &tab, shared->interval,
+                &tab, interval,
                 &tab, shared->keepalive,
                 &tab, shared->timeout,
                 &tab, &shared->type,
@@ -767,6 +890,7 @@ ngx_http_dynamic_healthcheck_get(ngx_http_request_t *r,
     S                               **uscf;
     M                                *umcf = NULL;
     ngx_dynamic_healthcheck_conf_t   *conf;
+    ngx_dynamic_healthcheck_opts_t   *opts;
     ngx_chain_t                      *start = NULL, *out = NULL, *next = NULL;
     ngx_uint_t                        i;
     ngx_str_t                         tab = no_tab;
@@ -818,7 +942,12 @@ ngx_http_dynamic_healthcheck_get(ngx_http_request_t *r,
                                               "    \"%V\":",
                                               &conf->shared->upstream);
 
-            next = ngx_http_dynamic_healthcheck_get_hc(r, conf->shared, tab);
+            opts = ngx_dynamic_healthcheck_snapshot_read(conf->shared,
+                                                         r->pool);
+            if (opts == NULL)
+                return NULL;
+
+            next = ngx_http_dynamic_healthcheck_get_hc(r, opts, tab);
             if (next == NULL)
                 return NULL;
 
@@ -940,6 +1069,25 @@ set_str_opt(ngx_http_variable_value_t *v, ngx_str_t *opt,
 }
 
 
+static void
+set_time_opt(ngx_http_variable_value_t *v, ngx_int_t *n,
+    ngx_flag_t *flags, ngx_flag_t flag)
+{
+    ngx_str_t  s;
+
+    if (v->not_found)
+        return;
+
+    s.data = v->data;
+    s.len = v->len;
+
+    *n = ngx_parse_time(&s, 0);
+
+    if (*n != NGX_ERROR)
+        *flags |= flag;
+}
+
+
 template <class N> void
 set_num_opt(ngx_http_variable_value_t *v, N *n,
     ngx_flag_t *flags, ngx_flag_t flag)
@@ -1021,8 +1169,8 @@ ngx_http_dynamic_healthcheck_update(ngx_http_request_t *r)
                            &flags, NGX_DYNAMIC_UPDATE_OPT_RISE);
     set_num_opt<ngx_int_t>(timeout, &opts.timeout,
                            &flags, NGX_DYNAMIC_UPDATE_OPT_TIMEOUT);
-    set_num_opt<ngx_int_t>(interval, &opts.interval,
-                           &flags, NGX_DYNAMIC_UPDATE_OPT_INTERVAL);
+    set_time_opt(interval, &opts.interval,
+                 &flags, NGX_DYNAMIC_UPDATE_OPT_INTERVAL);
     set_num_opt<ngx_uint_t>(keepalive, &opts.keepalive,
                             &flags, NGX_DYNAMIC_UPDATE_OPT_KEEPALIVE);
     set_num_opt<ngx_uint_t>(port, &opts.port,
@@ -1393,6 +1541,94 @@ skip:
 }
 
 
+/*
+ * per worker probe engine counters
+ */
+
+static ngx_chain_t *
+ngx_http_dynamic_healthcheck_status_workers(ngx_http_request_t *r)
+{
+    ngx_dynamic_hc_workers_t  *workers;
+    ngx_dynamic_hc_worker_t   *w;
+    ngx_core_conf_t           *ccf;
+    ngx_chain_t               *out;
+    ngx_uint_t                 i;
+    ngx_flag_t                 first = 1;
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(ngx_cycle->conf_ctx,
+                                           ngx_core_module);
+
+    out = (ngx_chain_t *) ngx_pcalloc(r->pool, sizeof(ngx_chain_t));
+    if (out == NULL)
+        return NULL;
+
+    out->buf = ngx_create_temp_buf(r->pool, ngx_pagesize
+        + ccf->worker_processes * 768);
+    if (out->buf == NULL)
+        return NULL;
+
+    out->buf->last = ngx_snprintf(out->buf->last,
+                                  out->buf->end - out->buf->last,
+                                  "{" CRLF);
+
+    workers = ngx_dynamic_healthcheck_workers();
+
+    for (i = 0; workers != NULL && i < (ngx_uint_t) ccf->worker_processes
+                && i < NGX_MAX_PROCESSES; i++) {
+
+        w = &workers->workers[i];
+
+        if (w->heartbeat == 0)
+            continue;
+
+        if (!first)
+            out->buf->last = ngx_snprintf(out->buf->last,
+                out->buf->end - out->buf->last, "," CRLF);
+
+        first = 0;
+
+        out->buf->last = ngx_snprintf(out->buf->last,
+            out->buf->end - out->buf->last,
+            "    \"%ui\":{"                     CRLF
+            "        \"pid\":%P,"               CRLF
+            "        \"load\":%ui,"             CRLF
+            "        \"alloc\":{"               CRLF
+            "            \"allocated\":%ui,"    CRLF
+            "            \"reused\":%ui,"       CRLF
+            "            \"freed\":%ui,"        CRLF
+            "            \"used\":%ui,"         CRLF
+            "            \"cached\":%ui"        CRLF
+            "        },"                        CRLF
+            "        \"lock\":{"                CRLF
+            "            \"acquired\":%ui,"     CRLF
+            "            \"hold_usec\":%uL,"    CRLF
+            "            \"max_usec\":%uL"      CRLF
+            "        },"                        CRLF
+            "        \"gc\":{"                  CRLF
+            "            \"runs\":%ui,"         CRLF
+            "            \"collected\":%ui,"    CRLF
+            "            \"time_usec\":%uL,"    CRLF
+            "            \"max_usec\":%uL"      CRLF
+            "        }"                         CRLF
+            "    }",
+            i, w->pid, w->load,
+            w->alloc.allocated, w->alloc.reused, w->alloc.freed,
+            w->alloc.used, w->alloc.cached,
+            w->lock.acquired, w->lock.hold, w->lock.max,
+            w->gc.runs, w->gc.collected, w->gc.time, w->gc.max);
+    }
+
+    out->buf->last = ngx_snprintf(out->buf->last,
+                                  out->buf->end - out->buf->last,
+                                  "%s}" CRLF, first ? "" : CRLF);
+
+    out->buf->last_buf = (r == r->main) ? 1: 0;
+    out->buf->last_in_chain = 1;
+
+    return out;
+}
+
+
 static ngx_int_t
 ngx_http_dynamic_healthcheck_status_handler(ngx_http_request_t *r)
 {
@@ -1401,6 +1637,7 @@ ngx_http_dynamic_healthcheck_status_handler(ngx_http_request_t *r)
     ngx_int_t                   rc;
     ngx_http_variable_value_t  *upstream;
     ngx_http_variable_value_t  *stream;
+    ngx_http_variable_value_t  *workers;
     off_t                       content_length = 0;
 
     if (r->method != NGX_HTTP_GET)
@@ -1412,17 +1649,22 @@ ngx_http_dynamic_healthcheck_status_handler(ngx_http_request_t *r)
     upstream = get_arg(r, "arg_upstream");
     stream = get_arg(r, "arg_stream");
 
-    out = stream->not_found
-        ? ngx_http_dynamic_healthcheck_status
-            <ngx_http_upstream_main_conf_t,
-             ngx_http_upstream_srv_conf_t,
-             ngx_http_upstream_rr_peers_t,
-             ngx_http_upstream_rr_peer_t> (r, upstream)
-        : ngx_http_dynamic_healthcheck_status
-            <ngx_stream_upstream_main_conf_t,
-             ngx_stream_upstream_srv_conf_t,
-             ngx_stream_upstream_rr_peers_t,
-             ngx_stream_upstream_rr_peer_t>(r, upstream);
+    workers = get_arg(r, "arg_workers");
+
+    if (!workers->not_found)
+        out = ngx_http_dynamic_healthcheck_status_workers(r);
+    else
+        out = stream->not_found
+            ? ngx_http_dynamic_healthcheck_status
+                <ngx_http_upstream_main_conf_t,
+                 ngx_http_upstream_srv_conf_t,
+                 ngx_http_upstream_rr_peers_t,
+                 ngx_http_upstream_rr_peer_t> (r, upstream)
+            : ngx_http_dynamic_healthcheck_status
+                <ngx_stream_upstream_main_conf_t,
+                 ngx_stream_upstream_srv_conf_t,
+                 ngx_stream_upstream_rr_peers_t,
+                 ngx_stream_upstream_rr_peer_t>(r, upstream);
 
     if (out == NULL)
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
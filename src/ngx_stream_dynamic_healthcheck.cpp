@@ -20,6 +20,7 @@ extern "C" {
 #include "ngx_dynamic_healthcheck_config.h"
 #include "ngx_dynamic_healthcheck_api.h"
 #include "ngx_dynamic_healthcheck_state.h"
+#include "ngx_dynamic_healthcheck_workers.h"
 
 
 static ngx_command_t ngx_stream_dynamic_healthcheck_commands[] = {
@@ -122,6 +123,27 @@ static ngx_command_t ngx_stream_dynamic_healthcheck_commands[] = {
       offsetof(ngx_dynamic_healthcheck_opts_t, persistent),
       NULL },
 
+    { ngx_string("check_ssl_trusted_certificate"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_dynamic_healthcheck_opts_t, ssl_trusted_certificate),
+      NULL },
+
+    { ngx_string("check_ssl_certificate"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_dynamic_healthcheck_opts_t, ssl_certificate),
+      NULL },
+
+    { ngx_string("check_ssl_certificate_key"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_dynamic_healthcheck_opts_t, ssl_certificate_key),
+      NULL },
+
     { ngx_string("check_exclude_host"),
       NGX_STREAM_UPS_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_str_array_slot2,
@@ -134,12 +156,8 @@ static ngx_command_t ngx_stream_dynamic_healthcheck_commands[] = {
 };
 
 
-#ifdef _WITH_LUA_API
 static ngx_int_t
 ngx_stream_dynamic_healthcheck_post_conf(ngx_conf_t *cf);
-#else
-#define ngx_stream_dynamic_healthcheck_post_conf NULL
-#endif
 
 
 static char *
@@ -217,18 +235,126 @@ ngx_stream_dynamic_healthcheck_create_module(lua_State *L)
 }
 
 
+#endif
+
+
+/*
+ * Connect errors and timeouts are failures, the session which has
+ * received data from the peer postpones the active checks.
+ * Latency of the stream is the connect time, outlier detection
+ * uses the time to the first byte of the peer when it is known.
+ */
+
+static ngx_int_t
+ngx_stream_dynamic_healthcheck_touch(ngx_stream_session_t *s)
+{
+    ngx_dynamic_healthcheck_conf_t  *uscf;
+    ngx_dynamic_healthcheck_opts_t  *opts;
+    ngx_stream_upstream_state_t     *state;
+    ngx_uint_t                       i;
+    ngx_flag_t                       failed, outlier;
+    ngx_msec_t                       latency;
+
+    if (s->upstream == NULL
+        || s->upstream->upstream == NULL
+        || s->upstream->upstream->srv_conf == NULL
+        || s->upstream_states == NULL)
+        return NGX_OK;
+
+    uscf = (ngx_dynamic_healthcheck_conf_t *)
+        ngx_stream_conf_upstream_srv_conf(s->upstream->upstream,
+            ngx_stream_dynamic_healthcheck_module);
+
+    if (uscf == NULL || uscf->shared == NULL)
+        return NGX_OK;
+
+    opts = uscf->shared;
+    outlier = opts->outlier || opts->outlier_errors;
+
+    if (!opts->passive && !outlier)
+        return NGX_OK;
+
+    state = (ngx_stream_upstream_state_t *) s->upstream_states->elts;
+
+    for (i = 0; i < s->upstream_states->nelts; i++) {
+
+        if (state[i].peer == NULL)
+            continue;
+
+        // an attempt before the last one without connect has failed,
+        // the last one unless the client has gone before the connect
+
+        if (state[i].connect_time == (ngx_msec_t) -1
+            && i + 1 == s->upstream_states->nelts
+            && s->status != NGX_STREAM_BAD_GATEWAY)
+            continue;
+
+        failed = state[i].connect_time == (ngx_msec_t) -1
+                 || (opts->passive_latency != 0
+                     && state[i].connect_time > opts->passive_latency);
+
+        if (outlier) {
+            latency = state[i].first_byte_time != (ngx_msec_t) -1
+                      ? state[i].first_byte_time : state[i].connect_time;
+
+            ngx_dynamic_healthcheck_state_observe(&uscf->peers, state[i].peer,
+                                                  latency, failed);
+        }
+
+        if (!opts->passive)
+            continue;
+
+        if (!failed) {
+            if (state[i].bytes_received != 0)
+                ngx_dynamic_healthcheck_state_checked(&uscf->peers,
+                                                      state[i].peer);
+            continue;
+        }
+
+        if (ngx_dynamic_healthcheck_state_fail(&uscf->peers, state[i].peer,
+                opts->passive_window, opts->fall) != NGX_OK)
+            continue;
+
+        ngx_log_error(NGX_LOG_WARN, s->connection->log, 0,
+                      "[%V] %V: addr=%V down by passive check",
+                      &uscf->config.module, &uscf->config.upstream,
+                      state[i].peer);
+
+        ngx_dynamic_healthcheck_api_base::passive_down(
+            (ngx_stream_upstream_srv_conf_t *) uscf->uscf, state[i].peer);
+    }
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_stream_dynamic_healthcheck_post_conf(ngx_conf_t *cf)
 {
+    ngx_stream_core_main_conf_t  *cmcf;
+    ngx_stream_handler_pt        *handler;
+
+#ifdef _WITH_LUA_API
+
     if (ngx_stream_lua_add_package_preload(cf, "ngx.healthcheck",
         ngx_stream_dynamic_healthcheck_create_module) != NGX_OK)
         return NGX_ERROR;
 
+#endif
+
+    cmcf = (ngx_stream_core_main_conf_t *)
+        ngx_stream_conf_get_module_main_conf(cf, ngx_stream_core_module);
+
+    handler = (ngx_stream_handler_pt *)
+        ngx_array_push(&cmcf->phases[NGX_STREAM_LOG_PHASE].handlers);
+    if (handler == NULL)
+        return NGX_ERROR;
+
+    *handler = ngx_stream_dynamic_healthcheck_touch;
+
     return NGX_OK;
 }
 
-#endif
-
 static void *
 ngx_stream_dynamic_healthcheck_create_conf(ngx_conf_t *cf)
 {
@@ -250,9 +376,20 @@ ngx_stream_dynamic_healthcheck_create_conf(ngx_conf_t *cf)
     conf->config.rise        = NGX_CONF_UNSET;
     conf->config.timeout     = NGX_CONF_UNSET_UINT;
     conf->config.interval    = NGX_CONF_UNSET;
-    conf->config.keepalive   = 1;
+    conf->config.keepalive   = NGX_CONF_UNSET_UINT;
+    conf->config.splay       = NGX_CONF_UNSET_UINT;
+    conf->config.concurrency = NGX_CONF_UNSET_UINT;
+    conf->config.shard       = NGX_CONF_UNSET;
     conf->config.buffer_size = NGX_CONF_UNSET_SIZE;
 
+    conf->config.passive_window   = NGX_CONF_UNSET_MSEC;
+    conf->config.passive_latency  = NGX_CONF_UNSET_MSEC;
+    conf->config.outlier          = NGX_CONF_UNSET_UINT;
+    conf->config.outlier_errors   = NGX_CONF_UNSET_UINT;
+    conf->config.outlier_ejection = NGX_CONF_UNSET_MSEC;
+    conf->config.ssl_verify       = NGX_CONF_UNSET;
+    conf->config.redis_role       = NGX_CONF_UNSET_UINT;
+
     return conf;
 }
 
@@ -330,10 +467,18 @@ ngx_stream_dynamic_healthcheck_init_srv_conf(ngx_conf_t *cf,
     ngx_conf_merge_value(conf->config.timeout,
         main_conf->config.timeout, 1000);
     ngx_conf_merge_value(conf->config.interval,
-        main_conf->config.interval, 10);
-    conf->config.keepalive = 1;
+        main_conf->config.interval, 10000);
+    ngx_conf_merge_uint_value(conf->config.keepalive,
+        main_conf->config.keepalive, 1);
     ngx_conf_merge_value(conf->config.passive,
         main_conf->config.passive, 0);
+    ngx_dynamic_healthcheck_merge_passive(&conf->config, &main_conf->config);
+    ngx_conf_merge_uint_value(conf->config.splay,
+        main_conf->config.splay, 0);
+    ngx_conf_merge_uint_value(conf->config.concurrency,
+        main_conf->config.concurrency, 0);
+    ngx_conf_merge_value(conf->config.shard,
+        main_conf->config.shard, 0);
     ngx_conf_merge_str_value(conf->config.request_body,
         main_conf->config.request_body);
     ngx_conf_merge_str_value(conf->config.response_body,
@@ -344,6 +489,20 @@ ngx_stream_dynamic_healthcheck_init_srv_conf(ngx_conf_t *cf,
         main_conf->config.disabled_hosts);
     ngx_conf_merge_str_value(conf->config.persistent,
         main_conf->config.persistent);
+    ngx_conf_merge_str_value(conf->config.grpc_service,
+        main_conf->config.grpc_service);
+    ngx_conf_merge_str_value(conf->config.redis_user,
+        main_conf->config.redis_user);
+    ngx_conf_merge_str_value(conf->config.redis_password,
+        main_conf->config.redis_password);
+    ngx_conf_merge_uint_value(conf->config.redis_role,
+        main_conf->config.redis_role, NGX_DYNAMIC_HC_REDIS_ANY);
+
+    // only redis replies are framed on a raw stream connection
+
+    if (conf->config.type.len != 5
+        || ngx_strncmp(conf->config.type.data, "redis", 5) != 0)
+        conf->config.keepalive = 1;
 
     if (conf->config.type.data != NULL
         && ngx_strncmp(conf->config.type.data, "http", 4) == 0)
@@ -369,6 +528,10 @@ ngx_stream_dynamic_healthcheck_init_srv_conf(ngx_conf_t *cf,
         return NGX_ERROR;
     }
 
+    if (ngx_dynamic_healthcheck_init_ssl(cf, conf, &main_conf->config)
+            != NGX_OK)
+        return NGX_ERROR;
+
     conf->uscf = uscf;
     conf->post_init = ngx_stream_dynamic_healthcheck_init_peers;
     conf->zone = ngx_shm_create_zone(cf, conf,
@@ -397,6 +560,9 @@ ngx_stream_dynamic_healthcheck_init_main_conf(ngx_conf_t *cf, void *conf)
         if (ngx_stream_dynamic_healthcheck_init_srv_conf(cf, *b) != NGX_OK)
             return (char *) NGX_CONF_ERROR;
 
+    if (ngx_dynamic_healthcheck_workers_add(cf) != NGX_OK)
+        return (char *) NGX_CONF_ERROR;
+
     ngx_log_error(NGX_LOG_NOTICE, cf->log, 0,
                   "stream dynamic healthcheck module loaded");
 
@@ -0,0 +1,397 @@
+use Test::Nginx::Socket;
+use Test::Nginx::Socket::Lua::Stream;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+
+=== TEST 1: latency outlier
+--- http_config
+    lua_load_resty_core off;
+    upstream u1 {
+        zone shm-u1 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:6003;
+        check type=http fall=1 rise=1 timeout=1500 interval=1
+              outlier=5 outlier_ejection=30s;
+        check_request_uri GET /heartbeat;
+        check_response_codes 200;
+    }
+    server {
+      listen 6001;
+      listen 6002;
+      location /heartbeat {
+        return 200;
+      }
+      location /x {
+        return 200;
+      }
+    }
+    server {
+      listen 6003;
+      location /heartbeat {
+        return 200;
+      }
+      location /x {
+        content_by_lua_block {
+          ngx.sleep(0.03)
+          ngx.say("ok")
+        }
+      }
+    }
+--- config
+    location /proxy/ {
+      proxy_pass http://u1/;
+    }
+    location /status {
+      healthcheck_status;
+    }
+    location /test {
+        content_by_lua_block {
+            -- latency and errors are observed in the log phase
+            -- of main requests, subrequests are not logged
+            local function traffic()
+              for i = 1, 75 do
+                local sock = ngx.socket.tcp()
+                assert(sock:connect("127.0.0.1", ngx.var.server_port))
+                assert(sock:send("GET /proxy/x HTTP/1.0\r\n"
+                                 .. "Host: localhost\r\n\r\n"))
+                assert(sock:receive("*a"))
+                sock:close()
+              end
+            end
+            local function status()
+              local resp = assert(ngx.location.capture("/status"))
+              if resp.status ~= ngx.HTTP_OK then
+                ngx.say(resp.status)
+              end
+              local cjson = require "cjson"
+              local data = cjson.decode(resp.body)
+              local t = {}
+              for u, h in pairs(data)
+              do
+                for p, s in pairs(h.primary)
+                do
+                  table.insert(t, string.format("%s %s %d", u, p, s.down))
+                end
+              end
+              table.sort(t)
+              for i,l in ipairs(t)
+              do
+                ngx.say(l)
+                ngx.log(ngx.INFO, l)
+              end
+            end
+            ngx.sleep(0.5)
+            traffic()
+            ngx.sleep(1.5)
+            status()
+        }
+    }
+--- timeout: 5
+--- request
+    GET /test
+--- response_body
+u1 127.0.0.1:6001 0
+u1 127.0.0.1:6002 0
+u1 127.0.0.1:6003 1
+
+=== TEST 2: error rate outlier
+--- http_config
+    lua_load_resty_core off;
+    upstream u1 {
+        zone shm-u1 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:6003;
+        check type=http fall=1 rise=1 timeout=1500 interval=1
+              outlier_errors=50 outlier_ejection=30s;
+        check_request_uri GET /heartbeat;
+        check_response_codes 200;
+    }
+    server {
+      listen 6001;
+      listen 6002;
+      location /heartbeat {
+        return 200;
+      }
+      location /x {
+        return 200;
+      }
+    }
+    server {
+      listen 6003;
+      location /heartbeat {
+        return 200;
+      }
+      location /x {
+        return 503;
+      }
+    }
+--- config
+    location /proxy/ {
+      proxy_pass http://u1/;
+    }
+    location /status {
+      healthcheck_status;
+    }
+    location /test {
+        content_by_lua_block {
+            -- latency and errors are observed in the log phase
+            -- of main requests, subrequests are not logged
+            local function traffic()
+              for i = 1, 75 do
+                local sock = ngx.socket.tcp()
+                assert(sock:connect("127.0.0.1", ngx.var.server_port))
+                assert(sock:send("GET /proxy/x HTTP/1.0\r\n"
+                                 .. "Host: localhost\r\n\r\n"))
+                assert(sock:receive("*a"))
+                sock:close()
+              end
+            end
+            local function status()
+              local resp = assert(ngx.location.capture("/status"))
+              if resp.status ~= ngx.HTTP_OK then
+                ngx.say(resp.status)
+              end
+              local cjson = require "cjson"
+              local data = cjson.decode(resp.body)
+              local t = {}
+              for u, h in pairs(data)
+              do
+                for p, s in pairs(h.primary)
+                do
+                  table.insert(t, string.format("%s %s %d", u, p, s.down))
+                end
+              end
+              table.sort(t)
+              for i,l in ipairs(t)
+              do
+                ngx.say(l)
+                ngx.log(ngx.INFO, l)
+              end
+            end
+            ngx.sleep(0.5)
+            traffic()
+            ngx.sleep(1.5)
+            status()
+        }
+    }
+--- timeout: 5
+--- request
+    GET /test
+--- response_body
+u1 127.0.0.1:6001 0
+u1 127.0.0.1:6002 0
+u1 127.0.0.1:6003 1
+
+=== TEST 3: ejection backoff
+--- http_config
+    lua_load_resty_core off;
+    upstream u1 {
+        zone shm-u1 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:6003;
+        check type=http fall=1 rise=1 timeout=1500 interval=1
+              outlier_errors=50 outlier_ejection=2s;
+        check_request_uri GET /heartbeat;
+        check_response_codes 200;
+    }
+    server {
+      listen 6001;
+      listen 6002;
+      location /heartbeat {
+        return 200;
+      }
+      location /x {
+        return 200;
+      }
+    }
+    server {
+      listen 6003;
+      location /heartbeat {
+        return 200;
+      }
+      location /x {
+        return 503;
+      }
+    }
+--- config
+    location /proxy/ {
+      proxy_pass http://u1/;
+    }
+    location /status {
+      healthcheck_status;
+    }
+    location /test {
+        content_by_lua_block {
+            -- latency and errors are observed in the log phase
+            -- of main requests, subrequests are not logged
+            local function traffic()
+              for i = 1, 75 do
+                local sock = ngx.socket.tcp()
+                assert(sock:connect("127.0.0.1", ngx.var.server_port))
+                assert(sock:send("GET /proxy/x HTTP/1.0\r\n"
+                                 .. "Host: localhost\r\n\r\n"))
+                assert(sock:receive("*a"))
+                sock:close()
+              end
+            end
+            local function status()
+              local resp = assert(ngx.location.capture("/status"))
+              if resp.status ~= ngx.HTTP_OK then
+                ngx.say(resp.status)
+              end
+              local cjson = require "cjson"
+              local data = cjson.decode(resp.body)
+              local t = {}
+              for u, h in pairs(data)
+              do
+                for p, s in pairs(h.primary)
+                do
+                  table.insert(t, string.format("%s %s %d", u, p, s.down))
+                end
+              end
+              table.sort(t)
+              for i,l in ipairs(t)
+              do
+                ngx.say(l)
+                ngx.log(ngx.INFO, l)
+              end
+            end
+            ngx.sleep(0.5)
+            traffic()
+            ngx.sleep(1.5)
+            status()
+            ngx.sleep(3)
+            status()
+            -- the second ejection lasts 4s
+            traffic()
+            ngx.sleep(1.5)
+            status()
+            ngx.sleep(2)
+            status()
+            ngx.sleep(3)
+            status()
+        }
+    }
+--- timeout: 16
+--- request
+    GET /test
+--- response_body
+u1 127.0.0.1:6001 0
+u1 127.0.0.1:6002 0
+u1 127.0.0.1:6003 1
+u1 127.0.0.1:6001 0
+u1 127.0.0.1:6002 0
+u1 127.0.0.1:6003 0
+u1 127.0.0.1:6001 0
+u1 127.0.0.1:6002 0
+u1 127.0.0.1:6003 1
+u1 127.0.0.1:6001 0
+u1 127.0.0.1:6002 0
+u1 127.0.0.1:6003 1
+u1 127.0.0.1:6001 0
+u1 127.0.0.1:6002 0
+u1 127.0.0.1:6003 0
+
+=== TEST 4: release after the ejection
+--- http_config
+    lua_load_resty_core off;
+    upstream u1 {
+        zone shm-u1 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:6003;
+        check type=http fall=1 rise=1 timeout=1500 interval=1
+              outlier_errors=50 outlier_ejection=1s;
+        check_request_uri GET /heartbeat;
+        check_response_codes 200;
+    }
+    server {
+      listen 6001;
+      listen 6002;
+      location /heartbeat {
+        return 200;
+      }
+      location /x {
+        return 200;
+      }
+    }
+    server {
+      listen 6003;
+      location /heartbeat {
+        return 200;
+      }
+      location /x {
+        return 503;
+      }
+    }
+--- config
+    location /proxy/ {
+      proxy_pass http://u1/;
+    }
+    location /status {
+      healthcheck_status;
+    }
+    location /test {
+        content_by_lua_block {
+            -- latency and errors are observed in the log phase
+            -- of main requests, subrequests are not logged
+            local function traffic()
+              for i = 1, 75 do
+                local sock = ngx.socket.tcp()
+                assert(sock:connect("127.0.0.1", ngx.var.server_port))
+                assert(sock:send("GET /proxy/x HTTP/1.0\r\n"
+                                 .. "Host: localhost\r\n\r\n"))
+                assert(sock:receive("*a"))
+                sock:close()
+              end
+            end
+            local function status()
+              local resp = assert(ngx.location.capture("/status"))
+              if resp.status ~= ngx.HTTP_OK then
+                ngx.say(resp.status)
+              end
+              local cjson = require "cjson"
+              local data = cjson.decode(resp.body)
+              local t = {}
+              for u, h in pairs(data)
+              do
+                for p, s in pairs(h.primary)
+                do
+                  table.insert(t, string.format("%s %s %d", u, p, s.down))
+                end
+              end
+              table.sort(t)
+              for i,l in ipairs(t)
+              do
+                ngx.say(l)
+                ngx.log(ngx.INFO, l)
+              end
+            end
+            ngx.sleep(0.5)
+            traffic()
+            ngx.sleep(1.5)
+            status()
+            ngx.sleep(2.5)
+            status()
+        }
+    }
+--- timeout: 6
+--- request
+    GET /test
+--- response_body
+u1 127.0.0.1:6001 0
+u1 127.0.0.1:6002 0
+u1 127.0.0.1:6003 1
+u1 127.0.0.1:6001 0
+u1 127.0.0.1:6002 0
+u1 127.0.0.1:6003 0
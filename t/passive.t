@@ -0,0 +1,651 @@
+use Test::Nginx::Socket;
+use Test::Nginx::Socket::Lua::Stream;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+
+=== TEST 1: passive codes
+--- http_config
+    lua_load_resty_core off;
+    upstream u1 {
+        zone shm-u1 128k;
+        server 127.0.0.1:6001;
+        check type=http fall=2 rise=1 timeout=1500 interval=60 passive;
+        check_request_uri GET /heartbeat;
+        check_response_codes 200;
+    }
+    server {
+      listen 6001;
+      location /heartbeat {
+        return 200;
+      }
+      location /bad_gateway {
+        return 503;
+      }
+    }
+--- config
+    location /proxy/ {
+      proxy_pass http://u1/;
+    }
+    location /status {
+      healthcheck_status;
+    }
+    location /test {
+        content_by_lua_block {
+            -- the failures are accounted in the log phase of main requests,
+            -- subrequests are not logged
+            local function get(uri)
+              local sock = ngx.socket.tcp()
+              assert(sock:connect("127.0.0.1", ngx.var.server_port))
+              assert(sock:send("GET " .. uri .. " HTTP/1.0\r\n"
+                               .. "Host: localhost\r\n\r\n"))
+              assert(sock:receive("*a"))
+              sock:close()
+            end
+            local function status()
+              local resp = assert(ngx.location.capture("/status"))
+              if resp.status ~= ngx.HTTP_OK then
+                ngx.say(resp.status)
+              end
+              local cjson = require "cjson"
+              local data = cjson.decode(resp.body)
+              local t = {}
+              for u, h in pairs(data)
+              do
+                for p, s in pairs(h.primary)
+                do
+                  table.insert(t, string.format("%s %s %d", u, p, s.down))
+                end
+              end
+              table.sort(t)
+              for i,l in ipairs(t)
+              do
+                ngx.say(l)
+                ngx.log(ngx.INFO, l)
+              end
+            end
+            ngx.sleep(0.5)
+            status()
+            get("/proxy/bad_gateway")
+            status()
+            get("/proxy/bad_gateway")
+            status()
+        }
+    }
+--- request
+    GET /test
+--- response_body
+u1 127.0.0.1:6001 0
+u1 127.0.0.1:6001 0
+u1 127.0.0.1:6001 1
+
+
+=== TEST 2: custom passive codes
+--- http_config
+    lua_load_resty_core off;
+    upstream u1 {
+        zone shm-u1 128k;
+        server 127.0.0.1:6001;
+        check type=http fall=2 rise=1 timeout=1500 interval=60 passive
+              passive_codes=500;
+        check_request_uri GET /heartbeat;
+        check_response_codes 200;
+    }
+    server {
+      listen 6001;
+      location /heartbeat {
+        return 200;
+      }
+      location /bad_gateway {
+        return 503;
+      }
+      location /error {
+        return 500;
+      }
+    }
+--- config
+    location /proxy/ {
+      proxy_pass http://u1/;
+    }
+    location /status {
+      healthcheck_status;
+    }
+    location /test {
+        content_by_lua_block {
+            -- the failures are accounted in the log phase of main requests,
+            -- subrequests are not logged
+            local function get(uri)
+              local sock = ngx.socket.tcp()
+              assert(sock:connect("127.0.0.1", ngx.var.server_port))
+              assert(sock:send("GET " .. uri .. " HTTP/1.0\r\n"
+                               .. "Host: localhost\r\n\r\n"))
+              assert(sock:receive("*a"))
+              sock:close()
+            end
+            local function status()
+              local resp = assert(ngx.location.capture("/status"))
+              if resp.status ~= ngx.HTTP_OK then
+                ngx.say(resp.status)
+              end
+              local cjson = require "cjson"
+              local data = cjson.decode(resp.body)
+              local t = {}
+              for u, h in pairs(data)
+              do
+                for p, s in pairs(h.primary)
+                do
+                  table.insert(t, string.format("%s %s %d", u, p, s.down))
+                end
+              end
+              table.sort(t)
+              for i,l in ipairs(t)
+              do
+                ngx.say(l)
+                ngx.log(ngx.INFO, l)
+              end
+            end
+            ngx.sleep(0.5)
+            get("/proxy/bad_gateway")
+            get("/proxy/bad_gateway")
+            status()
+            get("/proxy/error")
+            get("/proxy/error")
+            status()
+        }
+    }
+--- request
+    GET /test
+--- response_body
+u1 127.0.0.1:6001 0
+u1 127.0.0.1:6001 1
+
+
+=== TEST 3: passive latency
+--- http_config
+    lua_load_resty_core off;
+    upstream u1 {
+        zone shm-u1 128k;
+        server 127.0.0.1:6001;
+        check type=http fall=2 rise=1 timeout=1500 interval=60 passive
+              passive_latency=100ms;
+        check_request_uri GET /heartbeat;
+        check_response_codes 200;
+    }
+    server {
+      listen 6001;
+      location /heartbeat {
+        return 200;
+      }
+      location /ok {
+        return 200;
+      }
+      location /slow {
+        content_by_lua_block {
+          ngx.sleep(0.3)
+          ngx.say("ok")
+        }
+      }
+    }
+--- config
+    location /proxy/ {
+      proxy_pass http://u1/;
+    }
+    location /status {
+      healthcheck_status;
+    }
+    location /test {
+        content_by_lua_block {
+            -- the failures are accounted in the log phase of main requests,
+            -- subrequests are not logged
+            local function get(uri)
+              local sock = ngx.socket.tcp()
+              assert(sock:connect("127.0.0.1", ngx.var.server_port))
+              assert(sock:send("GET " .. uri .. " HTTP/1.0\r\n"
+                               .. "Host: localhost\r\n\r\n"))
+              assert(sock:receive("*a"))
+              sock:close()
+            end
+            local function status()
+              local resp = assert(ngx.location.capture("/status"))
+              if resp.status ~= ngx.HTTP_OK then
+                ngx.say(resp.status)
+              end
+              local cjson = require "cjson"
+              local data = cjson.decode(resp.body)
+              local t = {}
+              for u, h in pairs(data)
+              do
+                for p, s in pairs(h.primary)
+                do
+                  table.insert(t, string.format("%s %s %d", u, p, s.down))
+                end
+              end
+              table.sort(t)
+              for i,l in ipairs(t)
+              do
+                ngx.say(l)
+                ngx.log(ngx.INFO, l)
+              end
+            end
+            ngx.sleep(0.5)
+            get("/proxy/ok")
+            get("/proxy/ok")
+            status()
+            get("/proxy/slow")
+            get("/proxy/slow")
+            status()
+        }
+    }
+--- request
+    GET /test
+--- response_body
+u1 127.0.0.1:6001 0
+u1 127.0.0.1:6001 1
+
+
+=== TEST 4: passive window
+--- http_config
+    lua_load_resty_core off;
+    upstream u1 {
+        zone shm-u1 128k;
+        server 127.0.0.1:6001;
+        check type=http fall=2 rise=1 timeout=1500 interval=60 passive
+              passive_window=1s;
+        check_request_uri GET /heartbeat;
+        check_response_codes 200;
+    }
+    server {
+      listen 6001;
+      location /heartbeat {
+        return 200;
+      }
+      location /bad_gateway {
+        return 503;
+      }
+    }
+--- config
+    location /proxy/ {
+      proxy_pass http://u1/;
+    }
+    location /status {
+      healthcheck_status;
+    }
+    location /test {
+        content_by_lua_block {
+            -- the failures are accounted in the log phase of main requests,
+            -- subrequests are not logged
+            local function get(uri)
+              local sock = ngx.socket.tcp()
+              assert(sock:connect("127.0.0.1", ngx.var.server_port))
+              assert(sock:send("GET " .. uri .. " HTTP/1.0\r\n"
+                               .. "Host: localhost\r\n\r\n"))
+              assert(sock:receive("*a"))
+              sock:close()
+            end
+            local function status()
+              local resp = assert(ngx.location.capture("/status"))
+              if resp.status ~= ngx.HTTP_OK then
+                ngx.say(resp.status)
+              end
+              local cjson = require "cjson"
+              local data = cjson.decode(resp.body)
+              local t = {}
+              for u, h in pairs(data)
+              do
+                for p, s in pairs(h.primary)
+                do
+                  table.insert(t, string.format("%s %s %d", u, p, s.down))
+                end
+              end
+              table.sort(t)
+              for i,l in ipairs(t)
+              do
+                ngx.say(l)
+                ngx.log(ngx.INFO, l)
+              end
+            end
+            ngx.sleep(0.5)
+            get("/proxy/bad_gateway")
+            ngx.sleep(1.5)
+            get("/proxy/bad_gateway")
+            status()
+            get("/proxy/bad_gateway")
+            status()
+        }
+    }
+--- timeout: 4
+--- request
+    GET /test
+--- response_body
+u1 127.0.0.1:6001 0
+u1 127.0.0.1:6001 1
+
+
+=== TEST 5: down by passive check, up by active check
+--- http_config
+    lua_load_resty_core off;
+    upstream u1 {
+        zone shm-u1 128k;
+        server 127.0.0.1:6001;
+        check type=http fall=2 rise=1 timeout=1500 interval=1 passive;
+        check_request_uri GET /heartbeat;
+        check_response_codes 200;
+    }
+    server {
+      listen 6001;
+      location /heartbeat {
+        return 200;
+      }
+      location /bad_gateway {
+        return 503;
+      }
+    }
+--- config
+    location /proxy/ {
+      proxy_pass http://u1/;
+    }
+    location /status {
+      healthcheck_status;
+    }
+    location /test {
+        content_by_lua_block {
+            -- the failures are accounted in the log phase of main requests,
+            -- subrequests are not logged
+            local function get(uri)
+              local sock = ngx.socket.tcp()
+              assert(sock:connect("127.0.0.1", ngx.var.server_port))
+              assert(sock:send("GET " .. uri .. " HTTP/1.0\r\n"
+                               .. "Host: localhost\r\n\r\n"))
+              assert(sock:receive("*a"))
+              sock:close()
+            end
+            local function status()
+              local resp = assert(ngx.location.capture("/status"))
+              if resp.status ~= ngx.HTTP_OK then
+                ngx.say(resp.status)
+              end
+              local cjson = require "cjson"
+              local data = cjson.decode(resp.body)
+              local t = {}
+              for u, h in pairs(data)
+              do
+                for p, s in pairs(h.primary)
+                do
+                  table.insert(t, string.format("%s %s %d", u, p, s.down))
+                end
+              end
+              table.sort(t)
+              for i,l in ipairs(t)
+              do
+                ngx.say(l)
+                ngx.log(ngx.INFO, l)
+              end
+            end
+            ngx.sleep(0.5)
+            get("/proxy/bad_gateway")
+            get("/proxy/bad_gateway")
+            status()
+            ngx.sleep(2.5)
+            status()
+        }
+    }
+--- timeout: 5
+--- request
+    GET /test
+--- response_body
+u1 127.0.0.1:6001 1
+u1 127.0.0.1:6001 0
+
+
+=== TEST 6: no passive accounting without passive
+--- http_config
+    lua_load_resty_core off;
+    upstream u1 {
+        zone shm-u1 128k;
+        server 127.0.0.1:6001;
+        check type=http fall=2 rise=1 timeout=1500 interval=60;
+        check_request_uri GET /heartbeat;
+        check_response_codes 200;
+    }
+    server {
+      listen 6001;
+      location /heartbeat {
+        return 200;
+      }
+      location /bad_gateway {
+        return 503;
+      }
+    }
+--- config
+    location /proxy/ {
+      proxy_pass http://u1/;
+    }
+    location /status {
+      healthcheck_status;
+    }
+    location /test {
+        content_by_lua_block {
+            -- the failures are accounted in the log phase of main requests,
+            -- subrequests are not logged
+            local function get(uri)
+              local sock = ngx.socket.tcp()
+              assert(sock:connect("127.0.0.1", ngx.var.server_port))
+              assert(sock:send("GET " .. uri .. " HTTP/1.0\r\n"
+                               .. "Host: localhost\r\n\r\n"))
+              assert(sock:receive("*a"))
+              sock:close()
+            end
+            local function status()
+              local resp = assert(ngx.location.capture("/status"))
+              if resp.status ~= ngx.HTTP_OK then
+                ngx.say(resp.status)
+              end
+              local cjson = require "cjson"
+              local data = cjson.decode(resp.body)
+              local t = {}
+              for u, h in pairs(data)
+              do
+                for p, s in pairs(h.primary)
+                do
+                  table.insert(t, string.format("%s %s %d", u, p, s.down))
+                end
+              end
+              table.sort(t)
+              for i,l in ipairs(t)
+              do
+                ngx.say(l)
+                ngx.log(ngx.INFO, l)
+              end
+            end
+            ngx.sleep(0.5)
+            get("/proxy/bad_gateway")
+            get("/proxy/bad_gateway")
+            get("/proxy/bad_gateway")
+            status()
+        }
+    }
+--- request
+    GET /test
+--- response_body
+u1 127.0.0.1:6001 0
+
+
+=== TEST 7: passive failures of a removed and added peer
+--- http_config
+    lua_load_resty_core off;
+    upstream u1 {
+        zone shm-u1 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        check type=http fall=2 rise=1 timeout=1500 interval=1 passive;
+        check_request_uri GET /heartbeat;
+        check_response_codes 200;
+    }
+    server {
+      listen 6001;
+      location / {
+        return 200;
+      }
+    }
+    server {
+      listen 6002;
+      location /heartbeat {
+        return 200;
+      }
+      location /ok {
+        return 200;
+      }
+      location /bad_gateway {
+        return 503;
+      }
+    }
+--- config
+    location /proxy/ {
+      proxy_pass http://u1/;
+    }
+    location /dynamic {
+      dynamic_upstream;
+    }
+    location /status {
+      healthcheck_status;
+    }
+    location /test {
+        content_by_lua_block {
+            local port = ngx.var.server_port
+            local function get(uri)
+              local sock = ngx.socket.tcp()
+              assert(sock:connect("127.0.0.1", port))
+              assert(sock:send("GET " .. uri .. " HTTP/1.0\r\n"
+                               .. "Host: localhost\r\n\r\n"))
+              assert(sock:receive("*a"))
+              sock:close()
+            end
+            local function status()
+              local resp = assert(ngx.location.capture("/status"))
+              if resp.status ~= ngx.HTTP_OK then
+                ngx.say(resp.status)
+              end
+              local cjson = require "cjson"
+              local data = cjson.decode(resp.body)
+              local t = {}
+              for u, h in pairs(data)
+              do
+                for p, s in pairs(h.primary)
+                do
+                  table.insert(t, string.format("%s %s %d", u, p, s.down))
+                end
+              end
+              table.sort(t)
+              for i,l in ipairs(t)
+              do
+                ngx.say(l)
+                ngx.log(ngx.INFO, l)
+              end
+            end
+            -- the traffic goes on while the peer is removed and added
+            local stop = false
+            local function traffic(premature)
+              while not premature and not stop do
+                get("/proxy/ok")
+                ngx.sleep(0.01)
+              end
+            end
+            assert(ngx.timer.at(0, traffic))
+            ngx.sleep(0.5)
+            local server = "upstream=u1&server=127.0.0.1:6002"
+            assert(ngx.location.capture("/dynamic?" .. server .. "&remove="))
+            ngx.sleep(1.5)
+            assert(ngx.location.capture("/dynamic?" .. server .. "&add="))
+            ngx.sleep(1.5)
+            stop = true
+            for i = 1, 4 do
+              get("/proxy/bad_gateway")
+            end
+            status()
+        }
+    }
+--- timeout: 6
+--- request
+    GET /test
+--- response_body
+u1 127.0.0.1:6001 0
+u1 127.0.0.1:6002 1
+
+
+=== TEST 8: stream connect failures, up by active check
+--- http_config
+    lua_load_resty_core off;
+--- stream_config
+    upstream u1 {
+        zone shm-u1 128k;
+        # nothing listens on 6001, the active check goes to 6003
+        server 127.0.0.1:6001;
+        check type=tcp fall=2 rise=1 timeout=1500 interval=1 port=6003
+              passive;
+    }
+    server {
+      listen 6003;
+      return ok;
+    }
+    server {
+      listen 6100;
+      proxy_pass u1;
+    }
+--- config
+    location /status {
+      healthcheck_status;
+    }
+    location /test {
+        content_by_lua_block {
+            local function session()
+              local sock = ngx.socket.tcp()
+              assert(sock:connect("127.0.0.1", 6100))
+              sock:receive("*a")
+              sock:close()
+            end
+            local function status()
+              local resp = assert(ngx.location.capture("/status?stream="))
+              if resp.status ~= ngx.HTTP_OK then
+                ngx.say(resp.status)
+              end
+              local cjson = require "cjson"
+              local data = cjson.decode(resp.body)
+              local t = {}
+              for u, h in pairs(data)
+              do
+                for p, s in pairs(h.primary)
+                do
+                  table.insert(t, string.format("%s %s %d", u, p, s.down))
+                end
+              end
+              table.sort(t)
+              for i,l in ipairs(t)
+              do
+                ngx.say(l)
+                ngx.log(ngx.INFO, l)
+              end
+            end
+            ngx.sleep(0.5)
+            status()
+            session()
+            session()
+            -- the session is logged after the client has got the close
+            ngx.sleep(0.1)
+            status()
+            ngx.sleep(1.5)
+            status()
+        }
+    }
+--- timeout: 4
+--- request
+    GET /test
+--- response_body
+u1 127.0.0.1:6001 0
+u1 127.0.0.1:6001 1
+u1 127.0.0.1:6001 0
@@ -0,0 +1,726 @@
+use Test::Nginx::Socket;
+use Test::Nginx::Socket::Lua::Stream;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+
+=== TEST 1: redis PING
+--- http_config
+    lua_load_resty_core off;
+--- stream_config
+    upstream u1 {
+        zone shm-u1 128k;
+        server 127.0.0.1:6001 down;
+        check type=redis fall=1 rise=1 timeout=1500 interval=1;
+    }
+    server {
+      listen 6001;
+      content_by_lua_block {
+        local sock = assert(ngx.req.socket(true))
+        local function command()
+          local line = sock:receive("*l")
+          if not line then
+            return nil
+          end
+          local args = {}
+          for i = 1, tonumber(line:sub(2)) do
+            local len = tonumber(sock:receive("*l"):sub(2))
+            args[i] = sock:receive(len)
+            sock:receive(2)
+          end
+          return args
+        end
+        local cmd = command()
+        if cmd and cmd[1] == "PING" then
+          sock:send("+PONG\r\n")
+        else
+          sock:send("-ERR unexpected command\r\n")
+        end
+      }
+    }
+--- stream_server_config
+    proxy_pass u1;
+--- config
+    location /status {
+      healthcheck_status;
+    }
+    location /test {
+        content_by_lua_block {
+            ngx.sleep(1)
+            local resp = assert(ngx.location.capture("/status?stream="))
+            if resp.status ~= ngx.HTTP_OK then
+              ngx.say(resp.status)
+            end
+            local cjson = require "cjson"
+            local data = cjson.decode(resp.body)
+            local t = {}
+            for u, h in pairs(data)
+            do
+              for p, s in pairs(h.primary)
+              do
+                table.insert(t, string.format("%s %s %d", u, p, s.down))
+              end
+            end
+            table.sort(t)
+            for i,l in ipairs(t)
+            do
+              ngx.say(l)
+              ngx.log(ngx.INFO, l)
+            end
+        }
+    }
+--- request
+    GET /test
+--- response_body
+u1 127.0.0.1:6001 0
+
+
+=== TEST 2: redis split reply
+--- http_config
+    lua_load_resty_core off;
+--- stream_config
+    upstream u1 {
+        zone shm-u1 128k;
+        server 127.0.0.1:6001 down;
+        check type=redis fall=1 rise=1 timeout=1500 interval=1 redis_role=master;
+    }
+    server {
+      listen 6001;
+      content_by_lua_block {
+        local sock = assert(ngx.req.socket(true))
+        local function command()
+          local line = sock:receive("*l")
+          if not line then
+            return nil
+          end
+          local args = {}
+          for i = 1, tonumber(line:sub(2)) do
+            local len = tonumber(sock:receive("*l"):sub(2))
+            args[i] = sock:receive(len)
+            sock:receive(2)
+          end
+          return args
+        end
+        local cmd = command()
+        if cmd and cmd[1] == "ROLE" then
+          -- the reply is parsed again when more data arrives
+          sock:send("*3\r\n$6\r\nmas")
+          ngx.sleep(0.1)
+          sock:send("ter\r\n:3129659\r")
+          ngx.sleep(0.1)
+          sock:send("\n*0\r\n")
+        else
+          sock:send("-ERR unexpected command\r\n")
+        end
+      }
+    }
+--- stream_server_config
+    proxy_pass u1;
+--- config
+    location /status {
+      healthcheck_status;
+    }
+    location /test {
+        content_by_lua_block {
+            ngx.sleep(1)
+            local resp = assert(ngx.location.capture("/status?stream="))
+            if resp.status ~= ngx.HTTP_OK then
+              ngx.say(resp.status)
+            end
+            local cjson = require "cjson"
+            local data = cjson.decode(resp.body)
+            local t = {}
+            for u, h in pairs(data)
+            do
+              for p, s in pairs(h.primary)
+              do
+                table.insert(t, string.format("%s %s %d", u, p, s.down))
+              end
+            end
+            table.sort(t)
+            for i,l in ipairs(t)
+            do
+              ngx.say(l)
+              ngx.log(ngx.INFO, l)
+            end
+        }
+    }
+--- request
+    GET /test
+--- response_body
+u1 127.0.0.1:6001 0
+
+
+=== TEST 3: redis error reply
+--- http_config
+    lua_load_resty_core off;
+--- stream_config
+    upstream u1 {
+        zone shm-u1 128k;
+        server 127.0.0.1:6001;
+        check type=redis fall=1 rise=1 timeout=1500 interval=1;
+    }
+    server {
+      listen 6001;
+      content_by_lua_block {
+        local sock = assert(ngx.req.socket(true))
+        local function command()
+          local line = sock:receive("*l")
+          if not line then
+            return nil
+          end
+          local args = {}
+          for i = 1, tonumber(line:sub(2)) do
+            local len = tonumber(sock:receive("*l"):sub(2))
+            args[i] = sock:receive(len)
+            sock:receive(2)
+          end
+          return args
+        end
+        local cmd = command()
+        if cmd and cmd[1] == "PING" then
+          sock:send("-ERR unknown command 'PING'\r\n")
+        else
+          sock:send("-ERR unexpected command\r\n")
+        end
+      }
+    }
+--- stream_server_config
+    proxy_pass u1;
+--- config
+    location /status {
+      healthcheck_status;
+    }
+    location /test {
+        content_by_lua_block {
+            ngx.sleep(1)
+            local resp = assert(ngx.location.capture("/status?stream="))
+            if resp.status ~= ngx.HTTP_OK then
+              ngx.say(resp.status)
+            end
+            local cjson = require "cjson"
+            local data = cjson.decode(resp.body)
+            local t = {}
+            for u, h in pairs(data)
+            do
+              for p, s in pairs(h.primary)
+              do
+                table.insert(t, string.format("%s %s %d", u, p, s.down))
+              end
+            end
+            table.sort(t)
+            for i,l in ipairs(t)
+            do
+              ngx.say(l)
+              ngx.log(ngx.INFO, l)
+            end
+        }
+    }
+--- request
+    GET /test
+--- response_body
+u1 127.0.0.1:6001 1
+
+
+=== TEST 4: redis LOADING
+--- http_config
+    lua_load_resty_core off;
+--- stream_config
+    upstream u1 {
+        zone shm-u1 128k;
+        server 127.0.0.1:6001;
+        check type=redis fall=1 rise=1 timeout=1500 interval=1;
+    }
+    server {
+      listen 6001;
+      content_by_lua_block {
+        local sock = assert(ngx.req.socket(true))
+        local function command()
+          local line = sock:receive("*l")
+          if not line then
+            return nil
+          end
+          local args = {}
+          for i = 1, tonumber(line:sub(2)) do
+            local len = tonumber(sock:receive("*l"):sub(2))
+            args[i] = sock:receive(len)
+            sock:receive(2)
+          end
+          return args
+        end
+        local cmd = command()
+        if cmd and cmd[1] == "PING" then
+          sock:send("-LOADING Redis is loading the dataset in memory\r\n")
+        else
+          sock:send("-ERR unexpected command\r\n")
+        end
+      }
+    }
+--- stream_server_config
+    proxy_pass u1;
+--- config
+    location /status {
+      healthcheck_status;
+    }
+    location /test {
+        content_by_lua_block {
+            ngx.sleep(1)
+            local resp = assert(ngx.location.capture("/status?stream="))
+            if resp.status ~= ngx.HTTP_OK then
+              ngx.say(resp.status)
+            end
+            local cjson = require "cjson"
+            local data = cjson.decode(resp.body)
+            local t = {}
+            for u, h in pairs(data)
+            do
+              for p, s in pairs(h.primary)
+              do
+                table.insert(t, string.format("%s %s %d", u, p, s.down))
+              end
+            end
+            table.sort(t)
+            for i,l in ipairs(t)
+            do
+              ngx.say(l)
+              ngx.log(ngx.INFO, l)
+            end
+        }
+    }
+--- request
+    GET /test
+--- response_body
+u1 127.0.0.1:6001 1
+
+
+=== TEST 5: redis AUTH pipelined with PING
+--- http_config
+    lua_load_resty_core off;
+--- stream_config
+    upstream u1 {
+        zone shm-u1 128k;
+        server 127.0.0.1:6001 down;
+        check type=redis fall=1 rise=1 timeout=1500 interval=1 redis_user=hc redis_password=secret;
+    }
+    server {
+      listen 6001;
+      content_by_lua_block {
+        local sock = assert(ngx.req.socket(true))
+        local function command()
+          local line = sock:receive("*l")
+          if not line then
+            return nil
+          end
+          local args = {}
+          for i = 1, tonumber(line:sub(2)) do
+            local len = tonumber(sock:receive("*l"):sub(2))
+            args[i] = sock:receive(len)
+            sock:receive(2)
+          end
+          return args
+        end
+        local auth = command()
+        -- PING is sent before the reply to AUTH
+        local ping = command()
+        if auth and auth[1] == "AUTH" and auth[2] == "hc"
+           and auth[3] == "secret" and ping and ping[1] == "PING" then
+          sock:send("+OK\r\n+PONG\r\n")
+        else
+          sock:send("-WRONGPASS invalid username-password pair\r\n")
+        end
+      }
+    }
+--- stream_server_config
+    proxy_pass u1;
+--- config
+    location /status {
+      healthcheck_status;
+    }
+    location /test {
+        content_by_lua_block {
+            ngx.sleep(1)
+            local resp = assert(ngx.location.capture("/status?stream="))
+            if resp.status ~= ngx.HTTP_OK then
+              ngx.say(resp.status)
+            end
+            local cjson = require "cjson"
+            local data = cjson.decode(resp.body)
+            local t = {}
+            for u, h in pairs(data)
+            do
+              for p, s in pairs(h.primary)
+              do
+                table.insert(t, string.format("%s %s %d", u, p, s.down))
+              end
+            end
+            table.sort(t)
+            for i,l in ipairs(t)
+            do
+              ngx.say(l)
+              ngx.log(ngx.INFO, l)
+            end
+        }
+    }
+--- request
+    GET /test
+--- response_body
+u1 127.0.0.1:6001 0
+
+
+=== TEST 6: redis AUTH rejected
+--- http_config
+    lua_load_resty_core off;
+--- stream_config
+    upstream u1 {
+        zone shm-u1 128k;
+        server 127.0.0.1:6001;
+        check type=redis fall=1 rise=1 timeout=1500 interval=1 redis_password=secret;
+    }
+    server {
+      listen 6001;
+      content_by_lua_block {
+        local sock = assert(ngx.req.socket(true))
+        local function command()
+          local line = sock:receive("*l")
+          if not line then
+            return nil
+          end
+          local args = {}
+          for i = 1, tonumber(line:sub(2)) do
+            local len = tonumber(sock:receive("*l"):sub(2))
+            args[i] = sock:receive(len)
+            sock:receive(2)
+          end
+          return args
+        end
+        local auth = command()
+        local ping = command()
+        sock:send("-WRONGPASS invalid username-password pair\r\n"
+                  .. "-NOAUTH Authentication required.\r\n")
+      }
+    }
+--- stream_server_config
+    proxy_pass u1;
+--- config
+    location /status {
+      healthcheck_status;
+    }
+    location /test {
+        content_by_lua_block {
+            ngx.sleep(1)
+            local resp = assert(ngx.location.capture("/status?stream="))
+            if resp.status ~= ngx.HTTP_OK then
+              ngx.say(resp.status)
+            end
+            local cjson = require "cjson"
+            local data = cjson.decode(resp.body)
+            local t = {}
+            for u, h in pairs(data)
+            do
+              for p, s in pairs(h.primary)
+              do
+                table.insert(t, string.format("%s %s %d", u, p, s.down))
+              end
+            end
+            table.sort(t)
+            for i,l in ipairs(t)
+            do
+              ngx.say(l)
+              ngx.log(ngx.INFO, l)
+            end
+        }
+    }
+--- request
+    GET /test
+--- response_body
+u1 127.0.0.1:6001 1
+
+
+=== TEST 7: redis ROLE master
+--- http_config
+    lua_load_resty_core off;
+--- stream_config
+    upstream u1 {
+        zone shm-u1 128k;
+        server 127.0.0.1:6001 down;
+        check type=redis fall=1 rise=1 timeout=1500 interval=1 redis_role=master;
+    }
+    server {
+      listen 6001;
+      content_by_lua_block {
+        local sock = assert(ngx.req.socket(true))
+        local function command()
+          local line = sock:receive("*l")
+          if not line then
+            return nil
+          end
+          local args = {}
+          for i = 1, tonumber(line:sub(2)) do
+            local len = tonumber(sock:receive("*l"):sub(2))
+            args[i] = sock:receive(len)
+            sock:receive(2)
+          end
+          return args
+        end
+        local cmd = command()
+        if cmd and cmd[1] == "ROLE" then
+          sock:send("*3\r\n$6\r\nmaster\r\n:3129659\r\n*0\r\n")
+        else
+          sock:send("-ERR unexpected command\r\n")
+        end
+      }
+    }
+--- stream_server_config
+    proxy_pass u1;
+--- config
+    location /status {
+      healthcheck_status;
+    }
+    location /test {
+        content_by_lua_block {
+            ngx.sleep(1)
+            local resp = assert(ngx.location.capture("/status?stream="))
+            if resp.status ~= ngx.HTTP_OK then
+              ngx.say(resp.status)
+            end
+            local cjson = require "cjson"
+            local data = cjson.decode(resp.body)
+            local t = {}
+            for u, h in pairs(data)
+            do
+              for p, s in pairs(h.primary)
+              do
+                table.insert(t, string.format("%s %s %d", u, p, s.down))
+              end
+            end
+            table.sort(t)
+            for i,l in ipairs(t)
+            do
+              ngx.say(l)
+              ngx.log(ngx.INFO, l)
+            end
+        }
+    }
+--- request
+    GET /test
+--- response_body
+u1 127.0.0.1:6001 0
+
+
+=== TEST 8: redis ROLE master, the peer is a replica
+--- http_config
+    lua_load_resty_core off;
+--- stream_config
+    upstream u1 {
+        zone shm-u1 128k;
+        server 127.0.0.1:6001;
+        check type=redis fall=1 rise=1 timeout=1500 interval=1 redis_role=master;
+    }
+    server {
+      listen 6001;
+      content_by_lua_block {
+        local sock = assert(ngx.req.socket(true))
+        local function command()
+          local line = sock:receive("*l")
+          if not line then
+            return nil
+          end
+          local args = {}
+          for i = 1, tonumber(line:sub(2)) do
+            local len = tonumber(sock:receive("*l"):sub(2))
+            args[i] = sock:receive(len)
+            sock:receive(2)
+          end
+          return args
+        end
+        local cmd = command()
+        if cmd and cmd[1] == "ROLE" then
+          sock:send("*5\r\n$5\r\nslave\r\n$9\r\n127.0.0.1\r\n:6380\r\n$9\r\nconnected\r\n:3167038\r\n")
+        else
+          sock:send("-ERR unexpected command\r\n")
+        end
+      }
+    }
+--- stream_server_config
+    proxy_pass u1;
+--- config
+    location /status {
+      healthcheck_status;
+    }
+    location /test {
+        content_by_lua_block {
+            ngx.sleep(1)
+            local resp = assert(ngx.location.capture("/status?stream="))
+            if resp.status ~= ngx.HTTP_OK then
+              ngx.say(resp.status)
+            end
+            local cjson = require "cjson"
+            local data = cjson.decode(resp.body)
+            local t = {}
+            for u, h in pairs(data)
+            do
+              for p, s in pairs(h.primary)
+              do
+                table.insert(t, string.format("%s %s %d", u, p, s.down))
+              end
+            end
+            table.sort(t)
+            for i,l in ipairs(t)
+            do
+              ngx.say(l)
+              ngx.log(ngx.INFO, l)
+            end
+        }
+    }
+--- request
+    GET /test
+--- response_body
+u1 127.0.0.1:6001 1
+
+
+=== TEST 9: redis ROLE replica
+--- http_config
+    lua_load_resty_core off;
+--- stream_config
+    upstream u1 {
+        zone shm-u1 128k;
+        server 127.0.0.1:6001 down;
+        check type=redis fall=1 rise=1 timeout=1500 interval=1 redis_role=replica;
+    }
+    server {
+      listen 6001;
+      content_by_lua_block {
+        local sock = assert(ngx.req.socket(true))
+        local function command()
+          local line = sock:receive("*l")
+          if not line then
+            return nil
+          end
+          local args = {}
+          for i = 1, tonumber(line:sub(2)) do
+            local len = tonumber(sock:receive("*l"):sub(2))
+            args[i] = sock:receive(len)
+            sock:receive(2)
+          end
+          return args
+        end
+        local cmd = command()
+        if cmd and cmd[1] == "ROLE" then
+          sock:send("*5\r\n$5\r\nslave\r\n$9\r\n127.0.0.1\r\n:6380\r\n$9\r\nconnected\r\n:3167038\r\n")
+        else
+          sock:send("-ERR unexpected command\r\n")
+        end
+      }
+    }
+--- stream_server_config
+    proxy_pass u1;
+--- config
+    location /status {
+      healthcheck_status;
+    }
+    location /test {
+        content_by_lua_block {
+            ngx.sleep(1)
+            local resp = assert(ngx.location.capture("/status?stream="))
+            if resp.status ~= ngx.HTTP_OK then
+              ngx.say(resp.status)
+            end
+            local cjson = require "cjson"
+            local data = cjson.decode(resp.body)
+            local t = {}
+            for u, h in pairs(data)
+            do
+              for p, s in pairs(h.primary)
+              do
+                table.insert(t, string.format("%s %s %d", u, p, s.down))
+              end
+            end
+            table.sort(t)
+            for i,l in ipairs(t)
+            do
+              ngx.say(l)
+              ngx.log(ngx.INFO, l)
+            end
+        }
+    }
+--- request
+    GET /test
+--- response_body
+u1 127.0.0.1:6001 0
+
+
+=== TEST 10: redis ROLE replica, the link to the master is down
+--- http_config
+    lua_load_resty_core off;
+--- stream_config
+    upstream u1 {
+        zone shm-u1 128k;
+        server 127.0.0.1:6001;
+        check type=redis fall=1 rise=1 timeout=1500 interval=1 redis_role=replica;
+    }
+    server {
+      listen 6001;
+      content_by_lua_block {
+        local sock = assert(ngx.req.socket(true))
+        local function command()
+          local line = sock:receive("*l")
+          if not line then
+            return nil
+          end
+          local args = {}
+          for i = 1, tonumber(line:sub(2)) do
+            local len = tonumber(sock:receive("*l"):sub(2))
+            args[i] = sock:receive(len)
+            sock:receive(2)
+          end
+          return args
+        end
+        local cmd = command()
+        if cmd and cmd[1] == "ROLE" then
+          sock:send("*5\r\n$5\r\nslave\r\n$9\r\n127.0.0.1\r\n:6380\r\n$7\r\nconnect\r\n:3167038\r\n")
+        else
+          sock:send("-ERR unexpected command\r\n")
+        end
+      }
+    }
+--- stream_server_config
+    proxy_pass u1;
+--- config
+    location /status {
+      healthcheck_status;
+    }
+    location /test {
+        content_by_lua_block {
+            ngx.sleep(1)
+            local resp = assert(ngx.location.capture("/status?stream="))
+            if resp.status ~= ngx.HTTP_OK then
+              ngx.say(resp.status)
+            end
+            local cjson = require "cjson"
+            local data = cjson.decode(resp.body)
+            local t = {}
+            for u, h in pairs(data)
+            do
+              for p, s in pairs(h.primary)
+              do
+                table.insert(t, string.format("%s %s %d", u, p, s.down))
+              end
+            end
+            table.sort(t)
+            for i,l in ipairs(t)
+            do
+              ngx.say(l)
+              ngx.log(ngx.INFO, l)
+            end
+        }
+    }
+--- request
+    GET /test
+--- response_body
+u1 127.0.0.1:6001 1
@@ -0,0 +1,76 @@
+use Test::Nginx::Socket;
+use Test::Nginx::Socket::Lua::Stream;
+
+master_on();
+workers(2);
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+
+=== TEST 1: shard peers once per interval
+--- http_config
+    lua_load_resty_core off;
+    lua_shared_dict backend 1m;
+    upstream u1 {
+        zone shm-u1 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:6003;
+        server 127.0.0.1:6004;
+        check type=http fall=1 rise=1 timeout=1500 interval=1 shard;
+        check_request_uri GET /heartbeat;
+        check_response_codes 200;
+    }
+    server {
+      listen 6001;
+      listen 6002;
+      listen 6003;
+      listen 6004;
+      location /heartbeat {
+        content_by_lua_block {
+          local backend = ngx.shared.backend
+          local port = ngx.var.server_port
+          local n = backend:incr("checks:" .. port, 1, 0)
+          backend:set("check:" .. port .. ":" .. n, ngx.now())
+          ngx.say("pong")
+        }
+      }
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local backend = ngx.shared.backend
+            -- the view of both workers is published within a second
+            local from = ngx.now() + 1.5
+            ngx.sleep(4.5)
+            local checked, once = 0, true
+            for port = 6001, 6004 do
+              local prev
+              for i = 1, backend:get("checks:" .. port) or 0 do
+                local t = backend:get("check:" .. port .. ":" .. i)
+                if t >= from then
+                  if prev and t - prev < 0.5 then
+                    once = false
+                  end
+                  prev = t
+                end
+              end
+              if prev then
+                checked = checked + 1
+              end
+            end
+            ngx.say("checked ", checked)
+            ngx.say("once ", once)
+        }
+    }
+--- timeout: 6
+--- request
+    GET /test
+--- response_body
+checked 4
+once true
@@ -0,0 +1,115 @@
+use Test::Nginx::Socket;
+use Test::Nginx::Socket::Lua::Stream;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+
+=== TEST 1: splay
+--- http_config
+    lua_load_resty_core off;
+    lua_shared_dict backend 1m;
+    upstream u1 {
+        zone shm-u1 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:6003;
+        server 127.0.0.1:6004;
+        check type=http fall=1 rise=1 timeout=1500 interval=2 splay=100;
+        check_request_uri GET /heartbeat;
+        check_response_codes 200;
+    }
+    server {
+      listen 6001;
+      listen 6002;
+      listen 6003;
+      listen 6004;
+      location /heartbeat {
+        content_by_lua_block {
+          local backend = ngx.shared.backend
+          -- the first check of each peer
+          backend:add("first:" .. ngx.var.server_port, ngx.now())
+          ngx.say("pong")
+        }
+      }
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local backend = ngx.shared.backend
+            ngx.sleep(2.5)
+            local min, max, n = math.huge, 0, 0
+            for port = 6001, 6004 do
+              local t = backend:get("first:" .. port)
+              if t then
+                min = math.min(min, t)
+                max = math.max(max, t)
+                n = n + 1
+              end
+            end
+            ngx.say("checked ", n)
+            -- offsets of 127.0.0.1:6001-6004 in the 2s window are
+            -- 1429, 847, 1641 and 1450ms
+            ngx.say("spread ", max - min > 0.5)
+        }
+    }
+--- timeout: 4
+--- request
+    GET /test
+--- response_body
+checked 4
+spread true
+
+=== TEST 2: concurrency
+--- http_config
+    lua_load_resty_core off;
+    lua_shared_dict backend 1m;
+    upstream u1 {
+        zone shm-u1 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:6003;
+        server 127.0.0.1:6004;
+        check type=http fall=1 rise=1 timeout=1500 interval=1 concurrency=1;
+        check_request_uri GET /heartbeat;
+        check_response_codes 200;
+    }
+    server {
+      listen 6001;
+      listen 6002;
+      listen 6003;
+      listen 6004;
+      location /heartbeat {
+        content_by_lua_block {
+          local backend = ngx.shared.backend
+          local n = backend:incr("active", 1, 0)
+          if n > (backend:get("max") or 0) then
+            backend:set("max", n)
+          end
+          backend:incr("checks", 1, 0)
+          ngx.sleep(0.1)
+          backend:incr("active", -1)
+          ngx.say("pong")
+        }
+      }
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local backend = ngx.shared.backend
+            ngx.sleep(1.5)
+            ngx.say("checked ", backend:get("checks") >= 4)
+            ngx.say("max ", backend:get("max"))
+        }
+    }
+--- timeout: 3
+--- request
+    GET /test
+--- response_body
+checked true
+max 1
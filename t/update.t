@@ -156,3 +156,41 @@ u1 100 200 4000 1
 ping pong
 
 
+
+
+=== TEST 3: healthcheck update interval in milliseconds
+--- http_config
+    lua_load_resty_core off;
+    upstream u1 {
+        zone shm-u1 128k;
+        server 127.0.0.1:6001;
+        check type=http fall=2 rise=1 timeout=1500 interval=500ms;
+        check_request_uri GET /heartbeat;
+        check_response_codes 200;
+    }
+--- config
+    location /get {
+      healthcheck_get;
+    }
+    location /update {
+      healthcheck_update;
+    }
+    location /test {
+        content_by_lua_block {
+            local cjson = require "cjson"
+            local resp = assert(ngx.location.capture("/get"))
+            ngx.say(cjson.decode(resp.body).u1.interval)
+            assert(ngx.location.capture("/update?upstream=u1&interval=2"))
+            resp = assert(ngx.location.capture("/get"))
+            ngx.say(cjson.decode(resp.body).u1.interval)
+            assert(ngx.location.capture("/update?upstream=u1&interval=250ms"))
+            resp = assert(ngx.location.capture("/get"))
+            ngx.say(cjson.decode(resp.body).u1.interval)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+0.5
+2
+0.25